@@ -33,6 +33,8 @@ import glob
 import json
 import math
 import os
+import struct
+import subprocess
 import sys
 
 from builtins import bytes
@@ -65,6 +67,102 @@ def binary_data(string):
     return bytes(data)
 
 
+def varint(value):
+    """
+    Encode a non-negative integer as a LEB128 varint.
+    """
+    data = []
+    while value >= 0x80:
+        data.append(value & 0x7f | 0x80)
+        value >>= 7
+    data.append(value)
+
+    return data
+
+
+def sparse_data(string):
+    """
+    Takes a python string '0100000000000001' and converts it to a sparse trace:
+    the magic number, the size of the equivalent bit vector trace, the number
+    of blocks hit and the gaps between the blocks.
+    """
+    blocks = [i for i, bit in enumerate(string) if bit == '1']
+    data = varint(int(math.ceil(len(string) / 8))) + varint(len(blocks))
+    previous = -1
+    for block in blocks:
+        data.extend(varint(block - previous))
+        previous = block
+
+    return b'MLSPARSE' + bytes(data)
+
+
+def sancov_data(offsets, width):
+    """
+    Takes a list of offsets and converts it to a SanitizerCoverage file of
+    32 or 64-bit offsets (in the host byte order).
+    """
+    if width == 4:
+        return struct.pack('=Q{}I'.format(len(offsets)),
+                           0xC0BFFFFFFFFFFF32, *offsets)
+
+    return struct.pack('=Q{}Q'.format(len(offsets)),
+                       0xC0BFFFFFFFFFFF64, *offsets)
+
+
+def trace_data(data):
+    """
+    Convert a test exemplar's value into the bytes of its trace file.
+
+    Coverage files are given as the text of an afl-showmap map ('afl-text'),
+    the bytes of a binary map ('afl-binary') or a list of offsets ('sancov').
+    """
+    trace_format = data.get('format')
+    if trace_format == 'sparse':
+        return sparse_data(data['value'])
+    elif trace_format == 'afl-text':
+        return data['value'].encode('ascii')
+    elif trace_format == 'afl-binary':
+        return bytes(data['value'])
+    elif trace_format == 'sancov':
+        return sancov_data(data['value'], data.get('width', 8))
+
+    return binary_data(data['value'])
+
+
+def set_mtimes(corpus_dir, names, mtime):
+    """
+    Give the named files in the corpus directory the same modification time,
+    as if they had all been written in one clock tick.
+    """
+    for name in names:
+        os.utime(os.path.join(corpus_dir, name), ns=(mtime, mtime))
+
+
+def rewrite_corpus(corpus_dir, rewrite_data):
+    """
+    Overwrite exemplars after the matrix cache has been written, moving each
+    one's modification time on by its 'mtime_ns'.
+    """
+    for exemplar, data in rewrite_data.items():
+        exemplar_path = os.path.join(corpus_dir, exemplar)
+        stat = os.stat(exemplar_path)
+        with open(exemplar_path, 'wb') as corpus_file:
+            corpus_file.write(trace_data(data))
+        mtime = stat.st_mtime_ns + data.get('mtime_ns', 0)
+        os.utime(exemplar_path, ns=(stat.st_atime_ns, mtime))
+
+
+def damage_cache(corpus_dir):
+    """
+    Overwrite 64 bytes in the middle of the matrix cache, as a damaged disk
+    or an interrupted copy might.
+    """
+    cache_path = os.path.join(corpus_dir, 'moonlight.matrix')
+    with open(cache_path, 'r+b') as cache_file:
+        cache_file.seek(os.path.getsize(cache_path) // 2)
+        cache_file.write(b'\xff' * 64)
+
+
 def write_corpus(corpus_dir, corpus_data):
     """
     Take an exemplar_name to exemplar_data dictionary and write them into the
@@ -85,6 +183,19 @@ def write_weights(corpus_dir, test_name, corpus_data):
             test_file.write('{} {}\n'.format(exemplar, data['weight']))
 
 
+def pack_corpus(moonlight_cmd, pack_path):
+    """
+    Run MoonLight with the given command list to write the corpus to a corpus
+    pack instead of solving it. Returns the error MoonLight gave, if any.
+    """
+    moonlight = subprocess.Popen(moonlight_cmd + ['--pack', pack_path],
+                                 stdout=subprocess.PIPE,
+                                 stderr=subprocess.PIPE)
+    _, stderr = moonlight.communicate()
+
+    return stderr
+
+
 def parse_args():
     """
     Parse command-line arguments.
@@ -92,6 +203,12 @@ def parse_args():
     parser = argparse.ArgumentParser(description='Run MoonLight unit tests.')
     parser.add_argument('-m', '--moonlight-path', required=True,
                         help='Path to the MoonLight executable')
+    parser.add_argument('-a', '--moonlight-arg', action='append', default=[],
+                        help='Extra argument to run every test with, such as '
+                             '-a=--order-columns. Can be repeated')
+    parser.add_argument('-p', '--packed', action='store_true',
+                        help='Pack each test corpus (and its weights) with '
+                             '--pack and solve the pack with -p instead')
 
     return parser.parse_args()
 
@@ -103,7 +220,7 @@ def main():
     # Parse command-line arguments
     args = parse_args()
 
-    tests_passed = False
+    tests_passed = True
     for test_path in glob.glob(os.path.join(UNIT_TESTS_DIR, '*.json')):
         test_name = os.path.basename(test_path)
         print('Running unit test "{}"...'.format(test_name), end=' ')
@@ -116,13 +233,16 @@ def main():
         test_data['corpus'] = {exemplar: data for exemplar, data in test_data['corpus'].items()
                                if data['weight'] >= 0}
 
-        # Format the test data dict and bulk it up with the required values
-        value_lens = [len(data['value']) for data in test_data['corpus'].values()]
-        test_data['num_basic_blocks'] = int(math.ceil(max(value_lens) / 8) * 8)
+        # Format the test data dict and bulk it up with the required values.
+        # Coverage file tests give the number of blocks, which depends on
+        # their format
+        if 'num_basic_blocks' not in test_data:
+            value_lens = [len(data['value']) for data in test_data['corpus'].values()]
+            test_data['num_basic_blocks'] = int(math.ceil(max(value_lens) / 8) * 8)
         test_data['corpus_size'] = len(test_data['corpus'])
 
         for exemplar, data in test_data['corpus'].items():
-            test_data['corpus'][exemplar]['value'] = binary_data(data['value'])
+            data['value'] = trace_data(data)
 
         # Run MoonLight in the context of a temporary directory, which ensures
         # that all MoonLight-produced files are automatically cleaned up at the
@@ -137,21 +257,60 @@ def main():
             else:
                 weights_file = None
 
-            # Run MoonLight
+            # Run MoonLight. Tests that rewrite exemplars or damage the cache
+            # run it twice, the first time to write the matrix cache the
+            # second run reads. With 'same_tick_cache' the exemplars and the
+            # cache share one time
+            rewrite = test_data.get('rewrite')
+            damage = test_data.get('damage_cache', False)
+            if (rewrite or damage) and args.packed:
+                print('SKIPPED (changes the corpus directory)')
+                continue
+            same_tick = test_data.get('same_tick_cache', False)
+            tick = os.stat(corpus_dir).st_mtime_ns
+            if same_tick:
+                set_mtimes(corpus_dir, test_data['corpus'], tick)
             moonlight_cmd = [args.moonlight_path, '-d', corpus_dir,
-                             '-r', 'exemplar_', '-i']
+                             '-r', 'exemplar_']
+            if not rewrite and not damage:
+                moonlight_cmd.append('-i')
             if test_data['algorithm'] == 'greedy':
                 moonlight_cmd.append('-g')
             if weights_file:
                 moonlight_cmd.extend(['-w', weights_file])
+            moonlight_cmd.extend(test_data.get('flags', []))
+            if args.packed:
+                # the pack holds the columns and weights, so it is solved
+                # without the weight file or the trace format flags
+                pack_path = os.path.join(corpus_dir, 'corpus.mlpack')
+                error = pack_corpus(moonlight_cmd, pack_path)
+                if error:
+                    print('MOONLIGHT ERROR: {}'.format(error))
+                    sys.exit(1)
+                moonlight_cmd = [args.moonlight_path, '-d', corpus_dir,
+                                 '-p', pack_path, '-i']
+                if test_data['algorithm'] == 'greedy':
+                    moonlight_cmd.append('-g')
+            moonlight_cmd.extend(args.moonlight_arg)
 
             results = run_moonlight(moonlight_cmd, corpus_dir, silent=True)
+            if rewrite and 'error' not in results:
+                if same_tick:
+                    set_mtimes(corpus_dir, ['moonlight.matrix'], tick)
+                rewrite_corpus(corpus_dir, rewrite)
+                results = run_moonlight(moonlight_cmd, corpus_dir,
+                                        silent=True)
+            if damage and 'error' not in results:
+                damage_cache(corpus_dir)
+                results = run_moonlight(moonlight_cmd, corpus_dir,
+                                        silent=True)
             if 'error' in results:
                 print('MOONLIGHT ERROR: {}'.format(results['error']))
                 sys.exit(1)
 
             # Compare the solutions to the expected test data
-            tests_passed = check_results(results, test_data)
+            if not check_results(results, test_data):
+                tests_passed = False
 
     # Set the return code
     sys.exit(not tests_passed)
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Word-at-a-time kernels for the packed dense row.
+ */
+
+#include <algorithm>
+
+#include "BitRow.h"
+
+using namespace std;
+
+const size_t BitRow::WORD_BITS;
+const size_t BitRow::npos;
+
+static inline size_t words_for(size_t bits) {
+    return (bits + BitRow::WORD_BITS - 1) / BitRow::WORD_BITS;
+}
+
+static inline size_t popcount(BitRow::WORD word) {
+    return __builtin_popcountll(word);
+}
+
+BitRow::BitRow() : num_bits(0), words(vector<WORD>()) {
+}
+
+BitRow::BitRow(size_t num_bits)
+    : num_bits(num_bits), words(vector<WORD>(words_for(num_bits), 0)) {
+}
+
+void BitRow::clear() {
+    fill(words.begin(), words.end(), 0);
+}
+
+void BitRow::resize(size_t bits) {
+    words.resize(words_for(bits), 0);
+    num_bits = bits;
+
+    // keep the invariant that bits beyond the end are zero
+    size_t tail = num_bits % WORD_BITS;
+    if (tail) {
+        words.back() &= (WORD(1) << tail) - 1;
+    }
+}
+
+size_t BitRow::count() const {
+    size_t result = 0;
+
+    for (WORD word : words) {
+        result += popcount(word);
+    }
+
+    return result;
+}
+
+size_t BitRow::count_and(const BitRow &other) const {
+    size_t n = min(words.size(), other.words.size());
+    size_t result = 0;
+
+    for (size_t w = 0; w < n; w++) {
+        result += popcount(words[w] & other.words[w]);
+    }
+
+    return result;
+}
+
+size_t BitRow::count_and_not(const BitRow &other) const {
+    size_t n = min(words.size(), other.words.size());
+    size_t result = 0;
+
+    for (size_t w = 0; w < n; w++) {
+        result += popcount(words[w] & ~other.words[w]);
+    }
+
+    // words the other row doesn't have are ANDed with NOT zero
+    for (size_t w = n; w < words.size(); w++) {
+        result += popcount(words[w]);
+    }
+
+    return result;
+}
+
+bool BitRow::intersects(const BitRow &other) const {
+    size_t n = min(words.size(), other.words.size());
+
+    for (size_t w = 0; w < n; w++) {
+        if (words[w] & other.words[w]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool BitRow::is_subset_of(const BitRow &other) const {
+    size_t n = min(words.size(), other.words.size());
+
+    for (size_t w = 0; w < n; w++) {
+        if (words[w] & ~other.words[w]) {
+            return false;
+        }
+    }
+
+    for (size_t w = n; w < words.size(); w++) {
+        if (words[w]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool BitRow::none() const {
+    for (WORD word : words) {
+        if (word) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+BitRow &BitRow::operator&=(const BitRow &other) {
+    size_t n = min(words.size(), other.words.size());
+
+    for (size_t w = 0; w < n; w++) {
+        words[w] &= other.words[w];
+    }
+
+    for (size_t w = n; w < words.size(); w++) {
+        words[w] = 0;
+    }
+
+    return *this;
+}
+
+BitRow &BitRow::operator|=(const BitRow &other) {
+    if (other.num_bits > num_bits) {
+        resize(other.num_bits);
+    }
+
+    for (size_t w = 0; w < other.words.size(); w++) {
+        words[w] |= other.words[w];
+    }
+
+    return *this;
+}
+
+BitRow &BitRow::and_not(const BitRow &other) {
+    size_t n = min(words.size(), other.words.size());
+
+    for (size_t w = 0; w < n; w++) {
+        words[w] &= ~other.words[w];
+    }
+
+    return *this;
+}
+
+size_t BitRow::find_first() const {
+    for (size_t w = 0; w < words.size(); w++) {
+        if (words[w]) {
+            return w * WORD_BITS + __builtin_ctzll(words[w]);
+        }
+    }
+
+    return npos;
+}
+
+size_t BitRow::find_next(size_t pos) const {
+    pos++;
+    if (pos >= num_bits) {
+        return npos;
+    }
+
+    size_t w = pos / WORD_BITS;
+    WORD word = words[w] & (~WORD(0) << (pos % WORD_BITS));
+
+    while (!word) {
+        if (++w >= words.size()) {
+            return npos;
+        }
+        word = words[w];
+    }
+
+    return w * WORD_BITS + __builtin_ctzll(word);
+}
+
+vector<int> BitRow::set_indices() const {
+    vector<int> result;
+    result.reserve(count());
+    for_each_set([&result](int c) { result.push_back(c); });
+
+    return result;
+}
+
+bool BitRow::operator==(const BitRow &other) const {
+    return (num_bits == other.num_bits) && (words == other.words);
+}
+
+bool BitRow::operator!=(const BitRow &other) const {
+    return !(*this == other);
+}
+
+bool BitRow::operator<(const BitRow &other) const {
+    if (num_bits != other.num_bits) {
+        return num_bits < other.num_bits;
+    }
+
+    return words < other.words;
+}
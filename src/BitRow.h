@@ -0,0 +1,185 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief A dense 0-1 row packed 64 bits to a machine word.
+ *
+ * Trace data is a bit vector on disk and most of the dense row operations we
+ * need (union, intersection, difference and counting) map directly onto
+ * word-wide logical operations and popcount. Expanding each bit into an
+ * integer, as we used to, costs 32 times the memory and walks every column
+ * one at a time.
+ */
+
+#ifndef BIT_ROW_H
+#define BIT_ROW_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * \brief A fixed size bit vector stored in 64-bit words.
+ *
+ * Bit i lives in word (i / 64) at bit position (i % 64) counting from the
+ * least significant bit. Bits at or beyond size() are always zero, which lets
+ * the binary kernels work a whole word at a time without masking the tail.
+ *
+ * The binary operations accept rows of different sizes. Missing words are
+ * treated as zero - the same convention DATA.md uses for truncated traces.
+ */
+class BitRow {
+public:
+    using WORD = std::uint64_t;
+
+    /** Number of bits in each storage word */
+    static const std::size_t WORD_BITS = 64;
+
+    /** Returned by the find methods when there is no further set bit */
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    /** Default constructor: an empty row */
+    BitRow();
+
+    /** Construct a row of num_bits zeros */
+    explicit BitRow(std::size_t num_bits);
+
+    /** Number of bits (columns) in the row */
+    std::size_t size() const {
+        return num_bits;
+    }
+
+    /** Number of storage words backing the row */
+    std::size_t num_words() const {
+        return words.size();
+    }
+
+    /** Direct access to the storage words */
+    const WORD *data() const {
+        return words.data();
+    }
+
+    /** Direct access to the storage words */
+    WORD *data() {
+        return words.data();
+    }
+
+    /** \return true iff bit i is set. Bits beyond size() read as zero. */
+    bool test(std::size_t i) const {
+        return (i < num_bits) &&
+               ((words[i / WORD_BITS] >> (i % WORD_BITS)) & 1);
+    }
+
+    /** Read only element access, equivalent to test() */
+    bool operator[](std::size_t i) const {
+        return test(i);
+    }
+
+    /** Set bit i. The caller must ensure i < size() */
+    void set(std::size_t i) {
+        words[i / WORD_BITS] |= (WORD(1) << (i % WORD_BITS));
+    }
+
+    /** Clear bit i. The caller must ensure i < size() */
+    void reset(std::size_t i) {
+        words[i / WORD_BITS] &= ~(WORD(1) << (i % WORD_BITS));
+    }
+
+    /** Clear every bit, keeping the size */
+    void clear();
+
+    /** Change the number of bits. New bits are zero. */
+    void resize(std::size_t num_bits);
+
+    /** Number of set bits (popcount) */
+    std::size_t count() const;
+
+    /** Number of set bits in (this AND other) */
+    std::size_t count_and(const BitRow &other) const;
+
+    /** Number of set bits in (this AND NOT other) */
+    std::size_t count_and_not(const BitRow &other) const;
+
+    /** \return true iff (this AND other) has any bit set */
+    bool intersects(const BitRow &other) const;
+
+    /** \return true iff every bit set in this row is also set in other */
+    bool is_subset_of(const BitRow &other) const;
+
+    /** \return true iff no bits are set */
+    bool none() const;
+
+    /** this = this AND other */
+    BitRow &operator&=(const BitRow &other);
+
+    /** this = this OR other. The row grows if other is larger. */
+    BitRow &operator|=(const BitRow &other);
+
+    /** this = this AND NOT other */
+    BitRow &and_not(const BitRow &other);
+
+    /** \return index of the lowest set bit or npos */
+    std::size_t find_first() const;
+
+    /** \return index of the lowest set bit greater than pos or npos */
+    std::size_t find_next(std::size_t pos) const;
+
+    /**
+     * \brief Call f(index) for each set bit in increasing index order.
+     *
+     * Zero words are skipped whole so the cost is proportional to the number
+     * of words plus the number of set bits, not the number of columns.
+     */
+    template <typename F> void for_each_set(F f) const {
+        for (std::size_t w = 0; w < words.size(); w++) {
+            WORD word = words[w];
+            while (word) {
+                f(static_cast<int>(w * WORD_BITS + __builtin_ctzll(word)));
+                word &= word - 1; // clear the lowest set bit
+            }
+        }
+    }
+
+    /** \return sorted list of the indices of all set bits */
+    std::vector<int> set_indices() const;
+
+    /** Rows are equal iff they have the same size and the same bits */
+    bool operator==(const BitRow &other) const;
+
+    bool operator!=(const BitRow &other) const;
+
+    /**
+     * \brief Strict weak ordering (size then storage words) so rows can be
+     * used as keys in ordered containers. It is not a numeric ordering.
+     */
+    bool operator<(const BitRow &other) const;
+
+private:
+    /** Number of bits in the row */
+    std::size_t num_bits;
+
+    /** Packed storage, (num_bits + 63) / 64 words */
+    std::vector<WORD> words;
+};
+
+#endif /* BIT_ROW_H */
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Delta varint encoding of column index lists.
+ */
+
+#include <stdexcept>
+
+#include "ColumnCodec.h"
+
+using namespace std;
+
+void encode_columns(const COL_DATA &columns, vector<unsigned char> &out) {
+    put_varint(columns.size(), out);
+
+    // the first gap is from -1 so a column list starting at 0 is legal
+    INDEX previous = -1;
+    for (INDEX column : columns) {
+        put_varint(column - previous, out);
+        previous = column;
+    }
+}
+
+void decode_columns(const unsigned char *&in, const unsigned char *end,
+                    uint64_t limit, const vector<int> &transform,
+                    COL_DATA &columns) {
+    uint64_t count;
+    if (!get_varint(in, end, count) ||
+        count > static_cast<uint64_t>(end - in)) {
+        throw runtime_error("Corrupt column list encoding");
+    }
+
+    columns.reserve(columns.size() + count);
+    uint64_t column = static_cast<uint64_t>(-1);
+    for (uint64_t i = 0; i < count; i++) {
+        // the bytes may come from a file, so a repeated or out of range
+        // column is refused before anyone indexes with it
+        uint64_t gap;
+        if (!get_varint(in, end, gap) || gap == 0 || gap > limit ||
+            (column += gap) >= limit) {
+            throw runtime_error("Corrupt column list encoding");
+        }
+
+        if (transform.empty()) {
+            columns.push_back(column);
+        } else if (column >= transform.size()) {
+            throw runtime_error("Column index beyond the column transform");
+        } else if (transform[column] != DELETED) {
+            columns.push_back(transform[column]);
+        }
+    }
+}
+
+uint64_t hash_columns(const COL_DATA &columns) {
+    // multiply-xorshift mixing of each index (as in splitmix64), chained
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ columns.size();
+    for (INDEX column : columns) {
+        hash ^= static_cast<uint32_t>(column);
+        hash *= 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 31;
+    }
+    hash *= 0x94D049BB133111EBULL;
+    hash ^= hash >> 29;
+
+    return hash ? hash : 1;
+}
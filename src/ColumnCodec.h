@@ -0,0 +1,170 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Compact byte encoding of sorted column index lists.
+ *
+ * A row's column indices are sorted and usually close together, so we store
+ * the count followed by the gaps between consecutive indices as LEB128
+ * varints: seven bits per byte, high bit set on all but the last byte. Most
+ * gaps fit in one byte, a quarter of the size of the in-memory COL_DATA.
+ * The matrix keeps the rows it stores as lists the same way, without the
+ * count (see Matrix).
+ */
+
+#ifndef COLUMN_CODEC_H
+#define COLUMN_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "moonlight.h"
+
+/**
+ * \brief Append a varint to a byte buffer.
+ */
+inline void put_varint(std::uint64_t value, std::vector<unsigned char> &out) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+/**
+ * \brief Read a varint.
+ *
+ * \param in the encoded bytes. Advanced past the varint on return
+ * \param end one past the last readable byte
+ * \param value the decoded value
+ * \return false if the varint runs past the end of the input
+ */
+inline bool get_varint(const unsigned char *&in, const unsigned char *end,
+                       std::uint64_t &value) {
+    value = 0;
+
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        unsigned char byte = *in++;
+        value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * \brief Number of bytes put_varint() takes for a value.
+ */
+inline std::size_t varint_size(std::uint64_t value) {
+    std::size_t bytes = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        bytes++;
+    }
+    return bytes;
+}
+
+/**
+ * \brief Write a varint over the bytes of a buffer, for rewriting an
+ * encoding in place.
+ *
+ * \param value the value
+ * \param out where to write it
+ * \return one past the last byte written
+ */
+inline unsigned char *write_varint(std::uint32_t value, unsigned char *out) {
+    while (value >= 0x80) {
+        *out++ = static_cast<unsigned char>(value) | 0x80;
+        value >>= 7;
+    }
+    *out++ = static_cast<unsigned char>(value);
+    return out;
+}
+
+/**
+ * \brief Read a varint of at most 32 bits that is known to be well formed,
+ * such as one this process wrote. Nothing is checked, which keeps the
+ * common one byte case to a load and a branch.
+ *
+ * \param in the encoded bytes. Advanced past the varint on return
+ * \return the decoded value
+ */
+inline std::uint32_t read_varint(const unsigned char *&in) {
+    std::uint32_t value = *in++;
+    if (value < 0x80) {
+        return value;
+    }
+
+    value &= 0x7F;
+    for (int shift = 7;; shift += 7) {
+        unsigned char byte = *in++;
+        value |= static_cast<std::uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+/**
+ * \brief Append the encoding of a sorted column list to a byte buffer.
+ *
+ * \param columns strictly increasing, non-negative column indices
+ * \param out buffer the encoding is appended to
+ */
+void encode_columns(const COL_DATA &columns, std::vector<unsigned char> &out);
+
+/**
+ * \brief Decode one column list written by encode_columns().
+ *
+ * Each index is pushed through the column transform (new = transform[old])
+ * as it is decoded and dropped if that is DELETED. An empty transform is the
+ * identity.
+ *
+ * \param in the encoded bytes. Advanced past the column list on return
+ * \param end one past the last readable byte
+ * \param limit every column index must be below this, normally 8 times the
+ * trace size
+ * \param transform column index transform
+ * \param columns column list the indices are appended to
+ * \throws runtime_error if the encoding is truncated, repeats a column or
+ * has one at or beyond the limit
+ */
+void decode_columns(const unsigned char *&in, const unsigned char *end,
+                    std::uint64_t limit, const std::vector<int> &transform,
+                    COL_DATA &columns);
+
+/**
+ * \brief A 64-bit hash of a column list.
+ *
+ * Used to recognise a trace we've seen before, whatever form it was stored
+ * in. Not cryptographic.
+ *
+ * \param columns the column indices
+ * \return the hash. Never zero, so zero can mean "unknown"
+ */
+std::uint64_t hash_columns(const COL_DATA &columns);
+
+#endif /* COLUMN_CODEC_H */
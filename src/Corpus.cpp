@@ -29,17 +29,33 @@
  * \date Feb 2017
  */
 
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <string>
 #include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/log/utility/setup/file.hpp>
 #include <boost/regex.hpp> // don't use g++ -std11 regex!!!
 
+#include "ColumnCodec.h"
 #include "Corpus.h"
+#include "Parallel.h"
+#include "TraceDecode.h"
+#include "TraceReader.h"
 #include "moonlight.h"
 
 using namespace std;
@@ -50,112 +66,564 @@ namespace src = boost::log::sources;
 // Corpus File Implementation
 ///////////////////////////////////////////////////////////////////////
 
-CorpusFile::CorpusFile(path f, int size) : file_path(f), file_size(size) {
+CorpusFile::CorpusFile(path f, int size, int64_t modified, uint64_t inode)
+    : file_path(f), file_size(size), modified(modified), inode(inode) {
 }
 
 CorpusFile::CorpusFile() : CorpusFile(path(""), 0) {
 }
 
+///////////////////////////////////////////////////////////////////////
+// Trace Data Implementation
+///////////////////////////////////////////////////////////////////////
+
+const size_t TraceData::MMAP_THRESHOLD;
+
+TraceData::TraceData()
+    : bytes(nullptr), length(0), mapping(nullptr),
+      buffer(vector<unsigned char>()) {
+}
+
+TraceData::TraceData(const path &exemplar) : TraceData() {
+    int fd = open(exemplar.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Unable to open trace file: " + exemplar.native());
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw runtime_error("Unable to stat trace file: " + exemplar.native());
+    }
+    length = info.st_size;
+
+    if (length >= MMAP_THRESHOLD) {
+        void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            // we decode front to back exactly once
+            madvise(addr, length, MADV_SEQUENTIAL);
+            mapping = addr;
+            bytes = static_cast<const unsigned char *>(addr);
+        }
+    }
+
+    if (!mapping) {
+        // small file (or the mapping failed): a single read into a buffer
+        buffer.resize(length);
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = read(fd, buffer.data() + done, length - done);
+            if (n <= 0) {
+                close(fd);
+                throw runtime_error("Unable to read trace file: " +
+                                    exemplar.native());
+            }
+            done += n;
+        }
+        bytes = buffer.data();
+    }
+
+    close(fd);
+}
+
+TraceData::TraceData(vector<unsigned char> &&contents) : TraceData() {
+    buffer = std::move(contents);
+    bytes = buffer.data();
+    length = buffer.size();
+}
+
+TraceData::TraceData(TraceData &&orig) noexcept
+    : bytes(orig.bytes), length(orig.length), mapping(orig.mapping),
+      buffer(std::move(orig.buffer)) {
+    orig.bytes = nullptr;
+    orig.length = 0;
+    orig.mapping = nullptr;
+}
+
+TraceData &TraceData::operator=(TraceData &&rhs) noexcept {
+    // protect against self assignment
+    if (this != &rhs) {
+        release();
+        bytes = rhs.bytes;
+        length = rhs.length;
+        mapping = rhs.mapping;
+        buffer = std::move(rhs.buffer);
+        rhs.bytes = nullptr;
+        rhs.length = 0;
+        rhs.mapping = nullptr;
+    }
+
+    return *this;
+}
+
+TraceData::~TraceData() {
+    release();
+}
+
+void TraceData::release() {
+    if (mapping) {
+        munmap(mapping, length);
+        mapping = nullptr;
+    }
+    buffer.clear();
+    bytes = nullptr;
+    length = 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Corpus Reader Implementations
+///////////////////////////////////////////////////////////////////////
+
+CorpusReader::~CorpusReader() {
+}
+
+ROW CorpusReader::read_row(int i) const {
+    COL_DATA columns;
+    read_columns(i, vector<int>(), columns);
+
+    ROW row(8 * trace_bytes(i));
+    for (INDEX c : columns) {
+        row.set(c);
+    }
+
+    return row;
+}
+
+void CorpusReader::read_batch(const vector<int> &traces,
+                              const vector<int> &transform,
+                              vector<COL_DATA> &columns,
+                              int num_threads) const {
+    columns.assign(traces.size(), COL_DATA());
+    parallel_for(0, traces.size(), num_threads, [&](int k) {
+        read_columns(traces[k], transform, columns[k]);
+    });
+}
+
+int CorpusReader::trace_bytes(int i) const {
+    return corpus[i].file_size;
+}
+
+uint64_t CorpusReader::trace_hash(int i) const {
+    return 0;
+}
+
+DirectoryCorpus::DirectoryCorpus(const path &directory, const string &pattern,
+                                 int num_threads) {
+    src::severity_logger<> &mylog = my_logger::get();
+    BOOST_LOG(mylog) << "Finding files at path: " << directory
+                     << " with pattern: " << pattern;
+
+    corpus = get_file_list(directory, pattern, num_threads);
+    sizes.assign(corpus.size(), -1);
+}
+
+DirectoryCorpus::DirectoryCorpus(const path &directory, const path &list_file,
+                                 int num_threads) {
+    src::severity_logger<> &mylog = my_logger::get();
+    BOOST_LOG(mylog) << "Reading the corpus file list " << list_file;
+
+    corpus = read_file_list(directory, list_file, num_threads);
+    sizes.assign(corpus.size(), -1);
+}
+
+/**
+ * \brief The size of a trace file that hasn't been read (see trace_size()).
+ *
+ * Only a sparse trace's size differs from its file size, and that is in its
+ * header, so just the first few bytes are read.
+ *
+ * \throws runtime_error if the file is a corrupt sparse trace
+ */
+static int probe_trace_size(const CorpusFile &file) {
+    if (file.file_size < (int) SPARSE_TRACE_MAGIC_LENGTH) {
+        return file.file_size;
+    }
+
+    unsigned char header[TRACE_HEADER_LENGTH];
+    int fd = open(file.file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        // reading the trace will fail and say so
+        return file.file_size;
+    }
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    close(fd);
+    if (n <= 0) {
+        return file.file_size;
+    }
+
+    try {
+        return trace_size(header, n, file.file_size);
+    } catch (const runtime_error &) {
+        throw runtime_error("Corrupt sparse trace: " +
+                            file.file_path.native());
+    }
+}
+
+/**
+ * \brief Decode the contents of a corpus file, naming the file if it's
+ * corrupt.
+ *
+ * \return the size of the trace (see trace_size())
+ */
+static int decode_corpus_file(const CorpusFile &file, const TraceData &trace,
+                              const vector<int> &transform,
+                              COL_DATA &columns) {
+    try {
+        decode_trace_file(trace.data(), trace.size(), transform, columns);
+        return trace_size(trace.data(), trace.size(), trace.size());
+    } catch (const runtime_error &error) {
+        throw runtime_error(string(error.what()) + ": " +
+                            file.file_path.native());
+    }
+}
+
+void DirectoryCorpus::read_columns(int i, const vector<int> &transform,
+                                   COL_DATA &columns) const {
+    TraceData trace(corpus[i].file_path);
+
+    sizes[i] = decode_corpus_file(corpus[i], trace, transform, columns);
+}
+
+void DirectoryCorpus::read_batch(const vector<int> &traces,
+                                 const vector<int> &transform,
+                                 vector<COL_DATA> &columns,
+                                 int num_threads) const {
+    columns.assign(traces.size(), COL_DATA());
+    read_trace_files(corpus, traces, num_threads,
+                     [&](int k, const TraceData &trace) {
+                         int i = traces[k];
+                         sizes[i] = decode_corpus_file(corpus[i], trace,
+                                                       transform, columns[k]);
+                     });
+}
+
+int DirectoryCorpus::trace_bytes(int i) const {
+    if (sizes[i] < 0) {
+        sizes[i] = probe_trace_size(corpus[i]);
+    }
+
+    return sizes[i];
+}
+
+/** Spill bytes are written out in chunks of about this size */
+static const size_t SPILL_CHUNK = 4 * 1024 * 1024;
+
+CorpusSpill::CorpusSpill(const CorpusReader &source) : CorpusSpill() {
+    corpus = source.files();
+    offset.assign(corpus.size(), 0);
+    size.assign(corpus.size(), 0);
+}
+
+CorpusSpill::CorpusSpill() : fd(-1), length(0), mapping(nullptr) {
+    string name = (temp_directory_path() / "moonlight-XXXXXX.spill").native();
+    vector<char> name_buf(name.begin(), name.end());
+    name_buf.push_back('\0');
+    fd = mkstemps(name_buf.data(), 6);
+    if (fd < 0) {
+        throw runtime_error("Unable to create spill file: " + name);
+    }
+    // nobody else needs to see it, and it goes away however we exit
+    unlink(name_buf.data());
+}
+
+CorpusSpill::~CorpusSpill() {
+    if (mapping) {
+        munmap(mapping, length);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void CorpusSpill::store(int i, const COL_DATA &columns, int bytes) {
+    assert(!mapping);
+    corpus[i].file_size = bytes;
+
+    size_t before = pending.size();
+    encode_columns(columns, pending);
+    offset[i] = length;
+    size[i] = pending.size() - before;
+    length += size[i];
+
+    if (pending.size() >= SPILL_CHUNK) {
+        flush();
+    }
+}
+
+void CorpusSpill::append(const CorpusFile &file, const COL_DATA &columns) {
+    corpus.push_back(file);
+    offset.push_back(0);
+    size.push_back(0);
+    store(corpus.size() - 1, columns, file.file_size);
+}
+
+void CorpusSpill::flush() {
+    size_t done = 0;
+    while (done < pending.size()) {
+        ssize_t n = write(fd, pending.data() + done, pending.size() - done);
+        if (n <= 0) {
+            throw runtime_error("Unable to write spill file. Out of space in "
+                                "the temporary directory?");
+        }
+        done += n;
+    }
+    pending.clear();
+}
+
+void CorpusSpill::finish() {
+    flush();
+    vector<unsigned char>().swap(pending);
+
+    if (length > 0) {
+        void *addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            throw runtime_error("Unable to map spill file");
+        }
+        mapping = addr;
+    }
+}
+
+void CorpusSpill::read_columns(int i, const vector<int> &transform,
+                               COL_DATA &columns) const {
+    if (size[i] == 0) {
+        return;
+    }
+    assert(mapping);
+
+    const unsigned char *in = static_cast<const unsigned char *>(mapping);
+    in += offset[i];
+    uint64_t limit = 8 * static_cast<uint64_t>(corpus[i].file_size);
+    decode_columns(in, in + size[i], limit, transform, columns);
+}
+
 ///////////////////////////////////////////////////////////////////////
 // Utility Function Declarations
 ///////////////////////////////////////////////////////////////////////
 
-vector<CorpusFile> get_file_list(const path &directory, const string &pattern) {
+/** Directory entries are read from the kernel this many bytes at a time */
+static const size_t DIRENT_BUFFER = 1024 * 1024;
+
+/** The fixed part of a getdents64() record. The name follows d_type */
+struct DirentHeader {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+};
+
+/**
+ * \brief Find the literal text every match of a corpus pattern must contain.
+ *
+ * The default pattern (and most in practice) is plain text, which a substring
+ * search matches far faster than the regex engine.
+ *
+ * \param pattern the regex
+ * \param whole set to true iff the pattern is all literal text, so matching
+ * the literal is matching the pattern
+ * \return a literal prefix of the pattern that any match contains. Empty if
+ * there isn't one
+ */
+static string required_literal(const string &pattern, bool &whole) {
+    size_t end = pattern.find_first_of("\\^$.|?*+()[]{}");
+    whole = (end == string::npos);
+    if (whole) {
+        return pattern;
+    }
+
+    // alternation means no text is required, and a quantifier may make the
+    // last character of the prefix optional
+    if (pattern.find('|') != string::npos) {
+        return string();
+    }
+    string prefix = pattern.substr(0, end);
+    if (!prefix.empty() && (pattern[end] == '?' || pattern[end] == '*' ||
+                            pattern[end] == '{')) {
+        prefix.pop_back();
+    }
+
+    return prefix;
+}
+
+/**
+ * \brief Look up the size, modification time and inode of the named files.
+ *
+ * The statx() calls are independent metadata lookups, slow on network file
+ * systems, so they are issued from several threads at once. No file is
+ * opened, so a sparse trace is listed at its file size.
+ *
+ * \param dirfd directory relative names are looked up in
+ * \param location path of that directory
+ * \param names file names, relative or absolute
+ * \param must_exist throw if a name isn't an existing regular file, rather
+ * than leaving it out
+ * \param num_threads number of lookup threads. Zero for one per core
+ * \return the regular files, in the order named
+ */
+static vector<CorpusFile> stat_files(int dirfd, const path &location,
+                                     const vector<string> &names,
+                                     bool must_exist, int num_threads) {
+    vector<CorpusFile> files(names.size());
+    vector<char> found(names.size(), 0);
+
+    parallel_for(0, names.size(), resolve_num_threads(num_threads),
+                 [&](int i) {
+                     struct statx info;
+                     if (statx(dirfd, names[i].c_str(), AT_STATX_DONT_SYNC,
+                               STATX_TYPE | STATX_SIZE | STATX_MTIME |
+                                   STATX_INO,
+                               &info) == 0 &&
+                         S_ISREG(info.stx_mode)) {
+                         path name(names[i]);
+                         files[i] = CorpusFile(
+                             name.is_absolute() ? name : location / name,
+                             info.stx_size,
+                             info.stx_mtime.tv_sec * NANOSECONDS +
+                                 info.stx_mtime.tv_nsec,
+                             info.stx_ino);
+                         found[i] = 1;
+                     } else if (must_exist) {
+                         throw runtime_error("Not a corpus file: " +
+                                             names[i]);
+                     }
+                 });
+
+    vector<CorpusFile> regular;
+    regular.reserve(files.size());
+    for (unsigned int i = 0; i < files.size(); i++) {
+        if (found[i]) {
+            regular.push_back(std::move(files[i]));
+        }
+    }
+
+    return regular;
+}
+
+/**
+ * \brief Open a corpus directory for statx() lookups, or throw.
+ */
+static int open_directory(const path &directory) {
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        // not file IO problems - user supplied data problems
+        cerr << "Does not exist or is not a directory:" << endl;
+        cerr << directory << endl;
+        throw runtime_error("Corpus directory does not exist.");
+    }
+
+    return fd;
+}
+
+vector<CorpusFile> get_file_list(const path &directory, const string &pattern,
+                                 int num_threads) {
     // use Boost REGEX not GNU G++ 2011 standard library!
     boost::regex r(pattern);
-    vector<CorpusFile> myfilelist;
+    bool literal_only;
+    string literal = required_literal(pattern, literal_only);
 
+    int fd = open_directory(directory);
+    vector<string> names;
     try {
-        if (exists(directory) && is_directory(directory)) {
-            // open each file
-            directory_iterator finished = directory_iterator();
-            directory_iterator dir_object = directory_iterator(directory);
-            while (dir_object != finished) {
-                path f = *dir_object;
-                // is it an ordinary file?
-                if (is_regular_file(f)) {
-                    // check if its a corpus file
-                    string fqfn(f.filename().native());
-                    if (boost::regex_search(fqfn, r)) {
-                        // create a new CorpusFile object
-                        int fsize = file_size(dir_object->path());
-                        CorpusFile exemplar(absolute(f), fsize);
-                        // add it to the list
-                        myfilelist.push_back(exemplar);
-                    }
+        // read the entries in large batches, in directory order, and only
+        // keep names that could be corpus files. d_type lets us skip
+        // directories and the like without a lookup
+        vector<char> buffer(DIRENT_BUFFER);
+        for (;;) {
+            long n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+            if (n < 0) {
+                throw runtime_error(
+                    "Problem processing the corpus data. File IO problems?");
+            }
+            if (n == 0) {
+                break;
+            }
+
+            for (long pos = 0; pos < n;) {
+                DirentHeader entry;
+                size_t header = offsetof(DirentHeader, d_type) + 1;
+                memcpy(&entry, &buffer[pos], header);
+                const char *name = &buffer[pos + header];
+                pos += entry.d_reclen;
+
+                if (entry.d_type != DT_REG && entry.d_type != DT_LNK &&
+                    entry.d_type != DT_UNKNOWN) {
+                    continue;
                 }
-                dir_object++;
+                if (!literal.empty() && !strstr(name, literal.c_str())) {
+                    continue;
+                }
+                if (!literal_only && !boost::regex_search(name, r)) {
+                    continue;
+                }
+                names.push_back(name);
             }
-        } else {
-            // not file IO problems - user supplied data problems
-            cerr << "Does not exist or is not a directory:" << endl;
-            cerr << directory << endl;
-            throw runtime_error("Corpus directory does not exist.");
         }
-    } catch (const filesystem_error &ex) {
-        // for IO problems
-        throw runtime_error(
-            "Problem processing the corpus data. File IO problems?");
-        cerr << ex.what() << endl;
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    vector<CorpusFile> myfilelist;
+    try {
+        // entries can vanish between listing and lookup, so missing files
+        // are just left out
+        myfilelist = stat_files(fd, absolute(directory), names, false,
+                                num_threads);
+    } catch (...) {
+        close(fd);
+        throw;
     }
+    close(fd);
 
     return myfilelist;
 }
 
-ROW get_exemplar_data(const path &exemplar) {
-    int bytes = file_size(exemplar);
-    ROW result(8 * bytes, 0);
-    string fname = absolute(exemplar).native();
-
-    int col = 0;
-    char x; // signed in gnu g++
-
-    std::ifstream input(fname, std::ifstream::in | std::ifstream::binary);
-
-    for (int b = 0; b < bytes; b++) {
-        // we need to use 'ifstream.get()' method to read a byte at a time but
-        // there is no unsigned char read method. Hence the jiggery pokery with
-        // casts below...
-        input.get(x);
-        unsigned char datum = static_cast<unsigned char>(x);
-        unsigned char mask = 128; // binary 1000-0000
-
-        // we need to expand the bit compression encoding into a byte level
-        // representation
-        for (int i = 0; i < 8; i++) {
-            int value = ((datum & mask) > 0) ? 1 : 0;
-            result[col] = value;
-            col++;
-            mask >>= 1;
+vector<CorpusFile> read_file_list(const path &directory, const path &list_file,
+                                  int num_threads) {
+    std::ifstream in(list_file.native());
+    if (!in) {
+        throw runtime_error("Unable to read corpus file list: " +
+                            list_file.native());
+    }
+
+    vector<string> names;
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            names.push_back(line);
         }
     }
-    input.close();
 
-    return result;
+    int fd = open_directory(directory);
+    vector<CorpusFile> myfilelist;
+    try {
+        myfilelist = stat_files(fd, absolute(directory), names, true,
+                                num_threads);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    return myfilelist;
 }
 
-map<string, double> get_weight_data(const path &weight_file) {
-    src::severity_logger<> &mylog = my_logger::get();
-    map<string, double> weight_map;
-    string line;
-    std::ifstream f(weight_file.string(), std::ifstream::in);
-
-    while (getline(f, line)) {
-        // convert line to a string stream for easy parsing
-        istringstream ss(line);
-        string name;
-        double weight;
-
-        if (!(ss >> name >> weight)) {
-            BOOST_LOG(mylog)
-                << "Bad format in exemplar weight file. Dying now.";
-            assert(!("Bad format in exemplar weight file. Dying now."));
-        }
+ROW get_exemplar_data(const path &exemplar) {
+    TraceData trace(exemplar);
+    if (!is_sparse_trace(trace.data(), trace.size())) {
+        return pack_trace(trace.data(), trace.size());
+    }
 
-        weight_map.insert(pair<string, double>(name, weight));
+    COL_DATA columns;
+    decode_trace_file(trace.data(), trace.size(), vector<int>(), columns);
+    ROW row(8 * trace_size(trace.data(), trace.size(), trace.size()));
+    for (INDEX c : columns) {
+        row.set(c);
     }
 
-    return weight_map;
+    return row;
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -32,13 +32,18 @@
 #ifndef CORPUS_H
 #define CORPUS_H
 
+#include <cstdint>
 #include <map>
+#include <string>
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
 
 #include "moonlight.h"
 
+/** Nanoseconds in a second, the unit of CorpusFile::modified */
+const std::int64_t NANOSECONDS = 1000000000;
+
 /**
  * \brief Utility class for corpus file management.
  *
@@ -48,7 +53,8 @@
  */
 class CorpusFile {
 public:
-    CorpusFile(boost::filesystem::path f, int size);
+    CorpusFile(boost::filesystem::path f, int size, std::int64_t modified = 0,
+               std::uint64_t inode = 0);
 
     /** Default constructor **/
     CorpusFile();
@@ -56,9 +62,26 @@ public:
     /** Path to the corpus file */
     boost::filesystem::path file_path;
 
-    /** Size of the file in bytes */
+    /**
+     * Size of the trace in bytes: the file size, or for a sparse trace the
+     * size of the equivalent bit vector. A corpus directory is listed
+     * without reading the traces, so it lists a sparse trace's file size
+     * (see CorpusReader::trace_bytes())
+     */
     int file_size;
 
+    /**
+     * Modification time of the file (nanoseconds since the epoch). 0 if
+     * unknown
+     */
+    std::int64_t modified;
+
+    /**
+     * Inode number of the file, 0 if unknown. Files in a directory mostly
+     * lie on disk in inode order, so reading in this order seeks least
+     */
+    std::uint64_t inode;
+
     /**
      * brief Two corpus file objects are equivalent iff their file path, index
      * and size are equivalent.
@@ -91,6 +114,313 @@ public:
     bool operator!=(const CorpusFile &other) const;
 };
 
+/**
+ * \brief The raw bytes of a single trace file.
+ *
+ * The whole file is brought into memory in one go rather than a byte at a
+ * time. Small traces (the vast majority in practice) are read with a single
+ * read() call into a private buffer. Larger traces are memory mapped so we
+ * don't pay for a copy through the page cache.
+ *
+ * Objects can be moved but not copied. The bytes remain valid for the
+ * lifetime of the object.
+ */
+class TraceData {
+public:
+    /** Traces of at least this many bytes are memory mapped */
+    static const std::size_t MMAP_THRESHOLD = 256 * 1024;
+
+    /** Default constructor: an empty trace */
+    TraceData();
+
+    /**
+     * \brief Read the trace file into memory.
+     *
+     * \param exemplar path to the trace file
+     * \throws runtime_error if the file can't be opened or read
+     */
+    explicit TraceData(const boost::filesystem::path &exemplar);
+
+    /**
+     * \brief Take over trace bytes that have already been read.
+     *
+     * \param contents the whole trace file
+     */
+    explicit TraceData(std::vector<unsigned char> &&contents);
+
+    TraceData(const TraceData &orig) = delete;
+    TraceData &operator=(const TraceData &rhs) = delete;
+
+    /** Move constructor */
+    TraceData(TraceData &&orig) noexcept;
+
+    /** Move assignment */
+    TraceData &operator=(TraceData &&rhs) noexcept;
+
+    ~TraceData();
+
+    /** Pointer to the first byte of the trace */
+    const unsigned char *data() const {
+        return bytes;
+    }
+
+    /** Size of the trace in bytes */
+    std::size_t size() const {
+        return length;
+    }
+
+private:
+    /** Release any mapping or buffer we hold */
+    void release();
+
+    /** Start of the trace bytes (into either the buffer or the mapping) */
+    const unsigned char *bytes;
+
+    /** Number of trace bytes */
+    std::size_t length;
+
+    /** Non-null iff the bytes are memory mapped */
+    void *mapping;
+
+    /** Storage for traces that are read rather than mapped */
+    std::vector<unsigned char> buffer;
+};
+
+/**
+ * \brief Traces are read in batches of at least this many, so plenty of
+ * trace file reads can be on the way at once (see CorpusReader::read_batch())
+ */
+const int TRACE_BATCH = 1024;
+
+/**
+ * \brief A collection of traces that can be decoded into matrix rows.
+ *
+ * The traces are listed up front (path and size) and decoded on demand by
+ * their index in that list. This lets the matrix be built the same way
+ * whether the traces come straight from a corpus directory or from an
+ * intermediate copy of a corpus we have already read.
+ *
+ * read_columns() may be called concurrently from several threads.
+ */
+class CorpusReader {
+public:
+    virtual ~CorpusReader();
+
+    /** The traces in the corpus, in no particular order */
+    const std::vector<CorpusFile> &files() const {
+        return corpus;
+    }
+
+    /**
+     * \brief Decode a trace into its sorted list of set column indices.
+     *
+     * \param i index of the trace in files()
+     * \param transform column index transform (new = transform[old]).
+     * Columns mapped to DELETED are dropped. An empty transform is the
+     * identity
+     * \param columns column list the indices are appended to
+     * \throws runtime_error if the trace can't be read
+     */
+    virtual void read_columns(int i, const std::vector<int> &transform,
+                              COL_DATA &columns) const = 0;
+
+    /**
+     * \brief Decode several traces, as read_columns() does for each.
+     *
+     * The traces are decoded concurrently, in no particular order. Readers
+     * that can have many traces on the way at once override this.
+     *
+     * \param traces indices of the traces in files()
+     * \param transform column index transform, as for read_columns()
+     * \param columns set to one column list per trace, in the order of
+     * traces
+     * \param num_threads number of threads
+     * \throws runtime_error if a trace can't be read
+     */
+    virtual void read_batch(const std::vector<int> &traces,
+                            const std::vector<int> &transform,
+                            std::vector<COL_DATA> &columns,
+                            int num_threads) const;
+
+    /**
+     * \brief Return the packed row of a trace: 8 times the trace size in
+     * bits, as get_exemplar_data() returns.
+     *
+     * \param i index of the trace in files()
+     */
+    ROW read_row(int i) const;
+
+    /**
+     * \brief The size in bytes of a trace as a bit vector (see
+     * ::trace_size()).
+     *
+     * This is the listed file_size, except that the size of a sparse trace
+     * in a corpus directory is in its header. That is read with the trace,
+     * so asking for the size of a trace that hasn't been read costs a look
+     * at its header.
+     *
+     * \param i index of the trace in files()
+     */
+    virtual int trace_bytes(int i) const;
+
+    /**
+     * \brief Return hash_columns() of a trace, if it is known without
+     * decoding the trace.
+     *
+     * \param i index of the trace in files()
+     * \return the hash, or zero if unknown
+     */
+    virtual std::uint64_t trace_hash(int i) const;
+
+protected:
+    /** The traces in the corpus */
+    std::vector<CorpusFile> corpus;
+};
+
+/**
+ * \brief The trace files in a corpus directory matching a regex.
+ *
+ * Every read_columns() call reads the trace file from disk. Listing only
+ * looks the files up, so the size of a sparse trace is learned when it is
+ * read, or from its header if asked for first (see trace_bytes()).
+ */
+class DirectoryCorpus : public CorpusReader {
+public:
+    /**
+     * \brief List the corpus files. No trace data is read yet.
+     *
+     * \param directory the corpus directory
+     * \param pattern regex selecting the trace files in the directory
+     * \param num_threads number of file lookup threads. Zero for one per core
+     * \throws runtime_error if the directory doesn't exist
+     */
+    DirectoryCorpus(const boost::filesystem::path &directory,
+                    const std::string &pattern, int num_threads = 1);
+
+    /**
+     * \brief List the corpus files named in a file list (see
+     * read_file_list()). No trace data is read yet.
+     *
+     * \param directory the corpus directory
+     * \param list_file the file list
+     * \param num_threads number of file lookup threads. Zero for one per core
+     * \throws runtime_error if the list can't be read or names a missing file
+     */
+    DirectoryCorpus(const boost::filesystem::path &directory,
+                    const boost::filesystem::path &list_file, int num_threads);
+
+    void read_columns(int i, const std::vector<int> &transform,
+                      COL_DATA &columns) const override;
+
+    /** The trace files are read together (see read_trace_files()) */
+    void read_batch(const std::vector<int> &traces,
+                    const std::vector<int> &transform,
+                    std::vector<COL_DATA> &columns,
+                    int num_threads) const override;
+
+    int trace_bytes(int i) const override;
+
+private:
+    /**
+     * Size of each trace, set when the trace is read. -1 if it hasn't been,
+     * and trace_bytes() then looks in the file's header. Only trace i's
+     * reader writes entry i
+     */
+    mutable std::vector<int> sizes;
+};
+
+/**
+ * \brief A compact copy of the column data of another corpus, kept in a
+ * temporary spill file.
+ *
+ * Large data mode needs the traces more than once but the corpus can be far
+ * bigger than memory. Rather than go back to the corpus directory each time,
+ * the traces are read once and their (original) column indices stored with
+ * encode_columns(), usually a fraction of the size of the raw traces. The
+ * spill lists the same files in the same order as its source, so the two
+ * are interchangeable.
+ *
+ * The spill file is created in the system temporary directory ($TMPDIR) and
+ * unlinked straight away, so it never outlives the process. Columns are
+ * stored with store() and can only be read back once finish() is called,
+ * which maps the spill into memory.
+ */
+class CorpusSpill : public CorpusReader {
+public:
+    /**
+     * \brief Create an empty spill for the traces of a corpus.
+     *
+     * \param source the corpus whose traces will be stored
+     * \throws runtime_error if the spill file can't be created
+     */
+    explicit CorpusSpill(const CorpusReader &source);
+
+    /**
+     * \brief Create an empty spill for traces that are listed as they are
+     * stored (see append()).
+     *
+     * \throws runtime_error if the spill file can't be created
+     */
+    CorpusSpill();
+
+    CorpusSpill(const CorpusSpill &orig) = delete;
+    CorpusSpill &operator=(const CorpusSpill &rhs) = delete;
+
+    ~CorpusSpill();
+
+    /**
+     * \brief Store the (untransformed) column indices of trace i. Traces that
+     * are never stored read back as empty.
+     *
+     * \param i index of the trace in files()
+     * \param columns the trace's column indices
+     * \param bytes the trace's size, as the source learned it reading the
+     * trace (see trace_bytes()). It replaces the listed size
+     * \throws runtime_error if the spill can't be written
+     */
+    void store(int i, const COL_DATA &columns, int bytes);
+
+    /**
+     * \brief Add a trace to the end of the list and store its (untransformed)
+     * column indices.
+     *
+     * \throws runtime_error if the spill can't be written
+     */
+    void append(const CorpusFile &file, const COL_DATA &columns);
+
+    /**
+     * \brief Stop storing and make the spill readable.
+     *
+     * \throws runtime_error if the spill can't be written or mapped
+     */
+    void finish();
+
+    void read_columns(int i, const std::vector<int> &transform,
+                      COL_DATA &columns) const override;
+
+private:
+    /** Write out the pending bytes */
+    void flush();
+
+    /** Spill file descriptor */
+    int fd;
+
+    /** Bytes stored but not written to the spill file yet */
+    std::vector<unsigned char> pending;
+
+    /** Number of bytes in the spill file (plus pending) */
+    std::uint64_t length;
+
+    /** Spill file offset of each trace's columns */
+    std::vector<std::uint64_t> offset;
+
+    /** Number of encoded bytes for each trace. Zero if not stored */
+    std::vector<std::uint64_t> size;
+
+    /** The spill file mapping, once finished */
+    void *mapping;
+};
+
 ///////////////////////////////////////////////////////////////////////
 // Utility Function Declarations
 ///////////////////////////////////////////////////////////////////////
@@ -100,37 +430,47 @@ public:
  *
  * The caller must provide a path to the directory containing the corpus files
  * and a regex string pattern specifying the pattern of the exemplar files in
- * the corpus.
+ * the corpus. The directory is read in large batches and the file sizes
+ * looked up concurrently. A pattern that is plain text is matched without
+ * the regex engine.
  *
  * \param path path to the corpus directory
  * \param pattern regex pattern specifying the corpus files
- * \return a vector of CorpusFile objects no particular ordering
+ * \param num_threads number of file lookup threads. Zero for one per core
+ * \return a vector of CorpusFile objects in directory order
  */
 std::vector<CorpusFile> get_file_list(const boost::filesystem::path &p,
-                                      const std::string &pattern);
+                                      const std::string &pattern,
+                                      int num_threads = 1);
 
 /**
- * \brief Return the row data associated with the exemplar file.
+ * \brief Get a vector of the corpus files named in a file list, without
+ * scanning the corpus directory.
  *
- * The resulting vector will contain ones and zeros denoting if the exemplar
- * file used the corresponding basic block or not.
+ * The list has one file name per line, relative to the corpus directory or
+ * absolute. Blank lines are skipped.
  *
- * \param exemplar_path path to the exemplar file
- * \return exemplar data
- * \todo could return UINT8 valarray instead of INT32 vector for performance
+ * \param directory path to the corpus directory
+ * \param list_file the file list
+ * \param num_threads number of file lookup threads. Zero for one per core
+ * \return a vector of CorpusFile objects in list order
+ * \throws runtime_error if the list can't be read or names a file that
+ * isn't there
  */
-ROW get_exemplar_data(const boost::filesystem::path &exemplar_path);
+std::vector<CorpusFile> read_file_list(const boost::filesystem::path &directory,
+                                       const boost::filesystem::path &list_file,
+                                       int num_threads);
 
 /**
- * \brief Return the data associated with a weight file.
+ * \brief Return the row data associated with the exemplar file.
  *
- * A weight file contains a mapping of an example file name to its weight
- * value.
+ * The resulting packed row has a bit set for each basic block the exemplar
+ * file used. Bit i of the row is bit i of the trace, so the row is 8 times
+ * the trace size in bytes (see trace_size()).
  *
- * \param weight_file path to the weights file
- * \return weights data
+ * \param exemplar_path path to the exemplar file
+ * \return exemplar data
  */
-std::map<std::string, double>
-get_weight_data(const boost::filesystem::path &weight_file);
+ROW get_exemplar_data(const boost::filesystem::path &exemplar_path);
 
 #endif /* CORPUS_H */
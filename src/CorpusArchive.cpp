@@ -0,0 +1,449 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Tar archive corpus reader.
+ */
+
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/lzma.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/regex.hpp>
+
+#include "CorpusArchive.h"
+#include "Parallel.h"
+#include "TraceDecode.h"
+
+using namespace std;
+using namespace boost::filesystem;
+namespace io = boost::iostreams;
+namespace src = boost::log::sources;
+
+/** Tar archives are made of blocks of this size */
+static const size_t TAR_BLOCK = 512;
+
+/** Buffer size for each stage of reading and decompressing an archive */
+static const size_t STREAM_BUFFER = 256 * 1024;
+
+/** Unpacked traces waiting to be decoded are limited to about this size */
+static const size_t QUEUE_LIMIT = 64 * 1024 * 1024;
+
+/** An archive member waiting to be decoded */
+struct ArchiveMember {
+    CorpusFile file;
+    vector<unsigned char> data;
+};
+
+/**
+ * \brief Hands archive members from the unpacking thread to the decoders.
+ *
+ * The unpacking thread blocks once QUEUE_LIMIT bytes are waiting, so a fast
+ * decompressor can't run far ahead of the decoders.
+ */
+class MemberQueue {
+public:
+    MemberQueue() : bytes(0), done(false), abandoned(false) {
+    }
+
+    /**
+     * \brief Queue a member. Returns false if the decoders have given up, in
+     * which case the unpacking thread should stop.
+     */
+    bool push(ArchiveMember &&member) {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this]() {
+            return abandoned || bytes < QUEUE_LIMIT || members.empty();
+        });
+        if (abandoned) {
+            return false;
+        }
+
+        bytes += member.data.size();
+        members.push_back(std::move(member));
+        changed.notify_all();
+
+        return true;
+    }
+
+    /** No more members. error is null if the archive was read successfully */
+    void close(exception_ptr error) {
+        lock_guard<mutex> guard(lock);
+        done = true;
+        failure = error;
+        changed.notify_all();
+    }
+
+    /** The decoders have given up */
+    void abandon() {
+        lock_guard<mutex> guard(lock);
+        abandoned = true;
+        changed.notify_all();
+    }
+
+    /**
+     * \brief Take the next batch of up to max members.
+     *
+     * \return false once every member has been taken
+     * \throws whatever stopped the unpacking thread
+     */
+    bool pop(vector<ArchiveMember> &batch, size_t max) {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this, max]() {
+            return done || members.size() >= max || bytes >= QUEUE_LIMIT;
+        });
+        if (failure) {
+            rethrow_exception(failure);
+        }
+
+        batch.clear();
+        while (!members.empty() && batch.size() < max) {
+            bytes -= members.front().data.size();
+            batch.push_back(std::move(members.front()));
+            members.pop_front();
+        }
+        changed.notify_all();
+
+        return !batch.empty();
+    }
+
+private:
+    mutex lock;
+    condition_variable changed;
+    deque<ArchiveMember> members;
+    size_t bytes;
+    bool done;
+    bool abandoned;
+    exception_ptr failure;
+};
+
+/**
+ * \brief Read a tar number field: octal text, or base 256 if the top bit of
+ * the first byte is set (GNU tar, for large values).
+ */
+static uint64_t tar_number(const char *field, size_t length) {
+    uint64_t value = 0;
+
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        value = static_cast<unsigned char>(field[0]) & 0x7F;
+        for (size_t i = 1; i < length; i++) {
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        }
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < length && (field[i] == ' ' || field[i] == '\0')) {
+        i++;
+    }
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (field[i] - '0');
+    }
+
+    return value;
+}
+
+/**
+ * \brief A tar text field, which is NUL terminated unless it fills the field.
+ */
+static string tar_text(const char *field, size_t length) {
+    return string(field, strnlen(field, length));
+}
+
+/**
+ * \brief Check a tar header block's checksum. Old tars summed signed bytes,
+ * so either sum is accepted.
+ */
+static bool tar_checksum_ok(const char *header) {
+    uint64_t expected = tar_number(header + 148, 8);
+    uint64_t sum = 0;
+    int64_t signed_sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        char c = (i >= 148 && i < 156) ? ' ' : header[i];
+        sum += static_cast<unsigned char>(c);
+        signed_sum += static_cast<signed char>(c);
+    }
+
+    return expected == sum || (int64_t) expected == signed_sum;
+}
+
+/**
+ * \brief Read exactly n bytes of the archive, or throw.
+ */
+static void read_archive(istream &in, char *bytes, size_t n,
+                         const path &archive) {
+    if (!in.read(bytes, n) || (size_t) in.gcount() != n) {
+        throw runtime_error("Truncated archive: " + archive.native());
+    }
+}
+
+/**
+ * \brief Skip n bytes of the archive, or throw.
+ */
+static void skip_archive(istream &in, uint64_t n, const path &archive) {
+    char scratch[64 * TAR_BLOCK];
+
+    while (n > 0) {
+        size_t chunk = min<uint64_t>(n, sizeof(scratch));
+        read_archive(in, scratch, chunk, archive);
+        n -= chunk;
+    }
+}
+
+/**
+ * \brief Pick out the path, size and mtime records of a pax extended header.
+ * Each record is "<length> <keyword>=<value>\n". The mtime is returned in
+ * nanoseconds.
+ */
+static void parse_pax(const string &records, string &name, int64_t &size,
+                      int64_t &mtime) {
+    size_t pos = 0;
+    while (pos < records.size()) {
+        size_t space = records.find(' ', pos);
+        if (space == string::npos) {
+            break;
+        }
+        size_t length = strtoull(records.c_str() + pos, nullptr, 10);
+        if (length == 0 || pos + length > records.size() ||
+            space + 2 > pos + length) {
+            break;
+        }
+
+        string record = records.substr(space + 1, pos + length - space - 2);
+        size_t equals = record.find('=');
+        if (equals != string::npos) {
+            string key = record.substr(0, equals);
+            string value = record.substr(equals + 1);
+            if (key == "path") {
+                name = value;
+            } else if (key == "size") {
+                size = strtoll(value.c_str(), nullptr, 10);
+            } else if (key == "mtime") {
+                // seconds, perhaps with a decimal fraction
+                char *fraction;
+                mtime = strtoll(value.c_str(), &fraction, 10) * NANOSECONDS;
+                if (*fraction == '.') {
+                    int64_t scale = NANOSECONDS;
+                    for (char *digit = fraction + 1;
+                         isdigit(*digit) && scale > 1; digit++) {
+                        scale /= 10;
+                        mtime += (*digit - '0') * scale;
+                    }
+                }
+            }
+        }
+        pos += length;
+    }
+}
+
+/**
+ * \brief Unpack the selected trace files in a (possibly compressed) tar
+ * archive onto the queue, in archive order.
+ */
+static void unpack_tar(const path &archive, const boost::regex &pattern,
+                       MemberQueue &queue) {
+    std::ifstream file(archive.native(), std::ifstream::binary);
+    if (!file) {
+        throw runtime_error("Unable to open archive: " + archive.native());
+    }
+
+    // recognise the compression by its magic number
+    unsigned char magic[6] = {};
+    file.read(reinterpret_cast<char *>(magic), sizeof(magic));
+    file.clear();
+    file.seekg(0);
+
+    io::filtering_istream in;
+    if (magic[0] == 0x1F && magic[1] == 0x8B) {
+        in.push(io::gzip_decompressor(), STREAM_BUFFER);
+    } else if (memcmp(magic, "\xFD" "7zXZ\0", 6) == 0) {
+        in.push(io::lzma_decompressor(), STREAM_BUFFER);
+    } else if (memcmp(magic, "\x28\xB5\x2F\xFD", 4) == 0) {
+        in.push(io::zstd_decompressor(), STREAM_BUFFER);
+    } else if (memcmp(magic, "BZh", 3) == 0) {
+        in.push(io::bzip2_decompressor(), STREAM_BUFFER);
+    }
+    in.push(file, STREAM_BUFFER);
+
+    path location = absolute(archive);
+    char header[TAR_BLOCK];
+    string long_name;
+    string pax_name;
+    int64_t pax_size = -1;
+    int64_t pax_mtime = -1;
+    while (true) {
+        read_archive(in, header, TAR_BLOCK, archive);
+
+        // the archive ends with zero blocks
+        if (header[0] == '\0' &&
+            memcmp(header, header + 1, TAR_BLOCK - 1) == 0) {
+            break;
+        }
+        if (!tar_checksum_ok(header)) {
+            throw runtime_error("Not a tar archive: " + archive.native());
+        }
+
+        char type = header[156];
+        uint64_t size = tar_number(header + 124, 12);
+        int64_t mtime = tar_number(header + 136, 12) * NANOSECONDS;
+        uint64_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+        // GNU long names and pax extended headers describe the next member
+        if (type == 'L' || type == 'x') {
+            string data(size, '\0');
+            read_archive(in, &data[0], size, archive);
+            skip_archive(in, padding, archive);
+            if (type == 'L') {
+                long_name = tar_text(data.data(), data.size());
+            } else {
+                parse_pax(data, pax_name, pax_size, pax_mtime);
+            }
+            continue;
+        }
+
+        string name;
+        if (!pax_name.empty()) {
+            name = pax_name;
+        } else if (!long_name.empty()) {
+            name = long_name;
+        } else {
+            name = tar_text(header, 100);
+            string prefix = tar_text(header + 345, 155);
+            if (memcmp(header + 257, "ustar", 5) == 0 && !prefix.empty()) {
+                name = prefix + "/" + name;
+            }
+        }
+        if (pax_size >= 0) {
+            size = pax_size;
+            padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+        }
+        if (pax_mtime >= 0) {
+            mtime = pax_mtime;
+        }
+        long_name.clear();
+        pax_name.clear();
+        pax_size = -1;
+        pax_mtime = -1;
+
+        bool regular = (type == '0' || type == '\0' || type == '7');
+        string member = path(name).filename().string();
+        if (!regular || member.empty() ||
+            !boost::regex_search(member, pattern)) {
+            skip_archive(in, size + padding, archive);
+            continue;
+        }
+        if (size > (uint64_t) numeric_limits<int>::max()) {
+            throw runtime_error("Trace too large in archive: " + name);
+        }
+
+        ArchiveMember trace;
+        trace.file = CorpusFile(location / name, size, mtime);
+        trace.data.resize(size);
+        read_archive(in, reinterpret_cast<char *>(trace.data.data()), size,
+                     archive);
+        try {
+            trace.file.file_size = trace_size(trace.data.data(), size, size);
+        } catch (const runtime_error &) {
+            throw runtime_error("Corrupt sparse trace in archive: " + name);
+        }
+        skip_archive(in, padding, archive);
+        if (!queue.push(std::move(trace))) {
+            return;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Archive Corpus Implementation
+///////////////////////////////////////////////////////////////////////
+
+ArchiveCorpus::ArchiveCorpus(const path &archive, const string &pattern,
+                             int num_threads) {
+    src::severity_logger<> &mylog = my_logger::get();
+    BOOST_LOG(mylog) << "Reading traces from archive: " << archive
+                     << " with pattern: " << pattern;
+
+    // use Boost REGEX not GNU G++ 2011 standard library!
+    boost::regex r(pattern);
+    MemberQueue queue;
+    thread unpacker([&archive, &r, &queue]() {
+        exception_ptr error;
+        try {
+            unpack_tar(archive, r, queue);
+        } catch (...) {
+            error = current_exception();
+        }
+        queue.close(error);
+    });
+
+    // traces are decoded in batches while the next ones are unpacked, and
+    // stored in archive order
+    num_threads = resolve_num_threads(num_threads);
+    const size_t batch_size = 100 * num_threads;
+    try {
+        vector<ArchiveMember> batch;
+        vector<COL_DATA> columns;
+        while (queue.pop(batch, batch_size)) {
+            columns.assign(batch.size(), COL_DATA());
+            parallel_for(0, batch.size(), num_threads,
+                         [&batch, &columns](int i) {
+                             decode_trace_file(batch[i].data.data(),
+                                               batch[i].data.size(),
+                                               vector<int>(), columns[i]);
+                         });
+
+            BOOST_LOG(mylog) << "File: " << spill.files().size() << ", "
+                             << batch.front().file.file_path.filename();
+            for (size_t i = 0; i < batch.size(); i++) {
+                spill.append(batch[i].file, columns[i]);
+            }
+        }
+    } catch (...) {
+        queue.abandon();
+        unpacker.join();
+        throw;
+    }
+    unpacker.join();
+    spill.finish();
+
+    corpus = spill.files();
+    BOOST_LOG(mylog) << "Read " << corpus.size() << " traces from the archive";
+}
+
+void ArchiveCorpus::read_columns(int i, const vector<int> &transform,
+                                 COL_DATA &columns) const {
+    spill.read_columns(i, transform, columns);
+}
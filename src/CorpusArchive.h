@@ -0,0 +1,76 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief A corpus read straight out of a tar archive.
+ *
+ * Corpora are usually shipped as compressed tar files (see the `data`
+ * directory). Extracting tens of thousands of tiny trace files just to read
+ * them back once can cost more than the distillation, so the traces are
+ * streamed out of the archive instead. Plain tar and gzip, bzip2, xz and
+ * zstd compressed tar are recognised by their magic numbers.
+ */
+
+#ifndef CORPUS_ARCHIVE_H
+#define CORPUS_ARCHIVE_H
+
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "Corpus.h"
+#include "moonlight.h"
+
+/**
+ * \brief The traces in a tar archive.
+ *
+ * A tar archive can only be read front to back, so the whole archive is read
+ * once up front. One thread decompresses and unpacks the archive while the
+ * calling thread (and num_threads - 1 helpers) decode the traces, which are
+ * kept in a CorpusSpill. The traces are listed as archive/member so their
+ * file names are the names of the archive members.
+ */
+class ArchiveCorpus : public CorpusReader {
+public:
+    /**
+     * \brief Read the traces in an archive.
+     *
+     * \param archive path to the archive
+     * \param pattern regex selecting the trace files by member file name
+     * \param num_threads number of decoding threads. Zero for one per core
+     * \throws runtime_error if the archive can't be read or isn't a tar
+     * archive
+     */
+    ArchiveCorpus(const boost::filesystem::path &archive,
+                  const std::string &pattern, int num_threads);
+
+    void read_columns(int i, const std::vector<int> &transform,
+                      COL_DATA &columns) const override;
+
+private:
+    /** The decoded traces */
+    CorpusSpill spill;
+};
+
+#endif /* CORPUS_ARCHIVE_H */
@@ -0,0 +1,407 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief AFL and SanitizerCoverage corpus readers.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "CorpusCoverage.h"
+#include "Parallel.h"
+#include "TraceReader.h"
+
+using namespace std;
+using namespace boost::filesystem;
+namespace src = boost::log::sources;
+
+/** Edges past this would make column indices overflow */
+static const uint64_t MAX_EDGE = numeric_limits<int>::max() / 8 - 1;
+
+/** Magic number of a sancov file of 64-bit offsets */
+static const uint64_t SANCOV_MAGIC_64 = 0xC0BFFFFFFFFFFF64ULL;
+
+/** Magic number of a sancov file of 32-bit offsets */
+static const uint64_t SANCOV_MAGIC_32 = 0xC0BFFFFFFFFFFF32ULL;
+
+TraceFormat parse_trace_format(const string &name) {
+    if (name == "bits") {
+        return TraceFormat::BIT_VECTOR;
+    } else if (name == "afl") {
+        return TraceFormat::AFL;
+    } else if (name == "afl-raw") {
+        return TraceFormat::AFL_RAW;
+    } else if (name == "sancov") {
+        return TraceFormat::SANCOV;
+    }
+
+    throw runtime_error("Unknown trace format: " + name +
+                        " (expected bits, afl, afl-raw or sancov)");
+}
+
+///////////////////////////////////////////////////////////////////////
+// AFL Maps
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief The AFL hit count bucket of a raw hit count, from 0 for a single hit
+ * to 7 for 128 or more.
+ */
+static int count_bucket(uint64_t count) {
+    if (count < 4) {
+        return count - 1;
+    } else if (count < 8) {
+        return 3;
+    } else if (count < 16) {
+        return 4;
+    } else if (count < 32) {
+        return 5;
+    } else if (count < 128) {
+        return 6;
+    }
+
+    return 7;
+}
+
+/**
+ * \brief The AFL hit count bucket of a count in a text map.
+ *
+ * afl-showmap writes the bucket numbers 1 to 8 rather than the counts, unless
+ * run with -r, so without raw counts up to 8 are bucket numbers already. A
+ * larger count can only be a raw one.
+ */
+static int text_bucket(uint64_t count, bool raw) {
+    if (!raw && count <= 8) {
+        return count - 1;
+    }
+
+    return count_bucket(count);
+}
+
+/**
+ * \brief Is the map in afl-showmap's text form? A binary map is mostly zero
+ * bytes, which never appear in a text map.
+ */
+static bool is_text_map(const unsigned char *map, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        unsigned char c = map[i];
+        if (!((c >= '0' && c <= '9') || c == ':' || c == '\n' || c == '\r' ||
+              c == ' ' || c == '\t')) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * \brief Decode afl-showmap text output: one "edge:count" line per edge.
+ *
+ * \return number of edges the trace covers, one past the highest edge hit
+ */
+static uint64_t decode_text_map(const unsigned char *map, size_t bytes,
+                                bool hit_counts, bool raw,
+                                COL_DATA &columns) {
+    const unsigned char *p = map;
+    const unsigned char *end = map + bytes;
+    uint64_t edges = 0;
+
+    // read a decimal number, which sticks at MAX_EDGE + 1 if it's bigger
+    auto number = [&p, end](uint64_t &value) {
+        const unsigned char *first = p;
+        value = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            value = min(10 * value + (*p - '0'), MAX_EDGE + 1);
+        }
+        return p > first;
+    };
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' ||
+                           *p == '\n')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        uint64_t edge;
+        uint64_t count;
+        if (!number(edge) || p == end || *p++ != ':' || !number(count)) {
+            throw runtime_error("Bad format in AFL map");
+        }
+        if (edge > MAX_EDGE) {
+            throw runtime_error("Edge number too large in AFL map");
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        columns.push_back(hit_counts ? 8 * edge + text_bucket(count, raw)
+                                     : edge);
+        edges = max(edges, edge + 1);
+    }
+
+    // afl-showmap lists the edges in order, but nothing depends on it
+    sort(columns.begin(), columns.end());
+    columns.erase(unique(columns.begin(), columns.end()), columns.end());
+
+    return edges;
+}
+
+/**
+ * \brief Decode an afl-showmap binary map: one byte per edge, holding one bit
+ * per hit count bucket, or the hit count itself (capped at 255) if raw.
+ *
+ * \return number of edges the map covers
+ */
+static uint64_t decode_binary_map(const unsigned char *map, size_t bytes,
+                                  bool hit_counts, bool raw,
+                                  COL_DATA &columns) {
+    if (bytes > MAX_EDGE + 1) {
+        throw runtime_error("AFL map too large");
+    }
+
+    for (size_t e = 0; e < bytes; e += sizeof(uint64_t)) {
+        // maps are mostly empty, so skip zero words
+        uint64_t word = 0;
+        size_t n = min(sizeof(word), bytes - e);
+        memcpy(&word, map + e, n);
+        if (!word) {
+            continue;
+        }
+
+        for (size_t b = e; b < e + n; b++) {
+            unsigned char buckets = map[b];
+            if (!buckets) {
+                continue;
+            }
+            if (!hit_counts) {
+                columns.push_back(b);
+                continue;
+            }
+            if (raw) {
+                columns.push_back(8 * b + count_bucket(buckets));
+                continue;
+            }
+            for (int k = 0; k < 8; k++) {
+                if (buckets & (1 << k)) {
+                    columns.push_back(8 * b + k);
+                }
+            }
+        }
+    }
+
+    return bytes;
+}
+
+void CoverageCorpus::read_afl(const vector<CorpusFile> &files,
+                              bool hit_counts, bool raw, int num_threads) {
+    src::severity_logger<> &mylog = my_logger::get();
+
+    const size_t batch_size = max<size_t>(TRACE_BATCH, 100 * num_threads);
+    vector<int> which;
+    for (size_t first = 0; first < files.size(); first += batch_size) {
+        size_t last = min(files.size(), first + batch_size);
+        vector<COL_DATA> columns(last - first);
+        vector<uint64_t> edges(last - first);
+        which.clear();
+        for (size_t i = first; i < last; i++) {
+            which.push_back(i);
+        }
+
+        read_trace_files(files, which, num_threads,
+                         [&](int k, const TraceData &map) {
+            try {
+                edges[k] =
+                    is_text_map(map.data(), map.size())
+                        ? decode_text_map(map.data(), map.size(), hit_counts,
+                                          raw, columns[k])
+                        : decode_binary_map(map.data(), map.size(),
+                                            hit_counts, raw, columns[k]);
+            } catch (const runtime_error &error) {
+                throw runtime_error(string(error.what()) + ": " +
+                                    files[which[k]].file_path.native());
+            }
+        });
+
+        BOOST_LOG(mylog) << "File: " << first << ", "
+                         << files[first].file_path.filename();
+        for (size_t i = first; i < last; i++) {
+            uint64_t e = edges[i - first];
+            CorpusFile trace = files[i];
+            trace.file_size = hit_counts ? e : (e + 7) / 8;
+            spill.append(trace, columns[i - first]);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// SanitizerCoverage Files
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Decode a sancov file into its sorted, distinct offsets.
+ *
+ * \param file the sancov file
+ * \param data its contents
+ * \param offsets set to the offsets
+ * \throws runtime_error if the file isn't a sancov file
+ */
+static void decode_sancov(const path &file, const TraceData &data,
+                          vector<uint64_t> &offsets) {
+    uint64_t magic = 0;
+    if (data.size() >= sizeof(magic)) {
+        memcpy(&magic, data.data(), sizeof(magic));
+    }
+
+    size_t width;
+    if (magic == SANCOV_MAGIC_64) {
+        width = 8;
+    } else if (magic == SANCOV_MAGIC_32) {
+        width = 4;
+    } else {
+        throw runtime_error("Not a sancov file: " + file.native());
+    }
+    if ((data.size() - sizeof(magic)) % width != 0) {
+        throw runtime_error("Corrupt sancov file: " + file.native());
+    }
+
+    offsets.clear();
+    for (size_t at = sizeof(magic); at < data.size(); at += width) {
+        if (width == 8) {
+            uint64_t offset;
+            memcpy(&offset, data.data() + at, width);
+            offsets.push_back(offset);
+        } else {
+            uint32_t offset;
+            memcpy(&offset, data.data() + at, width);
+            offsets.push_back(offset);
+        }
+    }
+    sort(offsets.begin(), offsets.end());
+    offsets.erase(unique(offsets.begin(), offsets.end()), offsets.end());
+}
+
+void CoverageCorpus::read_sancov(const vector<CorpusFile> &files,
+                                 int num_threads) {
+    src::severity_logger<> &mylog = my_logger::get();
+
+    // the first pass collects the distinct offsets, which the second pass
+    // numbers the offsets of each file by
+    vector<uint64_t> all;
+    const size_t batch_size = max<size_t>(TRACE_BATCH, 100 * num_threads);
+    vector<vector<uint64_t>> offsets(batch_size);
+    vector<int> which;
+    for (size_t first = 0; first < files.size(); first += batch_size) {
+        size_t last = min(files.size(), first + batch_size);
+        which.clear();
+        for (size_t i = first; i < last; i++) {
+            which.push_back(i);
+        }
+        read_trace_files(files, which, num_threads,
+                         [&](int k, const TraceData &data) {
+            decode_sancov(files[which[k]].file_path, data, offsets[k]);
+        });
+
+        size_t merged = all.size();
+        for (size_t i = first; i < last; i++) {
+            all.insert(all.end(), offsets[i - first].begin(),
+                       offsets[i - first].end());
+        }
+        sort(all.begin() + merged, all.end());
+        inplace_merge(all.begin(), all.begin() + merged, all.end());
+        all.erase(unique(all.begin(), all.end()), all.end());
+    }
+    if (all.size() > static_cast<size_t>(numeric_limits<int>::max())) {
+        throw runtime_error("Too many distinct sancov offsets");
+    }
+    BOOST_LOG(mylog) << "Found " << all.size()
+                     << " distinct offsets in the sancov files";
+
+    vector<COL_DATA> columns(batch_size);
+    for (size_t first = 0; first < files.size(); first += batch_size) {
+        size_t last = min(files.size(), first + batch_size);
+        which.clear();
+        for (size_t i = first; i < last; i++) {
+            which.push_back(i);
+        }
+        read_trace_files(files, which, num_threads,
+                         [&](int k, const TraceData &data) {
+            vector<uint64_t> &mine = offsets[k];
+            decode_sancov(files[which[k]].file_path, data, mine);
+            COL_DATA &cols = columns[k];
+            cols.clear();
+            // both lists are sorted, so search on from the last match
+            auto from = all.begin();
+            for (uint64_t offset : mine) {
+                from = lower_bound(from, all.end(), offset);
+                cols.push_back(from - all.begin());
+            }
+        });
+
+        BOOST_LOG(mylog) << "File: " << first << ", "
+                         << files[first].file_path.filename();
+        for (size_t i = first; i < last; i++) {
+            // a file's columns change when another file brings new offsets,
+            // so a cached row can never be trusted: forget the time
+            CorpusFile trace(files[i].file_path, (all.size() + 7) / 8);
+            spill.append(trace, columns[i - first]);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Coverage Corpus
+///////////////////////////////////////////////////////////////////////
+
+CoverageCorpus::CoverageCorpus(const vector<CorpusFile> &files,
+                               TraceFormat format, bool hit_counts,
+                               int num_threads) {
+    src::severity_logger<> &mylog = my_logger::get();
+
+    num_threads = resolve_num_threads(num_threads);
+    if (format == TraceFormat::AFL || format == TraceFormat::AFL_RAW) {
+        bool raw = format == TraceFormat::AFL_RAW;
+        BOOST_LOG(mylog) << "Reading " << files.size() << " AFL maps"
+                         << (raw ? " of raw counts" : "")
+                         << (hit_counts ? " with hit counts" : "");
+        read_afl(files, hit_counts, raw, num_threads);
+    } else {
+        assert(format == TraceFormat::SANCOV);
+        BOOST_LOG(mylog) << "Reading " << files.size() << " sancov files";
+        read_sancov(files, num_threads);
+    }
+    spill.finish();
+
+    corpus = spill.files();
+}
+
+void CoverageCorpus::read_columns(int i, const vector<int> &transform,
+                                  COL_DATA &columns) const {
+    spill.read_columns(i, transform, columns);
+}
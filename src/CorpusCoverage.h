@@ -0,0 +1,114 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief A corpus of fuzzer coverage files rather than MoonLight traces.
+ *
+ * Coverage guided fuzzers can already describe what each seed covers, so
+ * their output is read directly instead of being converted to bit vectors
+ * first:
+ *
+ * * __afl__: afl-showmap output, either the text form (one `edge:count` line
+ *   per edge hit) or the binary form written with `-b` (one byte per edge).
+ *   Each edge is a column. With hit counts, each of AFL's eight hit count
+ *   buckets (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+) of an edge is a column
+ *   of its own, as afl-cmin distinguishes them.
+ * * __afl-raw__: afl-showmap output written with `-r`, which holds each
+ *   edge's hit count rather than its bucket. The counts are bucketed the same
+ *   way.
+ * * __sancov__: SanitizerCoverage `.sancov` files, a magic number followed
+ *   by the 32 or 64-bit offsets of the code that was reached. The distinct
+ *   offsets in the corpus are numbered in ascending order to make the
+ *   columns.
+ */
+
+#ifndef CORPUS_COVERAGE_H
+#define CORPUS_COVERAGE_H
+
+#include <string>
+#include <vector>
+
+#include "Corpus.h"
+#include "moonlight.h"
+
+/** The kinds of trace file a corpus directory can hold */
+enum class TraceFormat {
+    /** MoonLight bit vector or sparse traces (see DATA.md) */
+    BIT_VECTOR,
+    /** afl-showmap text or binary maps */
+    AFL,
+    /** afl-showmap text or binary maps of raw hit counts (-r) */
+    AFL_RAW,
+    /** SanitizerCoverage offset lists */
+    SANCOV
+};
+
+/**
+ * \brief Look up a trace format by its command line name: "bits", "afl",
+ * "afl-raw" or "sancov".
+ *
+ * \throws runtime_error if there's no such format
+ */
+TraceFormat parse_trace_format(const std::string &name);
+
+/**
+ * \brief The coverage files of a corpus, as traces.
+ *
+ * The columns of a sancov file depend on every other file in the corpus, so
+ * all the files are read up front, decoded, and kept in a CorpusSpill. An
+ * AFL trace has eight columns per edge with hit counts and one without, so
+ * its size in bytes is its number of edges or an eighth of that. Every
+ * sancov trace has one column per distinct offset in the corpus.
+ */
+class CoverageCorpus : public CorpusReader {
+public:
+    /**
+     * \brief Read and decode the coverage files.
+     *
+     * \param files the coverage files, as listed by get_file_list() or
+     * read_file_list()
+     * \param format the format of the files. Not TraceFormat::BIT_VECTOR
+     * \param hit_counts make a column for each AFL hit count bucket of each
+     * edge, rather than for each edge
+     * \param num_threads number of decoding threads. Zero for one per core
+     * \throws runtime_error if a file can't be read or isn't in the format
+     */
+    CoverageCorpus(const std::vector<CorpusFile> &files, TraceFormat format,
+                   bool hit_counts, int num_threads);
+
+    void read_columns(int i, const std::vector<int> &transform,
+                      COL_DATA &columns) const override;
+
+private:
+    /** Decode the AFL maps, of raw hit counts if raw, into the spill */
+    void read_afl(const std::vector<CorpusFile> &files, bool hit_counts,
+                  bool raw, int num_threads);
+
+    /** Decode the sancov files into the spill */
+    void read_sancov(const std::vector<CorpusFile> &files, int num_threads);
+
+    /** The decoded traces */
+    CorpusSpill spill;
+};
+
+#endif /* CORPUS_COVERAGE_H */
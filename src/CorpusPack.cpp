@@ -0,0 +1,360 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Corpus pack reader and writer.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "ColumnCodec.h"
+#include "CorpusPack.h"
+#include "Parallel.h"
+#include "TraceDecode.h"
+#include "WeightTable.h"
+
+using namespace std;
+using namespace boost::filesystem;
+namespace src = boost::log::sources;
+
+/** Identifies a corpus pack. The CR LF catches text mode transfers */
+static const char PACK_MAGIC[8] = {'M', 'L', 'P', 'A', 'C', 'K', '\r', '\n'};
+
+/** Bump this whenever the layout changes */
+static const uint32_t PACK_VERSION = 2;
+
+/** Header flag: the pack was made with a weight file */
+static const uint32_t PACK_WEIGHTED = 1;
+
+/** Trace encodings */
+enum PackEncoding : uint32_t {
+    /** raw bit vector, as in a trace file */
+    PACK_RAW = 0,
+    /** column list in the encode_columns() format */
+    PACK_COLUMNS = 1
+};
+
+/** The first bytes of a pack */
+struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t num_traces;
+    uint64_t index_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t data_offset;
+    uint64_t data_size;
+};
+
+/** One trace in the pack index. All offsets are from the start of the pack */
+struct PackEntry {
+    /** Offset of the stored trace */
+    uint64_t offset;
+    /** Number of stored bytes */
+    uint64_t length;
+    /** Offset of the trace name */
+    uint64_t name_offset;
+    /** hash_columns() of the trace */
+    uint64_t hash;
+    /** Length of the trace name */
+    uint32_t name_length;
+    /** Size of the original trace file in bytes */
+    uint32_t trace_size;
+    /** Exemplar weight. NaN if the weight file didn't have one */
+    double weight;
+    /** A PackEncoding */
+    uint32_t encoding;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(PackHeader) == 64, "PackHeader layout");
+static_assert(sizeof(PackEntry) == 56, "PackEntry layout");
+
+///////////////////////////////////////////////////////////////////////
+// Packed Corpus Implementation
+///////////////////////////////////////////////////////////////////////
+
+PackedCorpus::PackedCorpus(const path &pack_file)
+    : entries(nullptr), flags(0), base(nullptr), length(0) {
+    int fd = open(pack_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Unable to open corpus pack: " +
+                            pack_file.native());
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(PackHeader)) {
+        close(fd);
+        throw runtime_error("Not a corpus pack: " + pack_file.native());
+    }
+    length = info.st_size;
+
+    void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw runtime_error("Unable to map corpus pack: " +
+                            pack_file.native());
+    }
+    base = static_cast<const unsigned char *>(addr);
+
+    try {
+        PackHeader header;
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0) {
+            throw runtime_error("Not a corpus pack: " + pack_file.native());
+        }
+        if (header.version != PACK_VERSION) {
+            throw runtime_error("Unsupported corpus pack version: " +
+                                pack_file.native());
+        }
+        flags = header.flags;
+
+        // check every offset up front so decoding never needs to
+        uint64_t index_size = header.num_traces * sizeof(PackEntry);
+        if (header.index_offset % alignof(PackEntry) != 0 ||
+            header.num_traces > length / sizeof(PackEntry) ||
+            header.index_offset > length - index_size) {
+            throw runtime_error("Corrupt corpus pack index: " +
+                                pack_file.native());
+        }
+        entries = reinterpret_cast<const PackEntry *>(base +
+                                                      header.index_offset);
+
+        path location = absolute(pack_file);
+        corpus.reserve(header.num_traces);
+        for (uint64_t i = 0; i < header.num_traces; i++) {
+            const PackEntry &e = entries[i];
+            if (e.offset > length || e.length > length - e.offset ||
+                e.name_offset > length ||
+                e.name_length > length - e.name_offset ||
+                e.trace_size > (uint32_t) numeric_limits<int>::max() ||
+                (e.encoding == PACK_RAW && e.length > e.trace_size) ||
+                e.encoding > PACK_COLUMNS) {
+                throw runtime_error("Corrupt corpus pack index: " +
+                                    pack_file.native());
+            }
+
+            string name(reinterpret_cast<const char *>(base + e.name_offset),
+                        e.name_length);
+            corpus.push_back(CorpusFile(location / name, e.trace_size));
+        }
+    } catch (...) {
+        munmap(const_cast<unsigned char *>(base), length);
+        throw;
+    }
+}
+
+PackedCorpus::~PackedCorpus() {
+    munmap(const_cast<unsigned char *>(base), length);
+}
+
+void PackedCorpus::read_columns(int i, const vector<int> &transform,
+                                COL_DATA &columns) const {
+    const PackEntry &e = entries[i];
+    const unsigned char *in = base + e.offset;
+
+    if (e.encoding == PACK_RAW) {
+        decode_trace(in, e.length, transform, columns);
+    } else {
+        uint64_t limit = 8 * static_cast<uint64_t>(e.trace_size);
+        decode_columns(in, in + e.length, limit, transform, columns);
+    }
+}
+
+uint64_t PackedCorpus::trace_hash(int i) const {
+    return entries[i].hash;
+}
+
+bool PackedCorpus::weighted() const {
+    return flags & PACK_WEIGHTED;
+}
+
+map<string, double> PackedCorpus::weight_map() const {
+    map<string, double> weights;
+
+    for (unsigned int i = 0; i < corpus.size(); i++) {
+        if (!std::isnan(entries[i].weight)) {
+            weights[corpus[i].file_path.filename().string()] =
+                entries[i].weight;
+        }
+    }
+
+    return weights;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Utility Functions
+///////////////////////////////////////////////////////////////////////
+
+bool is_corpus_pack(const path &file) {
+    char magic[sizeof(PACK_MAGIC)];
+    std::ifstream in(file.native(), std::ifstream::binary);
+
+    return in.read(magic, sizeof(magic)) &&
+           memcmp(magic, PACK_MAGIC, sizeof(PACK_MAGIC)) == 0;
+}
+
+/**
+ * \brief Write a block of bytes to the pack, or throw.
+ */
+static void write_bytes(std::ofstream &out, const void *bytes, size_t n,
+                        const path &pack_file) {
+    if (!out.write(static_cast<const char *>(bytes), n)) {
+        throw runtime_error("Unable to write corpus pack: " +
+                            pack_file.native());
+    }
+}
+
+void write_corpus_pack(const CorpusReader &source, const path &weight_file,
+                       const path &pack_file, int num_threads) {
+    src::severity_logger<> &mylog = my_logger::get();
+    const vector<CorpusFile> &files = source.files();
+    BOOST_LOG(mylog) << "Packing " << files.size() << " traces into "
+                     << pack_file;
+
+    shared_ptr<const WeightTable> weights;
+    if (!weight_file.empty()) {
+        weights = load_weights(weight_file);
+    }
+
+    std::ofstream out(pack_file.native(),
+                      std::ofstream::binary | std::ofstream::trunc);
+    if (!out) {
+        throw runtime_error("Unable to create corpus pack: " +
+                            pack_file.native());
+    }
+
+    // the header is rewritten once we know where everything went
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+    write_bytes(out, &header, sizeof(header), pack_file);
+
+    vector<PackEntry> index(files.size());
+    string names;
+    uint64_t offset = sizeof(header);
+    uint64_t raw_bytes = 0;
+
+    // traces are decoded concurrently in batches and written in order, so
+    // the pack lists them in the same order as the source
+    num_threads = resolve_num_threads(num_threads);
+    const int batch_size = max(TRACE_BATCH, 100 * num_threads);
+    vector<int> traces;
+    vector<COL_DATA> batch;
+    vector<unsigned char> stored;
+    for (int first = 0; first < (int) files.size(); first += batch_size) {
+        int count = min<int>(batch_size, files.size() - first);
+        traces.resize(count);
+        for (int i = 0; i < count; i++) {
+            traces[i] = first + i;
+        }
+        source.read_batch(traces, vector<int>(), batch, num_threads);
+
+        for (int i = 0; i < count; i++) {
+            const CorpusFile &f = files[first + i];
+            const COL_DATA &columns = batch[i];
+            PackEntry &e = index[first + i];
+            memset(&e, 0, sizeof(e));
+
+            // keep whichever of the column list and the (trimmed) bit
+            // vector is smaller
+            stored.clear();
+            encode_columns(columns, stored);
+            size_t raw_length = columns.empty() ? 0 : columns.back() / 8 + 1;
+            if (raw_length <= stored.size()) {
+                stored.assign(raw_length, 0);
+                for (INDEX c : columns) {
+                    stored[c >> 3] |= 0x80 >> (c & 7);
+                }
+                e.encoding = PACK_RAW;
+            } else {
+                e.encoding = PACK_COLUMNS;
+            }
+            write_bytes(out, stored.data(), stored.size(), pack_file);
+
+            string name = f.file_path.filename().string();
+            int w = weights ? weights->find(name) : -1;
+            e.offset = offset;
+            e.length = stored.size();
+            e.name_offset = names.size(); // relative until names are placed
+            e.hash = hash_columns(columns);
+            e.name_length = name.size();
+            e.trace_size = source.trace_bytes(first + i);
+            e.weight = (w >= 0) ? weights->weight(w)
+                                : numeric_limits<double>::quiet_NaN();
+            names += name;
+            offset += stored.size();
+            raw_bytes += f.file_size;
+        }
+
+        BOOST_LOG(mylog) << "File: " << first << ", "
+                         << files[first].file_path.filename();
+    }
+
+    header.data_offset = sizeof(header);
+    header.data_size = offset - header.data_offset;
+
+    header.names_offset = offset;
+    header.names_size = names.size();
+    write_bytes(out, names.data(), names.size(), pack_file);
+    offset += names.size();
+    for (PackEntry &e : index) {
+        e.name_offset += header.names_offset;
+    }
+
+    // pad so the index can be used in place once mapped
+    static const char padding[alignof(PackEntry)] = {};
+    size_t pad = (alignof(PackEntry) - offset % alignof(PackEntry)) %
+                 alignof(PackEntry);
+    write_bytes(out, padding, pad, pack_file);
+    offset += pad;
+
+    header.index_offset = offset;
+    header.num_traces = index.size();
+    write_bytes(out, index.data(), index.size() * sizeof(PackEntry),
+                pack_file);
+
+    memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version = PACK_VERSION;
+    header.flags = weight_file.empty() ? 0 : PACK_WEIGHTED;
+    out.seekp(0);
+    write_bytes(out, &header, sizeof(header), pack_file);
+    out.close();
+    if (!out) {
+        throw runtime_error("Unable to write corpus pack: " +
+                            pack_file.native());
+    }
+
+    BOOST_LOG(mylog) << "Packed " << raw_bytes << " bytes of traces into "
+                     << header.data_size << " bytes";
+}
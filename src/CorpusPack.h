@@ -0,0 +1,129 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief A whole corpus packed into a single file.
+ *
+ * A corpus directory of tens of thousands of small trace files costs a file
+ * system metadata operation or three per trace before any decoding happens.
+ * A corpus pack holds the same traces in one file that is opened and mapped
+ * once. The layout (all integers in host byte order, which is little endian
+ * on every platform we run on) is:
+ *
+ * * __header__: magic "MLPACK\r\n", format version, flags, number of traces
+ *   and the offsets of the sections below.
+ * * __data__: the traces, concatenated. Each trace is stored either as the
+ *   raw bit vector (minus any trailing zero bytes) or as a column list in the
+ *   encode_columns() format, whichever is smaller.
+ * * __names__: the trace names, concatenated.
+ * * __index__: one PackEntry per trace giving the offset and encoding of its
+ *   data, its name, its weight and the hash_columns() of its columns. The
+ *   index comes last so a pack can be written in one pass.
+ */
+
+#ifndef CORPUS_PACK_H
+#define CORPUS_PACK_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "Corpus.h"
+#include "moonlight.h"
+
+struct PackEntry;
+
+/**
+ * \brief A read only corpus pack, mapped into memory.
+ *
+ * The traces are listed as pack_file/name so their file names are the names
+ * of the traces that went into the pack.
+ */
+class PackedCorpus : public CorpusReader {
+public:
+    /**
+     * \brief Open and map a corpus pack and check its index.
+     *
+     * \param pack_file path to the pack
+     * \throws runtime_error if the file can't be read or isn't a valid pack
+     */
+    explicit PackedCorpus(const boost::filesystem::path &pack_file);
+
+    PackedCorpus(const PackedCorpus &orig) = delete;
+    PackedCorpus &operator=(const PackedCorpus &rhs) = delete;
+
+    ~PackedCorpus();
+
+    void read_columns(int i, const std::vector<int> &transform,
+                      COL_DATA &columns) const override;
+
+    /** true iff the pack was made with a weight file */
+    bool weighted() const;
+
+    /**
+     * \brief The weights the pack was made with, by trace name. Traces that
+     * had no weight are left out.
+     */
+    std::map<std::string, double> weight_map() const;
+
+    /** The pack stores every trace's hash */
+    std::uint64_t trace_hash(int i) const override;
+
+private:
+    /** The index entries, pointing into the mapping */
+    const PackEntry *entries;
+
+    /** Pack header flags */
+    std::uint32_t flags;
+
+    /** The whole pack file */
+    const unsigned char *base;
+
+    /** Size of the pack file in bytes */
+    std::size_t length;
+};
+
+/**
+ * \brief Is the file a corpus pack? Only the magic number is checked.
+ */
+bool is_corpus_pack(const boost::filesystem::path &file);
+
+/**
+ * \brief Write the traces of a corpus to a corpus pack.
+ *
+ * \param source the corpus to pack
+ * \param weight_file exemplar weights to store with the traces. Empty path for
+ * none
+ * \param pack_file path of the pack to create. Overwritten if it exists
+ * \param num_threads number of decoding threads. Zero for one per core
+ * \throws runtime_error if a trace can't be read or the pack can't be written
+ */
+void write_corpus_pack(const CorpusReader &source,
+                       const boost::filesystem::path &weight_file,
+                       const boost::filesystem::path &pack_file,
+                       int num_threads);
+
+#endif /* CORPUS_PACK_H */
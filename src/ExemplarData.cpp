@@ -44,16 +44,16 @@ namespace src = boost::log::sources;
 
 CORPUS_DATA initialise_corpus_data(Matrix &matrix) {
     CORPUS_DATA corpus_data;
-    for (auto it = matrix.rowlist_begin(); it != matrix.rowlist_end(); it++) {
-        RowElem element = *it;
+    corpus_data.reserve(matrix.get_num_rows());
+    for (int r = 0; r < matrix.get_num_rows(); r++) {
         ExemplarData ex_data;
-        ex_data.file_path = element.file_path;
-        ex_data.file_size = element.file_size;
-        ex_data.score_rowsum = element.row_sum;
+        ex_data.file_path = matrix.get_row_exemplar(r);
+        ex_data.file_size = matrix.get_row_file_size(r);
+        ex_data.score_rowsum = matrix.get_row_sum(r);
         ex_data.score_block_target = 0.0;
         ex_data.score_unitarian = 0.0;
         ex_data.selected_greedy_rowsum = false;
-        corpus_data.push_back(ex_data);
+        corpus_data.push_back(std::move(ex_data));
     }
 
     return corpus_data; // move
@@ -95,9 +95,9 @@ ExemplarData &ExemplarData::operator=(const ExemplarData &rhs) {
 }
 
 // move constructor
-ExemplarData::ExemplarData(const ExemplarData &&orig) noexcept {
+ExemplarData::ExemplarData(ExemplarData &&orig) noexcept {
     this->file_size = orig.file_size;
-    this->file_path = orig.file_path;
+    this->file_path = std::move(orig.file_path);
     this->selected_greedy_rowsum = orig.selected_greedy_rowsum;
     this->score_rowsum = orig.score_rowsum;
     this->score_unitarian = orig.score_unitarian;
@@ -105,11 +105,11 @@ ExemplarData::ExemplarData(const ExemplarData &&orig) noexcept {
 }
 
 // move assignment
-ExemplarData &ExemplarData::operator=(const ExemplarData &&rhs) noexcept {
-    // protect against self assignment eg "mymatrix = mymatrix";
+ExemplarData &ExemplarData::operator=(ExemplarData &&rhs) noexcept {
+    // protect against self assignment eg "mymatrix = std::move(mymatrix)";
     if (this != &rhs) {
         this->file_size = rhs.file_size;
-        this->file_path = rhs.file_path;
+        this->file_path = std::move(rhs.file_path);
         this->selected_greedy_rowsum = rhs.selected_greedy_rowsum;
         this->score_rowsum = rhs.score_rowsum;
         this->score_unitarian = rhs.score_unitarian;
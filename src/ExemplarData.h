@@ -98,10 +98,10 @@ public:
     ExemplarData &operator=(const ExemplarData &orig);
 
     /** Move constructor */
-    ExemplarData(const ExemplarData &&orig) noexcept;
+    ExemplarData(ExemplarData &&orig) noexcept;
 
     /** Move assignment */
-    ExemplarData &operator=(const ExemplarData &&orig) noexcept;
+    ExemplarData &operator=(ExemplarData &&orig) noexcept;
 
     /** Print an exemplar's meta-data in CSV format. */
     std::string csv_print() const;
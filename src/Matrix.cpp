@@ -29,77 +29,38 @@
  * \date Feb 2017
  */
 
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/binary_oarchive.hpp>
-#include <boost/archive/text_iarchive.hpp>
-#include <boost/archive/text_oarchive.hpp>
+#include <cstdint>
+#include <numeric>
+
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/operations.hpp>
 
+#include "ColumnCodec.h"
 #include "Corpus.h"
 #include "Matrix.h"
+#include "MatrixCache.h"
+#include "Parallel.h"
+#include "TraceDecode.h"
+#include "TraceReader.h"
+#include "WeightTable.h"
 
 using namespace boost::filesystem;
-using namespace boost::serialization;
 using namespace std;
 namespace src = boost::log::sources;
 
 // unitity function prototypes
 static vector<int> transform_index(int num_elements, INDEX_LIST &delset);
+static bool packs(size_t ones, size_t columns);
+static size_t gaps_size(const COL_DATA &columns);
+static bool test_bit(const BitRow::WORD *bits, INDEX c);
+template <typename T>
+static void permute(vector<T> &items, const vector<int> &order);
 void pprint_map(map<string, int> mymap);
 
-RowElem::RowElem()
-    : file_size(0), row_sum(0), file_path(boost::filesystem::path("")),
-      column(COL_DATA()), weight(1.0) {
-}
-
-RowElem::RowElem(boost::filesystem::path file, int filesize, int sum,
-                 double weight)
-    : file_size(filesize), row_sum(sum), file_path(file),
-      column(COL_DATA(sum, 0)), weight(weight) {
-}
-
-RowElem::RowElem(const path &exemplar, const vector<int> &init_col_transform) {
-    this->file_path = exemplar;
-    this->file_size = boost::filesystem::file_size(exemplar);
-
-    // read in the raw data from the file
-    ROW rawdata = get_exemplar_data(exemplar);
-
-    // make a column list
-    COL_DATA temp;
-    int rowsum = 0;
-    for (unsigned int idx = 0; idx < rawdata.size(); idx++) {
-        if (rawdata[idx]) {
-            if (init_col_transform[idx] != DELETED) {
-                temp.push_back(
-                    init_col_transform[idx]); // record the column index
-                rowsum++;
-            }
-        }
-    }
-
-    this->row_sum = rowsum;
-    this->column = temp;
-    this->weight = 1.0;
-}
-
 ///////////////////////////////////////////////////////////////////////
 // Binary Operators
 ///////////////////////////////////////////////////////////////////////
 
-bool RowElem::operator==(const RowElem &other) const {
-    if (this->row_sum != other.row_sum) {
-        return false;
-    }
-
-    if (this->column != other.column) {
-        return false;
-    }
-
-    return true;
-}
-
 bool Matrix::operator==(const Matrix &other) const {
     auto lrows = this->get_num_rows();
     auto lcols = this->get_num_cols();
@@ -140,74 +101,110 @@ bool Matrix::operator==(const Matrix &other) const {
 
 Matrix::Matrix()
     : num_rows(0), num_cols(0), num_cols_orig(0), num_elems(0LL),
-      directory(path("")), pattern(""), rowlist(vector<RowElem>()) {
+      directory(path("")), pattern(""), stored_elems(0LL), name_begin(1, 0) {
 }
 
 Matrix::Matrix(int rows, int columns)
-    : num_rows(rows), num_cols(columns), num_cols_orig(columns), num_elems(0LL),
-      directory(path("")), pattern(""), rowlist(vector<RowElem>()) {
+    : num_rows(0), num_cols(columns), num_cols_orig(columns), num_elems(0LL),
+      directory(path("")), pattern(""), stored_elems(0LL), name_begin(1, 0) {
     if ((rows < 0) || (columns < 0)) {
         throw out_of_range("Row or column size can't be negative");
     }
+
+    reset_columns(columns);
+    col_origin.resize(columns);
+    iota(col_origin.begin(), col_origin.end(), 0);
+    for (int r = 0; r < rows; r++) {
+        insert_row(path(""), 0, COL_DATA(), 1.0);
+    }
 }
 
 Matrix::Matrix(const path &directory, const string &pattern,
-               const path &weight_file, INDEX_LIST cols_to_ignore)
+               const path &weight_file, INDEX_LIST cols_to_ignore,
+               int num_threads)
+    : Matrix(DirectoryCorpus(directory, pattern, num_threads), weight_file,
+             cols_to_ignore, num_threads) {
+    this->directory = directory;
+    this->pattern = pattern;
+}
+
+Matrix::Matrix(const CorpusReader &source, const path &weight_file,
+               INDEX_LIST cols_to_ignore, int num_threads)
     : num_rows(0), num_cols(0), num_cols_orig(0), num_elems(0LL),
-      directory(directory), pattern(pattern), rowlist(vector<RowElem>()) {
+      directory(path("")), pattern(""), stored_elems(0LL), name_begin(1, 0) {
     src::severity_logger<> &mylog = my_logger::get();
-    BOOST_LOG(mylog) << "Finding files at path: " << directory
-                     << " with pattern: " << pattern;
 
-    vector<CorpusFile> corpus = get_file_list(directory, pattern);
-    if (corpus.empty()) {
+    const vector<CorpusFile> &files = source.files();
+    if (files.empty()) {
         BOOST_LOG(mylog) << "No files found, exiting";
         exit(0);
     }
 
-    // sort the corpus - largest to smallest
-    sort(corpus.begin(), corpus.end(), greater<CorpusFile>());
+    // sort the corpus - largest to smallest. We sort indices into the
+    // source's list, in exactly the order sorting the list itself would give
+    vector<int> corpus(files.size());
+    for (unsigned int i = 0; i < files.size(); i++) {
+        corpus[i] = i;
+    }
+    sort(corpus.begin(), corpus.end(),
+         [&files](int a, int b) { return files[a] > files[b]; });
     BOOST_LOG(mylog) << "Corpus size: " << corpus.size();
 
     // this is the TRACE file size, not the exemplar file size!
-    int max_file_size = 0;
-    if (corpus.size() > 0) {
-        max_file_size = corpus[0].file_size;
-    }
+    int max_file_size = files[corpus[0]].file_size;
     num_cols_orig = (8 * max_file_size);
 
-    // create a column index transform to ignore the given column indices
-    vector<int> init_col_transform =
-        transform_index(num_cols_orig, cols_to_ignore);
+    // create a column index transform to ignore the given column indices.
+    // If there is nothing to ignore the empty (identity) transform saves the
+    // decoder a table lookup per set bit
+    vector<int> init_col_transform;
+    if (!cols_to_ignore.empty()) {
+        init_col_transform = transform_index(num_cols_orig, cols_to_ignore);
+    }
+    reset_columns(num_cols_orig - cols_to_ignore.size());
+    col_origin.resize(num_cols);
+    if (init_col_transform.empty()) {
+        iota(col_origin.begin(), col_origin.end(), 0);
+    } else {
+        for (int c = 0; c < num_cols_orig; c++) {
+            if (init_col_transform[c] != DELETED) {
+                col_origin[init_col_transform[c]] = c;
+            }
+        }
+    }
 
-    // create a map from exemplar file names to weights
-    bool weighted = false;
-    map<string, double> weight_map;
+    // look the weights up once, giving each selected row its weight
+    shared_ptr<const WeightTable> weight_table;
     if (!weight_file.empty()) {
         BOOST_LOG(mylog) << "Weighted version";
-        weighted = true;
-        weight_map = get_weight_data(weight_file);
+        weight_table = load_weights(weight_file);
     } else {
         BOOST_LOG(mylog) << "Unweighted version";
     }
 
-    // now parse the corpus files and insert into the matrix
-    // adjust the weights if needed, or leave them as 1 (default)
-    BOOST_LOG(mylog) << "Parsing corpus files and inserting into the matrix...";
-    num_rows = 0;
-
+    // work out which exemplars make it into the matrix and with what weight
+    // before reading any trace data, so we don't decode rows we'll discard
+    vector<int> selected;
+    vector<double> weights;
+    selected.reserve(corpus.size());
+    weights.reserve(corpus.size());
+    vector<char> weight_used(weight_table ? weight_table->capacity() : 0, 0);
+    int num_weights_used = 0;
     for (unsigned int r = 0; r < corpus.size(); r++) {
-        path f = corpus[r].file_path;
-        RowElem row(f, init_col_transform);
-        if (weighted) {
-            string name = row.file_path.filename().string();
-            if (weight_map.find(name) != weight_map.end()) {
-                row.weight = weight_map[name];
-                weight_map.erase(name);
-
-                if (row.weight > 0) {
+        if (weight_table) {
+            string name = files[corpus[r]].file_path.filename().string();
+            int entry = weight_table->find(name);
+            if (entry >= 0) {
+                double weight = weight_table->weight(entry);
+                if (!weight_used[entry]) {
+                    weight_used[entry] = 1;
+                    num_weights_used++;
+                }
+
+                if (weight > 0) {
                     // discard any exemplars with non +ve weights
-                    this->insert_row(row);
+                    selected.push_back(r);
+                    weights.push_back(weight);
                 }
             } else {
                 BOOST_LOG(mylog) << "Ignoring exemplar with no know weight: '"
@@ -215,18 +212,148 @@ Matrix::Matrix(const path &directory, const string &pattern,
             }
         } else {
             // unweighted version
-            this->insert_row(row);
+            selected.push_back(r);
+            weights.push_back(1.0);
         }
+    }
 
-        if ((r % 100) == 0) {
-            BOOST_LOG(mylog) << "File: " << r << ", " << f.filename();
+    // now parse the corpus files and insert into the matrix
+    // the traces are read in the order they lie on disk, which has nothing
+    // to do with their size, and decoded in batches by a pool of worker
+    // threads. Each row's columns are appended to the column array as they
+    // arrive, but its offsets and meta data go into its place in corpus
+    // order, so the result doesn't depend on the number of threads or the
+    // disk layout
+    num_threads = resolve_num_threads(num_threads);
+    BOOST_LOG(mylog) << "Parsing corpus files and inserting into the matrix "
+                     << "using " << num_threads << " thread(s), "
+                     << trace_reader_name() << " and the "
+                     << trace_decoder_name() << " trace decoder...";
+    vector<int> traces(selected.size());
+    for (unsigned int r = 0; r < selected.size(); r++) {
+        traces[r] = corpus[selected[r]];
+    }
+    vector<int> order = disk_order(files, traces);
+    num_rows = selected.size();
+    row_begin.resize(num_rows);
+    row_end.resize(num_rows);
+    row_lengths.resize(num_rows);
+    row_packed.resize(num_rows);
+    row_sums.resize(num_rows);
+    row_weights = std::move(weights);
+    row_file_sizes.resize(num_rows);
+    row_traces = traces;
+    row_active.resize(num_rows);
+    live_rows.resize(num_rows);
+    row_rank.resize(num_rows);
+    for (int r = 0; r < num_rows; r++) {
+        row_active.set(r);
+        live_rows[r] = r;
+        row_rank[r] = r;
+    }
+
+    // the names go in in corpus order too
+    row_names.resize(num_rows);
+    name_begin.reserve(num_rows + 1);
+    for (int r = 0; r < num_rows; r++) {
+        names += files[traces[r]].file_path.native();
+        row_names[r] = r;
+        name_begin.push_back(names.size());
+    }
+
+    const int batch_size = max(TRACE_BATCH, 100 * num_threads);
+    vector<int> batch;
+    vector<COL_DATA> columns;
+    for (unsigned int first = 0; first < order.size(); first += batch_size) {
+        int count = min<int>(batch_size, order.size() - first);
+        batch.resize(count);
+        for (int i = 0; i < count; i++) {
+            batch[i] = traces[order[first + i]];
+        }
+        source.read_batch(batch, init_col_transform, columns, num_threads);
+
+        // the listing doesn't know the size of a sparse trace until it is
+        // read, and its row can't be stored until the matrix is that wide
+        int widest = 0;
+        for (int i = 0; i < count; i++) {
+            widest = max(widest, source.trace_bytes(batch[i]));
         }
+        if (8 * widest > num_cols_orig) {
+            resize_columns(8 * widest);
+        }
+
+        // the disk order has nothing to do with row sums, so the rows read
+        // so far predict the size of the gap and bitmap arrays. Room that is
+        // never written costs no memory, but moving an array to grow it does
+        size_t needed = col_gaps.size();
+        size_t needed_words = row_words.size();
+        for (int i = 0; i < count; i++) {
+            if (packs(columns[i].size(), col_active.size())) {
+                needed_words += col_active.num_words();
+            } else {
+                needed += gaps_size(columns[i]);
+            }
+        }
+        double rows_read = first + count;
+        if (needed > col_gaps.capacity()) {
+            col_gaps.reserve(1.25 * needed * (num_rows / rows_read));
+        }
+        if (needed_words > row_words.capacity()) {
+            row_words.reserve(1.25 * needed_words * (num_rows / rows_read));
+        }
+
+        for (int i = 0; i < count; i++) {
+            int r = order[first + i];
+            const INDEX *row = columns[i].data();
+            if (packs(columns[i].size(), col_active.size())) {
+                pack_row(r, row, row + columns[i].size());
+            } else {
+                encode_row(r, row, row + columns[i].size());
+            }
+            row_sums[r] = columns[i].size();
+            row_file_sizes[r] = source.trace_bytes(batch[i]);
+            num_elems += row_sums[r];
+            for (INDEX c : columns[i]) {
+                col_sums[c]++;
+            }
+        }
+
+        BOOST_LOG(mylog) << "File: " << first << ", "
+                         << files[batch[0]].file_path.filename();
+    }
+
+    // with the traces read every size is known. If a sparse trace's differs
+    // from its listing the matrix is sized and the rows ordered as they
+    // would have been had the listing known it
+    vector<int> bytes(files.size());
+    bool resort = false;
+    for (unsigned int i = 0; i < files.size(); i++) {
+        bytes[i] = source.trace_bytes(i);
+        resort |= (bytes[i] != files[i].file_size);
+    }
+    if (resort) {
+        resize_columns(8 * *max_element(bytes.begin(), bytes.end()));
+        iota(corpus.begin(), corpus.end(), 0);
+        sort(corpus.begin(), corpus.end(),
+             [&bytes](int a, int b) { return bytes[a] > bytes[b]; });
+        vector<int> row_of(files.size(), -1);
+        for (int r = 0; r < num_rows; r++) {
+            row_of[row_traces[r]] = r;
+        }
+        vector<int> order;
+        order.reserve(num_rows);
+        for (int i : corpus) {
+            if (row_of[i] >= 0) {
+                order.push_back(row_of[i]);
+            }
+        }
+        permute_rows(order);
     }
-    num_cols = num_cols_orig - cols_to_ignore.size();
 
     // ensure all the exemplar weights are used, if not there is likely an
     // error
-    assert(weight_map.size() == 0);
+    assert(!weight_table || num_weights_used == weight_table->size());
+    find_sparse_cols();
 
     double density = (100.0 * num_elems) / (1.0 * num_cols * num_rows);
     BOOST_LOG(mylog) << "Finished creating the matrix";
@@ -237,44 +364,9 @@ Matrix::Matrix(const path &directory, const string &pattern,
     BOOST_LOG(mylog) << "";
 }
 
-Matrix::Matrix(const path &matrixfile) {
-    src::severity_logger<> &mylog = my_logger::get();
-    Matrix dmat;
-
-    // check if file exists and is usable
-    if (exists(matrixfile) && is_regular_file(matrixfile)) {
-        // attempt to restore it
-        std::ifstream matrix_file_in(matrixfile.native());
-        BOOST_LOG(mylog) << "Reading matrix data in from file: " << matrixfile;
-        // boost::archive::text_iarchive sin(matrix_file_in);
-        boost::archive::binary_iarchive sin(matrix_file_in);
-
-        // read class state from archive
-        sin >> dmat;
-        BOOST_LOG(mylog) << "Finished reading in Matrix data...";
-
-        // archive and stream closed when destructors are called - hence inner
-        // block
-    } else {
-        BOOST_LOG_SEV(mylog, error)
-            << "Matrix data file does not exist or is not a regular file!";
-        throw runtime_error(
-            "Matrix data file does not exist or is not a regular file");
-    }
-
-    // move assign to *this
-    *this = dmat;
-}
-
 // copy constructor
 Matrix::Matrix(const Matrix &orig) {
-    this->num_rows = orig.num_rows;
-    this->num_cols = orig.num_cols;
-    this->num_cols_orig = orig.num_cols_orig;
-    this->num_elems = orig.num_elems;
-    this->directory = orig.directory;
-    this->pattern = orig.pattern;
-    this->rowlist = orig.rowlist; // copy assignment
+    *this = orig; // copy assignment
 }
 
 // copy assignment
@@ -287,34 +379,90 @@ Matrix &Matrix::operator=(const Matrix &rhs) {
         this->num_elems = rhs.num_elems;
         this->directory = rhs.directory;
         this->pattern = rhs.pattern;
-        this->rowlist = rhs.rowlist; // copy assignment
+        this->trace_source = rhs.trace_source;
+        this->col_gaps = rhs.col_gaps;
+        this->row_begin = rhs.row_begin;
+        this->row_end = rhs.row_end;
+        this->row_lengths = rhs.row_lengths;
+        this->row_packed = rhs.row_packed;
+        this->row_words = rhs.row_words;
+        this->stored_elems = rhs.stored_elems;
+        this->row_sums = rhs.row_sums;
+        this->row_weights = rhs.row_weights;
+        this->row_file_sizes = rhs.row_file_sizes;
+        this->row_traces = rhs.row_traces;
+        this->row_names = rhs.row_names;
+        this->names = rhs.names;
+        this->name_begin = rhs.name_begin;
+        this->name_ranks = rhs.name_ranks;
+        this->row_active = rhs.row_active;
+        this->live_rows = rhs.live_rows;
+        this->col_active = rhs.col_active;
+        this->live_cols = rhs.live_cols;
+        this->col_rank = rhs.col_rank;
+        this->row_rank = rhs.row_rank;
+        this->col_sums = rhs.col_sums;
+        this->col_origin = rhs.col_origin;
+        this->sparse_cols = rhs.sparse_cols;
+        this->row_gaps = rhs.row_gaps;
+        this->col_begin = rhs.col_begin;
+        this->list_skips = rhs.list_skips;
+        this->skip_begin = rhs.skip_begin;
     }
 
     return *this;
 }
 
 // move constructor
-Matrix::Matrix(const Matrix &&orig) noexcept {
-    this->num_rows = orig.num_rows;
-    this->num_cols = orig.num_cols;
-    this->num_cols_orig = orig.num_cols_orig;
-    this->num_elems = orig.num_elems;
-    this->directory = orig.directory;
-    this->pattern = orig.pattern;
-    this->rowlist = orig.rowlist;
+Matrix::Matrix(Matrix &&orig) noexcept {
+    *this = std::move(orig);
 }
 
 // move assignment
-Matrix &Matrix::operator=(const Matrix &&rhs) noexcept {
-    // protect against self assignment eg "mymatrix = mymatrix";
+Matrix &Matrix::operator=(Matrix &&rhs) noexcept {
+    // protect against self assignment eg "mymatrix = std::move(mymatrix)";
     if (this != &rhs) {
         this->num_rows = rhs.num_rows;
         this->num_cols = rhs.num_cols;
         this->num_cols_orig = rhs.num_cols_orig;
         this->num_elems = rhs.num_elems;
-        this->directory = rhs.directory;
-        this->pattern = rhs.pattern;
-        this->rowlist = rhs.rowlist;
+        this->directory = std::move(rhs.directory);
+        this->pattern = std::move(rhs.pattern);
+        this->trace_source = std::move(rhs.trace_source);
+        this->col_gaps = std::move(rhs.col_gaps);
+        this->row_begin = std::move(rhs.row_begin);
+        this->row_end = std::move(rhs.row_end);
+        this->row_lengths = std::move(rhs.row_lengths);
+        this->row_packed = std::move(rhs.row_packed);
+        this->row_words = std::move(rhs.row_words);
+        this->stored_elems = rhs.stored_elems;
+        this->row_sums = std::move(rhs.row_sums);
+        this->row_weights = std::move(rhs.row_weights);
+        this->row_file_sizes = std::move(rhs.row_file_sizes);
+        this->row_traces = std::move(rhs.row_traces);
+        this->row_names = std::move(rhs.row_names);
+        this->names = std::move(rhs.names);
+        this->name_begin = std::move(rhs.name_begin);
+        this->name_ranks = std::move(rhs.name_ranks);
+        this->row_active = std::move(rhs.row_active);
+        this->live_rows = std::move(rhs.live_rows);
+        this->col_active = std::move(rhs.col_active);
+        this->live_cols = std::move(rhs.live_cols);
+        this->col_rank = std::move(rhs.col_rank);
+        this->row_rank = std::move(rhs.row_rank);
+        this->col_sums = std::move(rhs.col_sums);
+        this->col_origin = std::move(rhs.col_origin);
+        this->sparse_cols = std::move(rhs.sparse_cols);
+        this->row_gaps = std::move(rhs.row_gaps);
+        this->col_begin = std::move(rhs.col_begin);
+        this->list_skips = std::move(rhs.list_skips);
+        this->skip_begin = std::move(rhs.skip_begin);
+
+        // leave the matrix moved from without rows or columns
+        rhs.num_rows = 0;
+        rhs.num_cols = 0;
+        rhs.num_elems = 0;
+        rhs.stored_elems = 0;
     }
 
     return *this;
@@ -345,6 +493,40 @@ vector<int> transform_index(int num_elements, INDEX_LIST &delset) {
     return transform;
 }
 
+// whether a row with this many ones is stored as a bitmap of this many
+// columns rather than a list. A list takes a byte or two per one, but rows
+// with ones in more than one in 32 columns are kept as bitmaps all the same,
+// where overlaps are counted a word at a time
+bool packs(size_t ones, size_t columns) {
+    return ones > 2 * ((columns + BitRow::WORD_BITS - 1) / BitRow::WORD_BITS);
+}
+
+// the number of bytes a sorted row takes as a list
+size_t gaps_size(const COL_DATA &columns) {
+    size_t bytes = 0;
+    INDEX previous = -1;
+    for (INDEX c : columns) {
+        bytes += varint_size(c - previous);
+        previous = c;
+    }
+
+    return bytes;
+}
+
+bool test_bit(const BitRow::WORD *bits, INDEX c) {
+    return (bits[c / BitRow::WORD_BITS] >> (c % BitRow::WORD_BITS)) & 1;
+}
+
+// put items[order[k]] in place k
+template <typename T> void permute(vector<T> &items, const vector<int> &order) {
+    vector<T> result;
+    result.reserve(order.size());
+    for (int k : order) {
+        result.push_back(items[k]);
+    }
+    items.swap(result);
+}
+
 void pprint_map(const map<string, int> &mymap) {
     src::severity_logger<> &mylog = my_logger::get();
     BOOST_LOG(mylog) << "Weight map entries....";
@@ -355,23 +537,319 @@ void pprint_map(const map<string, int> &mymap) {
 }
 
 void Matrix::assert_row_sums() const {
-    assert(num_rows == (int) rowlist.size());
-    auto riter = rowlist.begin();
+    assert(num_rows == (int) live_rows.size());
+    assert(num_cols == (int) live_cols.size());
 
-    while (riter != rowlist.end()) {
+    long long elems = 0;
+    COLUMN_SUM &col_counts = checked_sums;
+    col_counts.assign(num_cols, 0);
+    for (int r = 0; r < num_rows; r++) {
         int count = 0;
-        auto citer = riter->column.begin();
-
-        while (citer != riter->column.end()) {
-            if (*citer != DELETED) {
+        for_each_stored(live_rows[r], [&](INDEX stored) {
+            INDEX c = col_rank[stored];
+            if (c != DELETED) {
+                col_counts[c]++;
                 count++;
             }
+        });
+
+        assert(count == row_sums[r]);
+        elems += count;
+    }
+    assert(elems == num_elems);
+
+    assert(col_counts == col_sums);
+    for (int c = 0; c < num_cols; c++) {
+        assert(sparse_cols.test(c) == (col_sums[c] <= 1));
+    }
+}
+
+path Matrix::name(int id) const {
+    return path(names.substr(name_begin[id], name_begin[id + 1] -
+                                                 name_begin[id]));
+}
+
+void Matrix::rank_names() const {
+    if (!name_ranks.empty()) {
+        return;
+    }
+
+    // sort the names where they lie in the table, comparing them as the
+    // strings they are, then give equal names equal ranks
+    int count = name_begin.size() - 1;
+    auto compare = [this](int a, int b) {
+        return names.compare(name_begin[a], name_begin[a + 1] - name_begin[a],
+                             names, name_begin[b],
+                             name_begin[b + 1] - name_begin[b]);
+    };
+    vector<int> order(count);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(),
+         [&compare](int a, int b) { return compare(a, b) < 0; });
+
+    name_ranks.resize(count);
+    for (int i = 0; i < count; i++) {
+        bool same = i > 0 && compare(order[i - 1], order[i]) == 0;
+        name_ranks[order[i]] = same ? name_ranks[order[i - 1]] : i;
+    }
+}
+
+void Matrix::append_row(const COL_DATA &columns, const path &exemplar,
+                        int file_size, double weight, int trace) {
+    int sum = 0;
+    for (INDEX c : columns) {
+        if (c >= 0 && c < (int) col_rank.size() && col_active.test(c)) {
+            INDEX k = col_rank[c];
+            if (++col_sums[k] == 2) {
+                sparse_cols.reset(k);
+            }
+            sum++;
+        }
+    }
+
+    int stored = row_begin.size();
+    row_begin.push_back(0);
+    row_end.push_back(0);
+    row_lengths.push_back(0);
+    row_packed.resize(stored + 1);
+    const INDEX *row = columns.data();
+    if (packs(columns.size(), col_active.size())) {
+        pack_row(stored, row, row + columns.size());
+    } else {
+        encode_row(stored, row, row + columns.size());
+    }
+    row_sums.push_back(sum);
+    row_weights.push_back(weight);
+    row_file_sizes.push_back(file_size);
+    row_traces.push_back(trace);
+    row_names.push_back(name_begin.size() - 1);
+    names += exemplar.native();
+    name_begin.push_back(names.size());
+    name_ranks.clear();
+    row_active.resize(stored + 1);
+    row_active.set(stored);
+    live_rows.push_back(stored);
+    row_rank.push_back(num_rows);
+
+    num_rows++;
+    num_elems += sum;
+}
+
+void Matrix::reset_columns(int columns) {
+    num_cols = columns;
+    col_active = BitRow(columns);
+    live_cols.resize(columns);
+    col_rank.resize(columns);
+    for (int c = 0; c < columns; c++) {
+        col_active.set(c);
+        live_cols[c] = c;
+        col_rank[c] = c;
+    }
+    col_sums.resize(columns, 0);
+    find_sparse_cols();
+}
+
+void Matrix::resize_columns(int columns) {
+    assert(num_cols == num_cols_orig);
+    if (columns == num_cols) {
+        return;
+    }
+
+    // every bitmap row is as wide as the matrix, so they move to make room
+    size_t old_words = col_active.num_words();
+    num_cols_orig = columns;
+    reset_columns(columns);
+    col_origin.resize(columns);
+    iota(col_origin.begin(), col_origin.end(), 0);
+
+    size_t words = col_active.num_words();
+    if (words == old_words || row_words.empty()) {
+        return;
+    }
+    vector<BitRow::WORD> moved(row_words.size() / old_words * words, 0);
+    for (int s = 0; s < num_rows; s++) {
+        if (row_packed.test(s)) {
+            size_t begin = row_begin[s] / old_words * words;
+            copy(row_words.begin() + row_begin[s],
+                 row_words.begin() + row_begin[s] + min(words, old_words),
+                 moved.begin() + begin);
+            row_begin[s] = begin;
+            row_end[s] = begin + words;
+        }
+    }
+    row_words.swap(moved);
+}
+
+void Matrix::permute_rows(const vector<int> &order) {
+    assert(order.size() == row_lengths.size());
+
+    BitRow packed(num_rows);
+    for (int s = 0; s < num_rows; s++) {
+        if (row_packed.test(order[s])) {
+            packed.set(s);
+        }
+    }
+    row_packed = std::move(packed);
+    permute(row_begin, order);
+    permute(row_end, order);
+    permute(row_lengths, order);
+    permute(row_sums, order);
+    permute(row_weights, order);
+    permute(row_file_sizes, order);
+    permute(row_traces, order);
+    permute(row_names, order);
+    drop_list_skips();
+}
+
+void Matrix::find_sparse_cols() {
+    // reuse the bitmap, which only shrinks as columns go
+    sparse_cols.resize(num_cols);
+    sparse_cols.clear();
+    for (int c = 0; c < num_cols; c++) {
+        if (col_sums[c] <= 1) {
+            sparse_cols.set(c);
+        }
+    }
+}
+
+void Matrix::index_columns() const {
+    if (!col_begin.empty()) {
+        return;
+    }
+
+    // size each stored column's gaps, lay the columns out one after another
+    // and fill them in as the rows come. The rows come in stored order, so
+    // each column's rows come out sorted
+    size_t stored_cols = col_rank.size();
+    col_begin.assign(stored_cols + 1, 0);
+    vector<int> previous(stored_cols, -1);
+    for (int s : live_rows) {
+        for_each_stored(s, [this, s, &previous](INDEX c) {
+            if (col_active.test(c)) {
+                col_begin[c + 1] += varint_size(s - previous[c]);
+                previous[c] = s;
+            }
+        });
+    }
+    partial_sum(col_begin.begin(), col_begin.end(), col_begin.begin());
+
+    row_gaps.resize(col_begin[stored_cols]);
+    vector<size_t> next(col_begin.begin(), col_begin.end() - 1);
+    previous.assign(stored_cols, -1);
+    for (int s : live_rows) {
+        for_each_stored(s, [this, s, &next, &previous](INDEX c) {
+            if (col_active.test(c)) {
+                unsigned char *out = row_gaps.data() + next[c];
+                next[c] = write_varint(s - previous[c], out) - row_gaps.data();
+                previous[c] = s;
+            }
+        });
+    }
+}
+
+void Matrix::drop_column_index() {
+    row_gaps = vector<unsigned char>();
+    col_begin = vector<size_t>();
+}
 
-            advance(citer, 1);
+void Matrix::pack_row(int s, const INDEX *first, const INDEX *last) {
+    size_t words = col_active.num_words();
+    row_begin[s] = row_words.size();
+    row_words.resize(row_words.size() + words, 0);
+    row_end[s] = row_words.size();
+    row_packed.set(s);
+
+    BitRow::WORD *bits = row_words.data() + row_begin[s];
+    int length = 0;
+    for (const INDEX *c = first; c != last; ++c) {
+        if (*c >= 0 && *c < (int) col_active.size()) {
+            bits[*c / BitRow::WORD_BITS] |= BitRow::WORD(1)
+                                            << (*c % BitRow::WORD_BITS);
+            length++;
         }
+    }
+    row_lengths[s] = length;
+    stored_elems += length;
+}
 
-        assert(count == riter->row_sum);
-        advance(riter, 1);
+void Matrix::encode_row(int s, const INDEX *first, const INDEX *last) {
+    if ((size_t) s < skip_begin.size()) {
+        skip_begin[s] = SIZE_MAX;
+    }
+    row_begin[s] = col_gaps.size();
+    INDEX previous = -1;
+    int length = 0;
+    for (const INDEX *c = first; c != last; ++c) {
+        if (*c >= 0 && *c < (int) col_active.size()) {
+            put_varint(*c - previous, col_gaps);
+            previous = *c;
+            length++;
+        }
+    }
+    row_end[s] = col_gaps.size();
+    row_lengths[s] = length;
+    stored_elems += length;
+}
+
+void Matrix::compact_row(int s) {
+    // a gap over a dropped column is the sum of the gaps either side of it,
+    // which never takes more bytes than they did, so the row can be
+    // rewritten over itself. It has fewer skip points too, so if they've
+    // been built they are rewritten over the old ones
+    unsigned char *base = col_gaps.data() + row_begin[s];
+    unsigned char *out = base;
+    ListSkip *skips = nullptr;
+    if ((size_t) s < skip_begin.size() && skip_begin[s] != SIZE_MAX) {
+        skips = list_skips.data() + skip_begin[s];
+    }
+    INDEX previous = -1;
+    int length = 0;
+    for_each_stored(s, [&](INDEX c) {
+        if (col_active.test(c)) {
+            out = write_varint(c - previous, out);
+            previous = c;
+            length++;
+            if (skips && length % MATRIX_LIST_SKIP == 0) {
+                skips[length / MATRIX_LIST_SKIP - 1] =
+                    ListSkip{(size_t)(out - base), c};
+            }
+        }
+    });
+    row_end[s] = out - col_gaps.data();
+    row_lengths[s] = length;
+}
+
+const Matrix::ListSkip *Matrix::row_skips(int s) const {
+    if (skip_begin.size() <= (size_t) s) {
+        skip_begin.resize(row_begin.size(), SIZE_MAX);
+    }
+    if (skip_begin[s] == SIZE_MAX) {
+        skip_begin[s] = list_skips.size();
+        const unsigned char *base = col_gaps.data() + row_begin[s];
+        const unsigned char *in = base;
+        const unsigned char *end = col_gaps.data() + row_end[s];
+        INDEX c = -1;
+        for (int k = 1; in != end; k++) {
+            c += read_varint(in);
+            if (k % MATRIX_LIST_SKIP == 0) {
+                list_skips.push_back(ListSkip{(size_t)(in - base), c});
+            }
+        }
+    }
+
+    return list_skips.data() + skip_begin[s];
+}
+
+void Matrix::drop_list_skips() {
+    list_skips = vector<ListSkip>();
+    skip_begin = vector<size_t>();
+}
+
+void Matrix::maybe_compact() {
+    // every deleted column still takes a bit in each bitmap
+    if (num_elems < MATRIX_COMPACT_DENSITY * stored_elems ||
+        num_cols < MATRIX_COMPACT_DENSITY * col_rank.size()) {
+        compact();
     }
 }
 
@@ -395,20 +873,20 @@ long long Matrix::get_num_elements() const {
     return num_elems;
 }
 
-void Matrix::insert_row(RowElem &row) {
-    this->rowlist.push_back(row);
-    num_rows++;
-    num_elems += row.row_sum;
+void Matrix::insert_row(const path &exemplar, int file_size,
+                        const COL_DATA &columns, double weight, int trace) {
+    append_row(columns, exemplar, file_size, weight, trace);
+    drop_column_index();
 }
 
 void Matrix::remove_row(int r) {
-    INDEX_LIST del_list(r);
+    INDEX_LIST del_list(1, r);
     remove_rows(del_list);
 }
 
 void Matrix::remove_rows(INDEX_LIST &del_list) {
     for (auto r : del_list) {
-        if ((r < 0) || (r > num_rows)) {
+        if ((r < 0) || (r >= num_rows)) {
             throw out_of_range("remove_rows: row index out of range");
         }
     }
@@ -417,31 +895,53 @@ void Matrix::remove_rows(INDEX_LIST &del_list) {
     BOOST_LOG(mylog) << "MATRIX: "
                      << "removing " << del_list.size() << " rows";
 
-    // sort in descending order. This ordering will preserve the integrity of
-    // the row indices in the index list - that is they will be correct after
-    // we delete rows with higher index values.
-    sort(del_list.begin(), del_list.end(), std::greater<int>());
+    // clear the rows' active bits and take their ones off the column sums
     for (int r : del_list) {
-        auto iter = rowlist.begin();
-        advance(iter, r);
-        num_elems -= iter->row_sum;
-        rowlist.erase(iter, iter + 1); // delete this RowElem, shuffle the rest
-                                       // down (since rowlist is vector)
-        num_rows--;
-        assert(num_rows == (int) rowlist.size());
+        int s = live_rows[r];
+        if (row_active.test(s)) {
+            row_active.reset(s);
+            row_rank[s] = DELETED;
+            num_elems -= row_sums[r];
+            for_each_stored(s, [this](INDEX stored) {
+                INDEX c = col_rank[stored];
+                if (c != DELETED && --col_sums[c] <= 1) {
+                    sparse_cols.set(c);
+                }
+            });
+        }
     }
+
+    // then drop them from the live rows in one pass, which shuffles the rows
+    // after them down
+    int live = 0;
+    for (int r = 0; r < num_rows; r++) {
+        int s = live_rows[r];
+        if (row_active.test(s)) {
+            live_rows[live] = s;
+            row_sums[live] = row_sums[r];
+            row_rank[s] = live;
+            live++;
+        }
+    }
+    num_rows = live;
+    live_rows.resize(num_rows);
+    row_sums.resize(num_rows);
+
+    maybe_compact();
 }
 
 void Matrix::remove_col(int c) {
-    INDEX_LIST del_list(c);
+    INDEX_LIST del_list(1, c);
     remove_cols(del_list);
 }
 
 void Matrix::remove_cols(INDEX_LIST &del_list) {
+#ifdef MATRIX_DEBUG
     assert_row_sums();
+#endif
 
     for (auto c : del_list) {
-        if ((c < 0) || (c > num_cols)) {
+        if ((c < 0) || (c >= num_cols)) {
             throw out_of_range("remove_cols: column index out of range");
         }
     }
@@ -449,60 +949,324 @@ void Matrix::remove_cols(INDEX_LIST &del_list) {
     src::severity_logger<> &mylog = my_logger::get();
     BOOST_LOG(mylog) << "MATRIX: "
                      << "removing " << del_list.size() << " cols";
-    vector<int> Transform = transform_index(num_cols, del_list);
 
-    auto iter = rowlist.begin();
-    for (int r = 0; r < num_rows; r++) {
-        RowElem &element = *iter;        // ref! don't copy!
-        COL_DATA &data = element.column; // ref! don't copy!
-        int size = data.size();
-        int current_rowsum = element.row_sum;
-        int new_rowsum = 0;
-
-        // transform the column elements
-        for (int i = 0; i < size; i++) {
-            if (data[i] != DELETED) {
-                data[i] = Transform[data[i]];
-                if (data[i] != DELETED) {
-                    new_rowsum++;
+    // clear the columns' active bits
+    INDEX_LIST &gone = gone_cols;
+    gone.clear();
+    for (int c : del_list) {
+        int s = live_cols[c];
+        if (col_active.test(s)) {
+            col_active.reset(s);
+            gone.push_back(s);
+        }
+    }
+    if (gone.empty()) {
+        return;
+    }
+
+    // take them off the sums of the live rows they're in. With a column
+    // index that is a walk down each column, without one a scan of every row
+    // unless the columns are empty
+    long long ones = 0;
+    for (int s : gone) {
+        ones += col_sums[col_rank[s]];
+    }
+    if (!col_begin.empty()) {
+        for (int s : gone) {
+            IndexIterator end(row_gaps.data() + col_begin[s + 1], 0,
+                              row_rank.data());
+            for (IndexIterator i(row_gaps.data() + col_begin[s], -1,
+                                 row_rank.data());
+                 i != end; ++i) {
+                int r = *i;
+                if (r != DELETED) {
+                    row_sums[r]--;
+                }
+            }
+        }
+    } else if (ones > 0) {
+        // bitmap rows are counted against a bitmap of the columns a word at
+        // a time. It is kept clear between calls
+        if (gone_bits.size() != col_rank.size()) {
+            gone_bits.resize(col_rank.size());
+        }
+        for (int s : gone) {
+            gone_bits.set(s);
+        }
+        for (int r = 0; r < num_rows; r++) {
+            int s = live_rows[r];
+            if (row_packed.test(s)) {
+                const BitRow::WORD *bits = row_words.data() + row_begin[s];
+                for (size_t w = 0; w < gone_bits.num_words(); w++) {
+                    row_sums[r] -=
+                        __builtin_popcountll(bits[w] & gone_bits.data()[w]);
                 }
+            } else {
+                for_each_stored(s, [this, r](INDEX c) {
+                    if (gone_bits.test(c)) {
+                        row_sums[r]--;
+                    }
+                });
             }
         }
+        for (int s : gone) {
+            gone_bits.reset(s);
+        }
+    }
+    num_elems -= ones;
+
+    // renumber the columns after them
+    int live = 0;
+    for (int c = 0; c < num_cols; c++) {
+        INDEX s = live_cols[c];
+        if (col_active.test(s)) {
+            live_cols[live] = s;
+            col_sums[live] = col_sums[c];
+            col_rank[s] = live;
+            live++;
+        } else {
+            col_rank[s] = DELETED;
+        }
+    }
+    num_cols = live;
+    live_cols.resize(num_cols);
+    col_sums.resize(num_cols);
+    find_sparse_cols();
 
-        int delta = current_rowsum - new_rowsum;
-        element.row_sum = new_rowsum;
-        num_elems -= delta;
-        advance(iter, 1);
+    // list rows left mostly deleted columns are compacted by themselves
+    for (int r = 0; r < num_rows; r++) {
+        int s = live_rows[r];
+        if (!row_packed.test(s) &&
+            row_sums[r] < MATRIX_COMPACT_DENSITY * row_lengths[s]) {
+            compact_row(s);
+        }
     }
 
-    num_cols -= del_list.size();
+#ifdef MATRIX_DEBUG
     assert_row_sums();
+#endif
+    maybe_compact();
 }
 
-COLUMN Matrix::get_col(int c) const {
-    if (c < 0 || c >= num_cols) {
-        throw out_of_range("get_col: column index out of range");
+void Matrix::compact() {
+    src::severity_logger<> &mylog = my_logger::get();
+    BOOST_LOG(mylog) << "MATRIX: "
+                     << "compacting " << stored_elems
+                     << " elements to " << num_elems;
+
+    // the column index and skip points would have to be renumbered too, so
+    // they go, and are built again when they are next needed
+    drop_column_index();
+    drop_list_skips();
+
+    // each row is stored again whichever way is smaller with the deleted
+    // columns gone. The new bitmaps are no bigger than what their rows took
+    // before, and are built in an array of their own while the old ones are
+    // still being read
+    size_t words = (num_cols + BitRow::WORD_BITS - 1) / BitRow::WORD_BITS;
+    BitRow packed(num_rows);
+    long long ones = 0;
+    for (int r = 0; r < num_rows; r++) {
+        if (packs(row_sums[r], num_cols)) {
+            packed.set(r);
+            ones += row_sums[r];
+        }
     }
 
-    COLUMN result(num_rows, 0);
-    auto riter = rowlist.begin();
+    vector<BitRow::WORD> bitmaps(packed.count() * words, 0);
+    vector<size_t> begin(num_rows);
+    vector<size_t> end(num_rows);
+    size_t next = 0;
+    for (int r = 0; r < num_rows; r++) {
+        if (packed.test(r)) {
+            BitRow::WORD *bits = bitmaps.data() + next;
+            for_each_stored(live_rows[r], [this, bits](INDEX stored) {
+                INDEX c = col_rank[stored];
+                if (c != DELETED) {
+                    bits[c / BitRow::WORD_BITS] |= BitRow::WORD(1)
+                                                   << (c % BitRow::WORD_BITS);
+                }
+            });
+            begin[r] = next;
+            next += words;
+            end[r] = next;
+        }
+    }
 
+    // slide each list row's live columns down over everything else,
+    // renumbering them as they go. The rows are moved in the order they lie
+    // in the array, and renumbering or dropping columns never makes a gap
+    // take more bytes, so no row is overwritten before it has moved and
+    // nothing is allocated
+    vector<int> order;
     for (int r = 0; r < num_rows; r++) {
-        const RowElem &element = *riter;
-        const COL_DATA &data = element.column;
-        int size = data.size();
-        int i = 0;
+        if (!packed.test(r) && !row_packed.test(live_rows[r])) {
+            order.push_back(r);
+        }
+    }
+    sort(order.begin(), order.end(), [this](int a, int b) {
+        return row_begin[live_rows[a]] < row_begin[live_rows[b]];
+    });
+    unsigned char *out = col_gaps.data();
+    for (int r : order) {
+        INDEX previous = -1;
+        begin[r] = out - col_gaps.data();
+        for_each_stored(live_rows[r], [this, &out, &previous](INDEX stored) {
+            INDEX c = col_rank[stored];
+            if (c != DELETED) {
+                out = write_varint(c - previous, out);
+                previous = c;
+            }
+        });
+        end[r] = out - col_gaps.data();
+    }
+    col_gaps.resize(out - col_gaps.data());
 
-        // scan through the vector to see if we have that column
-        while ((i < size) && ((data[i] < c) || (data[i] == DELETED))) {
-            i++; // scan passed...
+    // rows that were bitmaps but are lists now go on the end
+    for (int r = 0; r < num_rows; r++) {
+        if (!packed.test(r) && row_packed.test(live_rows[r])) {
+            INDEX previous = -1;
+            begin[r] = col_gaps.size();
+            for_each_stored(live_rows[r], [this, &previous](INDEX stored) {
+                INDEX c = col_rank[stored];
+                if (c != DELETED) {
+                    put_varint(c - previous, col_gaps);
+                    previous = c;
+                }
+            });
+            end[r] = col_gaps.size();
         }
+    }
+    if (col_gaps.size() < MATRIX_COMPACT_DENSITY * col_gaps.capacity()) {
+        col_gaps.shrink_to_fit();
+    }
+    row_words = std::move(bitmaps);
+    row_packed = packed;
+    stored_elems = num_elems;
 
-        if (i < size && data[i] == c) {
-            result[r] = 1;
+    // the live rows are in stored order, so each moves down or stays put
+    for (int r = 0; r < num_rows; r++) {
+        int s = live_rows[r];
+        row_begin[r] = begin[r];
+        row_end[r] = end[r];
+        row_lengths[r] = row_sums[r];
+        row_weights[r] = row_weights[s];
+        row_file_sizes[r] = row_file_sizes[s];
+        row_traces[r] = row_traces[s];
+        row_names[r] = row_names[s];
+        live_rows[r] = r;
+    }
+    row_begin.resize(num_rows);
+    row_end.resize(num_rows);
+    row_lengths.resize(num_rows);
+    row_weights.resize(num_rows);
+    row_file_sizes.resize(num_rows);
+    row_traces.resize(num_rows);
+    row_names.resize(num_rows);
+    row_active = BitRow(num_rows);
+    row_rank.resize(num_rows);
+    for (int r = 0; r < num_rows; r++) {
+        row_active.set(r);
+        row_rank[r] = r;
+    }
+
+    // the live columns are in stored order too
+    for (int c = 0; c < num_cols; c++) {
+        col_origin[c] = col_origin[live_cols[c]];
+    }
+    col_origin.resize(num_cols);
+    reset_columns(num_cols);
+}
+
+void Matrix::order_columns() {
+    compact();
+
+    src::severity_logger<> &mylog = my_logger::get();
+    BOOST_LOG(mylog) << "MATRIX: "
+                     << "ordering " << num_cols << " columns by frequency";
+
+    vector<INDEX> order(num_cols);
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(),
+                [this](INDEX a, INDEX b) { return col_sums[a] > col_sums[b]; });
+    vector<INDEX> renumber(num_cols);
+    for (int k = 0; k < num_cols; k++) {
+        renumber[order[k]] = k;
+    }
+
+    // each row is stored again in the same form. Walking down the columns
+    // in their new order hands each row its new columns in order, once to
+    // size the lists and once to fill them and the bitmaps in
+    index_columns();
+    vector<size_t> next(num_rows + 1, 0);
+    vector<INDEX> previous(num_rows, -1);
+    for (int k = 0; k < num_cols; k++) {
+        const unsigned char *column = row_gaps.data() + col_begin[order[k]];
+        const unsigned char *end = row_gaps.data() + col_begin[order[k] + 1];
+        for_each_gap(column, end, [this, k, &next, &previous](int r) {
+            if (!row_packed.test(r)) {
+                next[r + 1] += varint_size(k - previous[r]);
+                previous[r] = k;
+            }
+        });
+    }
+    partial_sum(next.begin(), next.end(), next.begin());
+
+    vector<unsigned char> gaps(next[num_rows]);
+    vector<BitRow::WORD> words(row_words.size(), 0);
+    previous.assign(num_rows, -1);
+    for (int k = 0; k < num_cols; k++) {
+        const unsigned char *column = row_gaps.data() + col_begin[order[k]];
+        const unsigned char *end = row_gaps.data() + col_begin[order[k] + 1];
+        for_each_gap(column, end,
+                     [this, k, &words, &gaps, &next, &previous](int r) {
+            if (row_packed.test(r)) {
+                words[row_begin[r] + k / BitRow::WORD_BITS] |=
+                    BitRow::WORD(1) << (k % BitRow::WORD_BITS);
+            } else {
+                next[r] = write_varint(k - previous[r], gaps.data() + next[r]) -
+                          gaps.data();
+                previous[r] = k;
+            }
+        });
+    }
+    drop_column_index();
+    drop_list_skips();
+
+    size_t length = 0;
+    for (int r = 0; r < num_rows; r++) {
+        if (!row_packed.test(r)) {
+            row_begin[r] = length;
+            length = next[r];
+            row_end[r] = length;
         }
+    }
+    col_gaps.swap(gaps);
+    row_words.swap(words);
+
+    COLUMN_SUM sums(num_cols);
+    vector<INDEX> origin(num_cols);
+    for (int c = 0; c < num_cols; c++) {
+        sums[renumber[c]] = col_sums[c];
+        origin[renumber[c]] = col_origin[c];
+    }
+    col_sums.swap(sums);
+    col_origin.swap(origin);
+    find_sparse_cols();
+}
 
-        advance(riter, 1);
+COLUMN Matrix::get_col(int c) const {
+    if (c < 0 || c >= num_cols) {
+        throw out_of_range("get_col: column index out of range");
+    }
+
+    COLUMN result(num_rows, 0);
+    IndexIterator end = rows_end(c);
+    for (IndexIterator i = rows_begin(c); i != end; ++i) {
+        int r = *i;
+        if (r != DELETED) {
+            result[r] = 1;
+        }
     }
 
     return result;
@@ -513,16 +1277,8 @@ ROW Matrix::get_row(int r) const {
         throw out_of_range("get_row: row index out of range");
     }
 
-    ROW result(num_cols, 0);
-    auto iter = rowlist.begin();
-    advance(iter, r);                          // find the row
-    const COL_DATA &columndata = iter->column; // ref! don't copy!
-
-    for (INDEX value : columndata) {
-        if (value != DELETED) {
-            result[value] = 1;
-        }
-    }
+    ROW result(num_cols);
+    for_each_column(r, [&result](INDEX c) { result.set(c); });
 
     return result;
 }
@@ -532,91 +1288,152 @@ bool Matrix::is_row_column_set(int r, int c) const {
         throw out_of_range("is_row_column_set: index out of range");
     }
 
-    auto riter = rowlist.begin();
-    advance(riter, r);
-    const COL_DATA &data = riter->column; // ref! don't copy!
-    int size = data.size();
-
-    // scan through the vector to see if we have that column
-    int idx = 0;
-    while ((idx < size) && ((data[idx] < c) || (data[idx] == DELETED))) {
-        idx++; // scan passed...
+    int s = live_rows[r];
+    if (row_packed.test(s)) {
+        return test_bit(row_words.data() + row_begin[s], live_cols[c]);
     }
 
-    // we are either at the position where the column should be or gone passed
-    // it
-    if ((idx < size) && (data[idx] == c)) {
-        // this row has the column
-        return true;
+    // the row's stored column numbers are sorted, so the search starts at
+    // the last skip point before the column and stops at the first number
+    // that isn't less
+    INDEX column = live_cols[c];
+    const unsigned char *in = col_gaps.data() + row_begin[s];
+    const unsigned char *end = col_gaps.data() + row_end[s];
+    INDEX stored = -1;
+    int num_skips = row_lengths[s] / MATRIX_LIST_SKIP;
+    if (num_skips > 0) {
+        const ListSkip *skips = row_skips(s);
+        const ListSkip *after = lower_bound(
+            skips, skips + num_skips, column,
+            [](const ListSkip &skip, INDEX c) { return skip.column < c; });
+        if (after != skips) {
+            in = col_gaps.data() + row_begin[s] + after[-1].offset;
+            stored = after[-1].column;
+        }
+    }
+    while (in != end && stored < column) {
+        stored += read_varint(in);
     }
 
-    // we don't have the column
-    return false;
+    return stored == column;
 }
 
-ROW_SUM Matrix::get_row_sum() const {
-    ROW_SUM result(num_rows, 0);
-    auto iter = rowlist.begin();
+const ROW_SUM &Matrix::get_row_sum() const {
+    return row_sums;
+}
 
-    for (int r = 0; r < num_rows; r++) {
-        result[r] = iter->row_sum;
-        advance(iter, 1);
-    }
+const COLUMN_SUM &Matrix::get_column_sum() const {
+    return col_sums;
+}
+
+INDEX_LIST Matrix::get_singular_cols() const {
+    INDEX_LIST result;
+    sparse_cols.for_each_set([this, &result](int c) {
+        if (col_sums[c] == 0) {
+            result.push_back(c);
+        }
+    });
 
     return result;
 }
 
-COLUMN_SUM Matrix::get_column_sum() const {
-    COLUMN_SUM result(num_cols, 0);
-    auto iter = rowlist.begin();
-
-    for (int r = 0; r < num_rows; r++) {
-        const COL_DATA &columndata = rowlist[r].column; // TODO: bad for lists
-        for (INDEX value : columndata) {
-            if (value != DELETED) {
-                result[value]++;
-            }
+INDEX_LIST Matrix::get_unitarian_cols() const {
+    INDEX_LIST result;
+    sparse_cols.for_each_set([this, &result](int c) {
+        if (col_sums[c] == 1) {
+            result.push_back(c);
         }
-        advance(iter, 1);
-    }
+    });
 
     return result;
 }
 
 int Matrix::get_overlap(int r1, int r2) const {
-    if (r1 < 0 || r2 < 0 || r1 > num_rows || r2 > num_rows) {
+    if (r1 < 0 || r2 < 0 || r1 >= num_rows || r2 >= num_rows) {
         throw out_of_range("get_overlap: row index not in range");
     }
 
     int result = 0;
-    auto iter1 = rowlist.begin();
-    auto iter2 = rowlist.begin();
-    advance(iter1, r1);
-    advance(iter2, r2);
-    const COL_DATA &columndata1 = iter1->column;
-    const COL_DATA &columndata2 = iter2->column;
-    unsigned int j = 0;
-
-    for (unsigned int i = 0; i < columndata1.size(); i++) {
-        if (columndata1[i] == DELETED) {
-            continue;
+    int s1 = live_rows[r1];
+    int s2 = live_rows[r2];
+    if (row_packed.test(s1) && row_packed.test(s2)) {
+        // bitmaps of the same stored columns: count a word at a time
+        const BitRow::WORD *bits1 = row_words.data() + row_begin[s1];
+        const BitRow::WORD *bits2 = row_words.data() + row_begin[s2];
+        const BitRow::WORD *live = col_active.data();
+        for (size_t w = 0; w < col_active.num_words(); w++) {
+            result += __builtin_popcountll(bits1[w] & bits2[w] & live[w]);
         }
+    } else if (row_packed.test(s1) || row_packed.test(s2)) {
+        // look each live column of the list up in the bitmap
+        if (row_packed.test(s1)) {
+            swap(s1, s2);
+        }
+        const BitRow::WORD *bits2 = row_words.data() + row_begin[s2];
+        for_each_stored(s1, [this, bits2, &result](INDEX c) {
+            if (col_active.test(c) && test_bit(bits2, c)) {
+                result++;
+            }
+        });
+    } else {
+        result = list_overlap(s1, s2);
+    }
+
+    assert(result <= get_row_sum(r1) && result <= get_row_sum(r2));
+
+    return result;
+}
 
-        while (j < columndata2.size() && columndata2[j] < columndata1[i]) {
-            j++;
+int Matrix::list_overlap(int s1, int s2) const {
+    // both rows are sorted by stored column, which sorts the live columns
+    // the same way as their current indices. The shorter row is decoded, and
+    // the longer one only as far as each live column of it, jumping from
+    // skip point to skip point over the stretches in between
+    if (row_lengths[s1] > row_lengths[s2]) {
+        swap(s1, s2);
+    }
+    int result = 0;
+    const unsigned char *in1 = col_gaps.data() + row_begin[s1];
+    const unsigned char *end1 = col_gaps.data() + row_end[s1];
+    const unsigned char *in2 = col_gaps.data() + row_begin[s2];
+    const unsigned char *end2 = col_gaps.data() + row_end[s2];
+    const ListSkip *skip = nullptr;
+    const ListSkip *last_skip = nullptr;
+    if (row_lengths[s2] >= MATRIX_LIST_SKIP) {
+        skip = row_skips(s2);
+        last_skip = skip + row_lengths[s2] / MATRIX_LIST_SKIP;
+    }
+    INDEX c1 = -1;
+    INDEX c2 = -1;
+
+    while (in1 != end1) {
+        c1 += read_varint(in1);
+        if (!col_active.test(c1)) {
+            continue;
         }
 
-        if (j >= columndata2.size()) {
+        if (skip != last_skip && skip->column < c1) {
+            const ListSkip *after = lower_bound(
+                skip, last_skip, c1,
+                [](const ListSkip &k, INDEX c) { return k.column < c; });
+            if (after[-1].column > c2) {
+                in2 = col_gaps.data() + row_begin[s2] + after[-1].offset;
+                c2 = after[-1].column;
+            }
+            skip = after;
+        }
+        while (c2 < c1 && in2 != end2) {
+            c2 += read_varint(in2);
+        }
+        if (c2 < c1) {
             break;
         }
 
-        if (columndata2[j] == columndata1[i]) {
+        if (c2 == c1) {
             result++;
         }
     }
 
-    assert(result <= get_row_sum(r1) && result <= get_row_sum(r2));
-
     return result;
 }
 
@@ -625,10 +1442,33 @@ path Matrix::get_row_exemplar(int r) const {
         throw out_of_range("get_row_exemplar: row index out of range");
     }
 
-    auto riter = rowlist.begin();
-    advance(riter, r);
+    return name(row_names[live_rows[r]]);
+}
 
-    return riter->file_path;
+int Matrix::get_row_exemplar_rank(int r) const {
+    if (r < 0 || r >= num_rows) {
+        throw out_of_range("get_row_exemplar_rank: row index out of range");
+    }
+
+    rank_names();
+    return name_ranks[row_names[live_rows[r]]];
+}
+
+void Matrix::set_trace_source(shared_ptr<const CorpusReader> source) {
+    trace_source = source;
+}
+
+ROW Matrix::get_row_trace(int r) const {
+    if (r < 0 || r >= num_rows) {
+        throw out_of_range("get_row_trace: row index out of range");
+    }
+
+    int s = live_rows[r];
+    if (trace_source && row_traces[s] >= 0) {
+        return trace_source->read_row(row_traces[s]);
+    }
+
+    return get_exemplar_data(name(row_names[s]));
 }
 
 int Matrix::get_row_file_size(int r) const {
@@ -636,10 +1476,7 @@ int Matrix::get_row_file_size(int r) const {
         throw out_of_range("get_row_file_size: row index out of range");
     }
 
-    auto riter = rowlist.begin();
-    advance(riter, r);
-
-    return riter->file_size;
+    return row_file_sizes[live_rows[r]];
 }
 
 double Matrix::get_row_weight(int r) const {
@@ -647,10 +1484,7 @@ double Matrix::get_row_weight(int r) const {
         throw out_of_range("get_row_file_size: row index out of range");
     }
 
-    auto riter = rowlist.begin();
-    advance(riter, r);
-
-    return riter->weight;
+    return row_weights[live_rows[r]];
 }
 
 int Matrix::get_row_sum(int r) const {
@@ -658,38 +1492,33 @@ int Matrix::get_row_sum(int r) const {
         throw out_of_range("get_row_sum: row index out of range");
     }
 
-    auto riter = rowlist.begin();
-    advance(riter, r);
-
-    return riter->row_sum;
+    return row_sums[r];
 }
 
-vector<RowElem>::iterator Matrix::rowlist_begin() {
-    return rowlist.begin();
-}
+INDEX Matrix::get_col_origin(int c) const {
+    if ((c < 0) || (c >= num_cols)) {
+        throw out_of_range("get_col_origin: column index out of range");
+    }
 
-vector<RowElem>::iterator Matrix::rowlist_end() {
-    return rowlist.end();
+    return col_origin[live_cols[c]];
 }
 
-COL_DATA::iterator Matrix::column_begin(int row) {
-    if ((row < 0) || (row >= num_rows)) {
-        throw out_of_range("columnbegin: index out of range");
+IndexIterator Matrix::rows_begin(int col) const {
+    if ((col < 0) || (col >= num_cols)) {
+        throw out_of_range("rows_begin: index out of range");
     }
 
-    auto riter = rowlist.begin();
-    advance(riter, row);
-
-    return riter->column.begin();
+    index_columns();
+    return IndexIterator(row_gaps.data() + col_begin[live_cols[col]], -1,
+                         row_rank.data());
 }
 
-COL_DATA::iterator Matrix::column_end(int row) {
-    if ((row < 0) || (row >= num_rows)) {
-        throw out_of_range("columnbegin: index out of range");
+IndexIterator Matrix::rows_end(int col) const {
+    if ((col < 0) || (col >= num_cols)) {
+        throw out_of_range("rows_end: index out of range");
     }
 
-    auto riter = rowlist.begin();
-    advance(riter, row);
-
-    return riter->column.end();
+    index_columns();
+    return IndexIterator(row_gaps.data() + col_begin[live_cols[col] + 1], 0,
+                         row_rank.data());
 }
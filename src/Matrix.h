@@ -40,198 +40,197 @@
  * * I need to be able to _delete rows and columns_. I do _not_ need to be able
  *   to insert rows and columns.
  *
- * This implementation will be a _List of Lists_ implementation in row major
- * format.
+ * This implementation stores the matrix in row major compressed sparse row
+ * (CSR) form: the column indices of every row in one array, and each row's
+ * meta data in arrays of their own.
  */
 
 #ifndef MATRIX_H
 #define MATRIX_H
 
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
-#include <boost/serialization/vector.hpp>
+#include <boost/filesystem/path.hpp>
 
+#include "BitRow.h"
+#include "ColumnCodec.h"
 #include "moonlight.h"
 
-#define DELETED -1
+class CorpusReader;
 
 /**
- * \brief Each row in the matrix is represented as a row element.
- *
- * A row element is stored in the matrix in a doubly linked list. Overall
- * we are implementing a List of Lists data model of a matrix. We record useful
- * information about each row such as which exemplar it models, the file size
- * and most importantly the column data.
+ * Compact the matrix storage once fewer than this fraction of the stored
+ * column indices belong to live rows and columns, and a row once fewer than
+ * this fraction of its stored column indices belong to live columns
  */
-class RowElem {
-    ///////////////////////////////////////////////////////////////////////
-    // Serialisation
-    ///////////////////////////////////////////////////////////////////////
-
-    friend class boost::serialization::access;
-    friend std::ostream &operator<<(std::ostream &os, const RowElem &element);
-
-    template <class Archive>
-    void save(Archive &ar, const unsigned int version) const {
-        // we don't serialise 'path' objects but the string representation
-        std::string fname = file_path.native();
-        ar &file_size;
-        ar &row_sum;
-        ar &fname; // string version of path
-        ar &column;
-        ar &weight;
-    }
-
-    template <class Archive>
-    void load(Archive &ar, const unsigned int version) {
-        // we don't serialise 'path' objects but the string representation
-        std::string fname;
-        ar &file_size;
-        ar &row_sum;
-        ar &fname; // string version of path
-        ar &column;
-        ar &weight;
-        this->file_path = boost::filesystem::path(fname); // recreate
-    }
+const double MATRIX_COMPACT_DENSITY = 0.5;
 
-    BOOST_SERIALIZATION_SPLIT_MEMBER()
+/**
+ * A row stored as a list keeps a skip point after every this many column
+ * numbers, so a search of it needn't decode it from the start
+ */
+const int MATRIX_LIST_SKIP = 64;
 
+/**
+ * \brief Iterator over the row indices of a column of a Matrix.
+ *
+ * Rows keep the numbers they had when they were stored, so each is looked up
+ * in the matrix's current numbering as it is read. Rows that have been
+ * deleted read as DELETED. The stored numbers are decoded from their gaps
+ * as the iterator moves.
+ */
+class IndexIterator {
 public:
-    /** default constructor */
-    RowElem();
-
-    RowElem(boost::filesystem::path file, int filesize, int sum, double weight);
+    using iterator_category = std::input_iterator_tag;
+    using value_type = INDEX;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const INDEX *;
+    using reference = INDEX;
 
     /**
-     * \brief Constructor to create a row element given a path to the exemplar
-     * file and a column index transform. If all columns are to be read in then
-     * the identity transform is used.
-     *
-     * \todo There is an open question to whether there is a genuine
-     * performance benefit of having multiple worker threads concurrently
-     * making calls to this method to process batches of exemplar files
-     * together. The real question behind this is whether there is a
-     * performance benefit in concurrent file IO and this is influenced
-     * significantly by the underlying kernel support and disk and controller
-     * hardware and technology. I let some young coding ninja work this out :-)
-     *
-     * \param exemplar path to the exemplar file
-     * \param column index transform (new_index = transform[old_index]) so that
-     * a set of columns can be ignored
+     * \param gap position in the column's gaps between stored row numbers
+     * \param previous the stored row number before it, -1 at the start
+     * \param rank each stored row's current index, or DELETED
      */
-    RowElem(const boost::filesystem::path &exemplar,
-            const std::vector<int> &init_col_transform);
+    IndexIterator(const unsigned char *gap, INDEX previous, const INDEX *rank)
+        : gap(gap), previous(previous), rank(rank) {
+    }
 
-    /** Size of trace file in bytes */
-    int file_size;
+    INDEX operator*() const {
+        const unsigned char *in = gap;
+        return rank[previous + read_varint(in)];
+    }
 
-    /** Number of ones in the row */
-    int row_sum;
+    IndexIterator &operator++() {
+        previous += read_varint(gap);
+        return *this;
+    }
 
-    /** Path to the exemplar file */
-    boost::filesystem::path file_path;
+    IndexIterator operator++(int) {
+        IndexIterator before = *this;
+        ++*this;
+        return before;
+    }
 
-    /** Sequence of non-zero column indices for this row */
-    COL_DATA column;
+    bool operator==(const IndexIterator &other) const {
+        return gap == other.gap;
+    }
 
-    /** The file weighting (for weighted set cover problem) */
-    double weight;
+    bool operator!=(const IndexIterator &other) const {
+        return gap != other.gap;
+    }
 
-    /**
-     * \brief Two RowElem objects are equivalent iff they have the same column
-     * values irrespective of exemplar file...
-     */
-    bool operator==(const RowElem &other) const;
+private:
+    const unsigned char *gap;
+    INDEX previous;
+    const INDEX *rank;
 };
 
-BOOST_CLASS_VERSION(RowElem, 0)
-
 /**
  * \brief Matrix is a data model for a logical sparse matrix.
  *
- * The matrix data model is a __list of lists__ abstraction in row major format.
- * The row list is a doubly linked list of RowElement objects ordered by row
- * index. Each RowElement object contains some meta data about the row such
- * the path to the exemplar file, the file size, the row sum and most
- * importantly a list of column indices.
+ * The matrix data model is __compressed sparse row__. The sorted column
+ * indices of each row lie one row after another in a single byte array,
+ * each row as the gaps between its indices in the varint encoding of
+ * ColumnCodec.h, and a row is the range of that array between its begin and
+ * end offsets. Most gaps take a single byte. Rows are read from start to
+ * end, except that a search of a row decodes it from the nearest of the
+ * skip points it keeps after every MATRIX_LIST_SKIP columns. A row
+ * with ones in more than one in 32 columns takes less room as a bitmap, so
+ * those rows are stored that way instead, one after another in an array of
+ * their own, and operations on two of them are done a word at a time. The
+ * meta data about the rows (the row sum, the weight, the file size, the
+ * trace and the exemplar file name) is kept in one array per field, and the
+ * exemplar file names in a single table of names, so a row costs no heap
+ * allocations of its own and a scan over rows or columns walks contiguous
+ * memory.
  *
  * The column data records only the indices of columns where there is a one
  * in the matrix. If a column index is not present in the list it is assumed
  * to be zero. This results in a large memory saving for sparse matrices.
  * Specifically, the memory requirements are
- *  * 32bits times number of ones in the matrix, plus
- *  * number of rows times sizeof(RowElement)
+ *  * 8bits times number of ones in the row, or more where the ones are
+ *    over 128 columns apart, or 1bit per column for a row with ones in
+ *    more than one in 32 columns, for each row, plus
+ *  * a byte or two times number of ones in the matrix once there is a
+ *    column index, plus
+ *  * about 48 bytes plus the length of the exemplar path per row
  *
  * In practice, the first factor dominates the memory requirements given real
  * data.
  *
+ * Rows needn't lie in the column array in row order: the matrix is built by
+ * appending rows in the order their traces are read.
+ *
+ * Alongside the rows the matrix keeps a __compressed sparse column__ index:
+ * the sorted row indices of each column, one column after another, each
+ * column as the varint gaps between its indices like the rows. Column
+ * queries, column sums and the row sum updates when columns are deleted
+ * then take time in proportion to the columns involved rather than to the
+ * whole matrix. The index costs as much memory again as the rows, so it is
+ * only built when a column is first asked for. Deletions keep it up to date,
+ * but inserting a row or compacting the matrix drops it until it is next
+ * needed.
+ *
  * This implementation supports row and column deletions but __not__ insertions
- * apart from the obvious initial matrix construction. Row operations are
- * generally efficient but column operations, and deletions in particular, are
- * more difficult - a direct consequence of our list of lists data model. One
- * interesting aspect of column deletions is my choice __not__ to actually
- * release storage of any deleted column indices in the lists. Instead I simply
- * mark these elements as "deleted" and decrement the greater indices.
- * Consequently the column lists never get smaller and memory requirements
- * remain constant. It is a complex balance of considerations whether
- * ultimately this might be beneficial to our application but one I choose to
- * completely ignore as a distraction to my goals. If you're interested in
- * having a look go fill your boots mate. Oh, and also look at the
- * multi-threaded file IO performance question as well while you're at it...
+ * apart from the obvious initial matrix construction. Deletions are lazy:
+ * each stored row and column keeps the number it was stored with, deleting
+ * it just clears its bit in the row or column active bitmap, and the rows
+ * and columns of the matrix are the live ones in stored order. Deleting is
+ * then about as cheap as the list of rows or columns to delete, plus
+ * updating the row sums, rather than a rewrite of every row. Once the live
+ * rows and columns hold less than MATRIX_COMPACT_DENSITY of the stored
+ * column indices, or the live columns are less than that fraction of the
+ * stored ones, the storage is compacted, the stored numbers start again
+ * from the current ones, and each row is stored whichever way is smaller at
+ * the new number of columns. A row whose own live columns fall
+ * below that fraction of its stored ones is compacted by itself before
+ * then, so scans of it stop paying for the columns it had.
  */
 class Matrix {
-    ///////////////////////////////////////////////////////////////////////
-    // serialisation
-    ///////////////////////////////////////////////////////////////////////
-
-    friend class boost::serialization::access;
     friend std::ostream &operator<<(std::ostream &os, const Matrix &matrix);
-
-    template <class Archive>
-    void save(Archive &ar, unsigned int version) const {
-        // we don't serialise 'path' objects but the string representation
-        std::string dname = directory.native();
-        ar &num_rows;
-        ar &num_cols;
-        ar &num_cols_orig;
-        ar &num_elems;
-        ar &dname; // TODO verify
-        ar &pattern;
-        ar &rowlist;
-    }
-
-    template <class Archive> void load(Archive &ar, unsigned int version) {
-        // we don't serialise 'path' objects but the string representation
-        std::string dname;
-        ar &num_rows;
-        ar &num_cols;
-        ar &num_cols_orig;
-        ar &num_elems;
-        ar &dname; // TODO verify
-        ar &pattern;
-        ar &rowlist;
-        this->directory = boost::filesystem::path(dname); // recreate
-    }
-
-    BOOST_SERIALIZATION_SPLIT_MEMBER()
+    friend class MatrixCache;
 
 public:
     /** Default constructor */
     Matrix();
 
-    /** Useful constructor */
+    /** Useful constructor: a matrix of zeros */
     Matrix(int rows, int columns);
 
-    /** Useful constructor */
+    /**
+     * \brief Construct the matrix from the trace files in a corpus directory.
+     *
+     * \param directory the corpus directory
+     * \param pattern regex selecting the trace files in the directory
+     * \param weight_file exemplar weights. Empty path for unweighted
+     * \param cols_to_ignore trace column indices to leave out of the matrix
+     * \param num_threads number of decoding threads. Zero for one per core
+     */
     Matrix(const boost::filesystem::path &directory, const std::string &pattern,
            const boost::filesystem::path &weight_file,
-           INDEX_LIST cols_to_ignore);
+           INDEX_LIST cols_to_ignore, int num_threads);
+
     /**
-     * \brief Useful constructor
+     * \brief Construct the matrix from the traces of a corpus.
      *
-     * Restore Matrix from serialised data file
+     * Rows are ordered by trace file size, largest first. The traces are
+     * decoded concurrently by num_threads worker threads but always inserted
+     * in that order, so the matrix is identical whatever the thread count.
+     *
+     * \param source the corpus traces
+     * \param weight_file exemplar weights. Empty path for unweighted
+     * \param cols_to_ignore trace column indices to leave out of the matrix
+     * \param num_threads number of decoding threads. Zero for one per core
      */
-    Matrix(const boost::filesystem::path &matrixfile);
+    Matrix(const CorpusReader &source,
+           const boost::filesystem::path &weight_file,
+           INDEX_LIST cols_to_ignore, int num_threads);
 
     /** Copy constructor */
     Matrix(const Matrix &orig);
@@ -239,11 +238,17 @@ public:
     /** Copy assignment */
     Matrix &operator=(const Matrix &orig);
 
-    /** Move constructor */
-    Matrix(const Matrix &&orig) noexcept;
+    /**
+     * \brief Move constructor. The matrix moved from is left without rows or
+     * columns
+     */
+    Matrix(Matrix &&orig) noexcept;
 
-    /** Move assignment */
-    Matrix &operator=(const Matrix &&orig) noexcept;
+    /**
+     * \brief Move assignment. The matrix moved from is left without rows or
+     * columns
+     */
+    Matrix &operator=(Matrix &&orig) noexcept;
 
     ///////////////////////////////////////////////////////////////////////
     // API
@@ -281,37 +286,53 @@ public:
     long long get_num_elements() const;
 
     /**
-     * \return Iterator to start of rowlist. Allows direct access to the
-     * RowElems that make up the matrix
-     */
-    std::vector<RowElem>::iterator rowlist_begin();
-
-    /**
-     * \return Iterator to end of rowlist. Allows direct access to the RowElems
-     * that make up the matrix
+     * \brief Call f(column index) for each one in a row, in increasing
+     * column order.
+     *
+     * \param row row index
+     * \param f called with each column index
+     * \throws out_of_range exception if row index is negative or too big.
      */
-    std::vector<RowElem>::iterator rowlist_end();
+    template <typename F> void for_each_column(int row, F f) const {
+        if ((row < 0) || (row >= num_rows)) {
+            throw std::out_of_range("for_each_column: index out of range");
+        }
+
+        for_each_stored(live_rows[row], [this, &f](INDEX stored) {
+            INDEX c = col_rank[stored];
+            if (c != DELETED) {
+                f(c);
+            }
+        });
+    }
 
     /**
-     * \return Iterator to start of vector of column indices for given row
+     * \return Iterator to start of the row indices for given column, in
+     * increasing order. Deleted rows show up as DELETED
      */
-    COL_DATA::iterator column_begin(int row);
+    IndexIterator rows_begin(int col) const;
 
     /**
-     * \return Iterator to end of vector of column indices for given row
+     * \return Iterator to end of the row indices for given column
      */
-    COL_DATA::iterator column_end(int row);
+    IndexIterator rows_end(int col) const;
 
     /**
      * \brief Insert a row into the matrix.
      *
-     * After the matrix is constructed it is empty of any data. This method
-     * simply allows you to install a new row to the end of the matrix.
-     * Assumption is that the number of rows inserted is equal to the number
-     * of rows provided in the constructor. Behaviour is undefined if that is
-     * not the case.
+     * This method simply allows you to install a new row to the end of the
+     * matrix.
+     *
+     * \param exemplar path to the exemplar file the row was constructed from
+     * \param file_size size of the exemplar's trace in bytes
+     * \param columns sorted column indices of the ones in the row, numbered
+     * as they were before any columns were deleted
+     * \param weight the exemplar's weight
+     * \param trace index of the trace in the corpus the row was read from
+     * (see set_trace_source()). -1 if unknown
      */
-    void insert_row(RowElem &row);
+    void insert_row(const boost::filesystem::path &exemplar, int file_size,
+                    const COL_DATA &columns, double weight, int trace = -1);
 
     /**
      * \brief Delete a row from the matrix.
@@ -362,6 +383,38 @@ public:
      */
     void remove_cols(INDEX_LIST &del_list);
 
+    /**
+     * \brief Drop the storage of deleted rows and columns.
+     *
+     * Row and column indices are unchanged. Deletions compact the matrix
+     * themselves when it gets sparse enough (see MATRIX_COMPACT_DENSITY), so
+     * this is only needed to get the matrix as small as it can be.
+     */
+    void compact();
+
+    /**
+     * \brief Renumber the columns, most ones first.
+     *
+     * Columns with the same number of ones keep their order. The matrix is
+     * compacted first. Rows that share many columns then have them close
+     * together, which makes the rows smaller and puts the column sums a
+     * scan of a row touches closer together. Each column remembers the
+     * column of the traces it stands for (see get_col_origin()).
+     */
+    void order_columns();
+
+    /**
+     * \brief The column of the row traces a column of the matrix stands for.
+     *
+     * That is the column itself unless columns were ignored when the matrix
+     * was built, or have been deleted or renumbered since.
+     *
+     * \param c column index
+     * \return the column of the row traces (see get_row_trace())
+     * \throws out_of_range exception if column index is negative or too big.
+     */
+    INDEX get_col_origin(int c) const;
+
     /**
      * \brief Retrieve a column vector from the matrix.
      *
@@ -390,27 +443,48 @@ public:
     bool is_row_column_set(int r, int c) const;
 
     /**
-     * \brief Get / compute the row sum for a given row
+     * \brief Get the row sum for a given row
      *
      * \return row sum
      */
     int get_row_sum(int r) const;
 
     /**
-     * \brief Compute the row sum for each row in the matrix and return as a
-     * vector.
+     * \brief The row sum of each row in the matrix.
+     *
+     * The sums are kept up to date as rows and columns are deleted, so this
+     * costs nothing.
+     *
+     * \return row sum vector, valid until the matrix is next modified
+     */
+    const ROW_SUM &get_row_sum() const;
+
+    /**
+     * \brief The column sum of each column in the matrix.
+     *
+     * The sums are kept up to date as rows and columns are deleted, so this
+     * costs nothing.
+     *
+     * \return column sum vector, valid until the matrix is next modified
+     */
+    const COLUMN_SUM &get_column_sum() const;
+
+    /**
+     * \brief The columns with no ones (the column singularities).
      *
-     * \return row sum vector
+     * The matrix keeps track of the columns with at most one one as rows are
+     * deleted, so this doesn't look at the column sums one by one.
+     *
+     * \return sorted column indices
      */
-    ROW_SUM get_row_sum() const;
+    INDEX_LIST get_singular_cols() const;
 
     /**
-     * \brief Compute the column sum for each column in the matrix and return
-     * as a vector.
+     * \brief The columns with exactly one one (the column unitarians).
      *
-     * \return column sum vector
+     * \return sorted column indices
      */
-    COLUMN_SUM get_column_sum() const;
+    INDEX_LIST get_unitarian_cols() const;
 
     /**
      * \brief Compute number of columns contained in the two given rows
@@ -427,6 +501,42 @@ public:
      */
     boost::filesystem::path get_row_exemplar(int r) const;
 
+    /**
+     * \brief Where a row's exemplar path comes among the exemplar paths of
+     * all the rows in lexicographic order.
+     *
+     * Comparing ranks orders rows the way comparing their paths does, rows
+     * with the same path having the same rank. The ranks are worked out when
+     * first asked for, and again after a row is inserted.
+     *
+     * \param r row index
+     * \return the rank
+     * \throws out_of_range exception if row index is negative or too big.
+     */
+    int get_row_exemplar_rank(int r) const;
+
+    /**
+     * \brief Set the corpus the rows' traces can be re-read from.
+     *
+     * Rows remember the index of their trace in the corpus they were
+     * constructed from, so that corpus (or any other listing the same traces
+     * in the same order) can be used to re-read them. Without a trace source
+     * traces are re-read from the exemplar file path.
+     *
+     * \param source the corpus, shared with the matrix
+     */
+    void set_trace_source(std::shared_ptr<const CorpusReader> source);
+
+    /**
+     * \brief Re-read the trace a row was constructed from.
+     *
+     * \param r row index
+     * \return all the trace's columns, 8 times the trace size, as
+     * get_exemplar_data() returns
+     * \throws out_of_range exception if row index is negative or too big.
+     */
+    ROW get_row_trace(int r) const;
+
     /**
      * \brief Get size of binary file from which the given row was constructed
      * vector.
@@ -443,7 +553,8 @@ public:
      */
     double get_row_weight(int r) const;
 
-    // debugging function, check matrix consistency
+    // debugging function, check matrix consistency. remove_cols() calls it
+    // when built with MATRIX_DEBUG, as it costs a pass over the matrix
     void assert_row_sums() const;
 
     /**
@@ -474,13 +585,284 @@ private:
     /** Regex pattern to select corpus exemplars in the directory */
     std::string pattern;
 
+    /** Where to re-read row traces from. Null to use the exemplar paths */
+    std::shared_ptr<const CorpusReader> trace_source;
+
     /**
-     * Doubly linked list of row elements. Each row element contains amongst
-     * other things column data
+     * Stored column numbers of the stored rows that are lists, one row after
+     * another. Each row's numbers are sorted and written as the varint gaps
+     * between them, the first from -1. Deleted rows and columns leave theirs
+     * behind until compact()
      */
-    std::vector<RowElem> rowlist;
-};
+    std::vector<unsigned char> col_gaps;
+
+    /**
+     * Where each stored row's gaps start in col_gaps, or its bitmap in
+     * row_words
+     */
+    std::vector<std::size_t> row_begin;
+
+    /**
+     * Where each stored row's gaps end in col_gaps, or its bitmap in
+     * row_words
+     */
+    std::vector<std::size_t> row_end;
+
+    /** Number of column numbers each stored row holds */
+    std::vector<int> row_lengths;
+
+    /** Which stored rows are bitmaps */
+    BitRow row_packed;
+
+    /**
+     * Bitmaps of the stored columns of the stored rows that are bitmaps, one
+     * row after another, each as long as col_active
+     */
+    std::vector<BitRow::WORD> row_words;
+
+    /**
+     * Number of column numbers stored since the last compaction, deleted
+     * rows and columns included
+     */
+    long long stored_elems;
+
+    /** Number of ones in each row of the matrix */
+    ROW_SUM row_sums;
+
+    /** Each stored row's file weighting (for weighted set cover problem) */
+    std::vector<double> row_weights;
+
+    /** Size of each stored row's trace file in bytes */
+    std::vector<int> row_file_sizes;
+
+    /**
+     * Index of each stored row's trace in the corpus the row was read from
+     * (see set_trace_source()). -1 if unknown
+     */
+    std::vector<int> row_traces;
+
+    /** Each stored row's exemplar path, as an index into the name table */
+    std::vector<int> row_names;
+
+    /** The name table: every exemplar path, one after another */
+    std::string names;
+
+    /** Where each name starts in names, and where the last one ends */
+    std::vector<std::size_t> name_begin;
+
+    /**
+     * Each name's place in the name table in lexicographic order. Empty
+     * until it is first asked for
+     */
+    mutable std::vector<int> name_ranks;
+
+    /** Which stored rows haven't been deleted */
+    BitRow row_active;
+
+    /** The stored row of each row of the matrix */
+    std::vector<int> live_rows;
+
+    /** Which stored columns haven't been deleted */
+    BitRow col_active;
+
+    /** The stored column of each column of the matrix */
+    std::vector<INDEX> live_cols;
+
+    /** Each stored column's column of the matrix, or DELETED */
+    std::vector<INDEX> col_rank;
+
+    /** Each stored row's row of the matrix, or DELETED */
+    std::vector<int> row_rank;
+
+    /** The column of the row traces each stored column stands for */
+    std::vector<INDEX> col_origin;
+
+    /** Number of ones in each column of the matrix */
+    COLUMN_SUM col_sums;
+
+    /** Which columns of the matrix have at most one one */
+    BitRow sparse_cols;
+
+    /**
+     * The column index: stored row numbers of the stored columns, one column
+     * after another. Each column's numbers are sorted and written as the
+     * varint gaps between them, the first from -1. Rows and columns deleted
+     * since the index was built leave theirs behind
+     */
+    mutable std::vector<unsigned char> row_gaps;
+
+    /**
+     * Where each stored column's gaps start in row_gaps, and where the last
+     * one ends. Empty if there is no column index
+     */
+    mutable std::vector<std::size_t> col_begin;
+
+    /** A place a stored row that is a list can be decoded from */
+    struct ListSkip {
+        /** Offset of the next gap from the start of the row */
+        std::size_t offset;
+        /** The stored column before it */
+        INDEX column;
+    };
+
+    /**
+     * Skip points of the stored rows that are lists, each row's one after
+     * another: the place in the row after every MATRIX_LIST_SKIP column
+     * numbers. A row's are built when it is first searched
+     */
+    mutable std::vector<ListSkip> list_skips;
+
+    /**
+     * Where each stored row's skip points start in list_skips, or SIZE_MAX
+     * if they haven't been built. Rows past the end have none built
+     */
+    mutable std::vector<std::size_t> skip_begin;
+
+    /** Working list of the stored columns remove_cols() is deleting */
+    INDEX_LIST gone_cols;
+
+    /**
+     * Working bitmap of the stored columns remove_cols() is deleting. Clear
+     * between calls
+     */
+    BitRow gone_bits;
+
+    /** Working column sums for assert_row_sums() */
+    mutable COLUMN_SUM checked_sums;
 
-BOOST_CLASS_VERSION(Matrix, 0)
+    /** \return the path of a name in the name table */
+    boost::filesystem::path name(int id) const;
+
+    /** Rank the names in the name table, if not ranked */
+    void rank_names() const;
+
+    /**
+     * \brief Call f(stored column) for each one in a stored row, in
+     * increasing order, whether it is a list or a bitmap. Deleted columns are
+     * included.
+     */
+    template <typename F> void for_each_stored(int s, F f) const {
+        if (row_packed.test(s)) {
+            for_each_bit(row_words.data() + row_begin[s],
+                         row_words.data() + row_end[s], f);
+        } else {
+            for_each_gap(col_gaps.data() + row_begin[s],
+                         col_gaps.data() + row_end[s], f);
+        }
+    }
+
+    /** \brief Call f(column) for each set bit of a bitmap row, in order */
+    template <typename F>
+    static void for_each_bit(const BitRow::WORD *first,
+                             const BitRow::WORD *last, F f) {
+        for (const BitRow::WORD *w = first; w != last; ++w) {
+            BitRow::WORD word = *w;
+            INDEX base = (w - first) * BitRow::WORD_BITS;
+            while (word) {
+                f(base + __builtin_ctzll(word));
+                word &= word - 1; // clear the lowest set bit
+            }
+        }
+    }
+
+    /** \brief Call f(column) for each column of a list row, in order */
+    template <typename F>
+    static void for_each_gap(const unsigned char *in, const unsigned char *end,
+                             F f) {
+        INDEX c = -1;
+        while (in != end) {
+            c += read_varint(in);
+            f(c);
+        }
+    }
+
+    /**
+     * \brief Store a stored row as a bitmap at the end of row_words.
+     *
+     * \param s stored row
+     * \param first the row's stored column numbers
+     * \param last end of the row's stored column numbers
+     */
+    void pack_row(int s, const INDEX *first, const INDEX *last);
+
+    /**
+     * \brief Store a stored row as a list at the end of col_gaps.
+     *
+     * \param s stored row
+     * \param first the row's stored column numbers
+     * \param last end of the row's stored column numbers
+     */
+    void encode_row(int s, const INDEX *first, const INDEX *last);
+
+    /**
+     * \brief Add a row, naming it in the name table. It is stored as a
+     * bitmap if that takes less room, otherwise as a list.
+     *
+     * \param columns the row's sorted stored column numbers
+     */
+    void append_row(const COL_DATA &columns,
+                    const boost::filesystem::path &exemplar, int file_size,
+                    double weight, int trace);
+
+    /**
+     * \brief Make the stored columns the columns of the matrix.
+     *
+     * Columns the matrix didn't have before start with a column sum of 0.
+     *
+     * \param columns number of columns
+     */
+    void reset_columns(int columns);
+
+    /**
+     * \brief Change the number of columns of a matrix under construction
+     * that ignores no columns, laying the bitmap rows out again at the new
+     * width.
+     *
+     * \param columns number of columns. Any dropped must be empty
+     */
+    void resize_columns(int columns);
+
+    /**
+     * \brief Reorder the stored rows of a matrix under construction.
+     *
+     * \param order the stored row that goes in each place
+     */
+    void permute_rows(const std::vector<int> &order);
+
+    /** Find the columns with at most one one from the column sums */
+    void find_sparse_cols();
+
+    /** Build the column index from the live rows and columns, if not built */
+    void index_columns() const;
+
+    /** Drop the column index */
+    void drop_column_index();
+
+    /**
+     * \brief The skip points of a stored row that is a list, building them
+     * if they haven't been. There are row_lengths[s] / MATRIX_LIST_SKIP.
+     */
+    const ListSkip *row_skips(int s) const;
+
+    /** Drop the skip points of every row */
+    void drop_list_skips();
+
+    /**
+     * \brief Number of live columns two stored rows that are lists have in
+     * common
+     */
+    int list_overlap(int s1, int s2) const;
+
+    /**
+     * \brief Drop the deleted columns from a stored row that is a list,
+     * leaving a gap after it in col_gaps until compact().
+     *
+     * \param s stored row
+     */
+    void compact_row(int s);
+
+    /** Compact the storage if it has got sparse enough */
+    void maybe_compact();
+};
 
 #endif /* MATRIX_H */
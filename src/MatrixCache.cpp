@@ -0,0 +1,542 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Matrix cache reader and writer.
+ */
+
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "ColumnCodec.h"
+#include "Matrix.h"
+#include "MatrixCache.h"
+#include "Parallel.h"
+
+using namespace std;
+using namespace boost::filesystem;
+namespace src = boost::log::sources;
+
+/** Identifies a matrix cache file */
+static const char MATRIX_MAGIC[8] = {'M', 'L', 'M', 'A', 'T', 'R', 'I', 'X'};
+
+/**
+ * Bump this whenever the matrix cache layout changes, so old caches are
+ * rebuilt rather than misread
+ */
+static const uint32_t MATRIX_VERSION = 5;
+
+/**
+ * The first bytes of a matrix cache file. All offsets are from the start of
+ * the file.
+ */
+struct MatrixCacheHeader {
+    char magic[8];
+    uint32_t version;
+    /** number of traces in the corpus the matrix was built from */
+    uint32_t num_traces;
+    uint64_t num_rows;
+    uint64_t num_cols;
+    uint64_t num_cols_orig;
+    uint64_t num_elems;
+    /** what the matrix was built from, see MatrixCache::write() */
+    uint64_t key_offset;
+    uint64_t key_size;
+    /** num_rows + 1 uint64_t offsets of each row's columns */
+    uint64_t offsets_offset;
+    /** num_rows MatrixCacheRow */
+    uint64_t rows_offset;
+    /**
+     * the column indices of each row, as the varint gaps between them (see
+     * ColumnCodec.h)
+     */
+    uint64_t columns_offset;
+    uint64_t columns_size;
+    /** exemplar paths */
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+/** Row meta data in a matrix cache file */
+struct MatrixCacheRow {
+    uint64_t path_offset;
+    /** hash_columns() of the row */
+    uint64_t hash;
+    /** modification time of the trace file in nanoseconds, 0 if unknown */
+    int64_t modified;
+    double weight;
+    uint32_t path_length;
+    int32_t file_size;
+    int32_t trace;
+    /**
+     * size of the trace as the corpus listed it. A corpus directory lists a
+     * sparse trace at its file size, not its size as a bit vector
+     */
+    int32_t listed_size;
+};
+
+static_assert(sizeof(MatrixCacheHeader) == 112, "MatrixCacheHeader layout");
+static_assert(sizeof(MatrixCacheRow) == 48, "MatrixCacheRow layout");
+
+///////////////////////////////////////////////////////////////////////
+// Matrix Cache Implementation
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Are the varint gaps in [in, end) a valid row of a matrix with
+ * 'cols' columns? Each gap must be at least one and the columns stay below
+ * cols, so the indices come out strictly increasing and in range.
+ */
+static bool valid_gaps(const unsigned char *in, const unsigned char *end,
+                       uint64_t cols) {
+    uint64_t c = static_cast<uint64_t>(-1);
+    while (in != end) {
+        uint64_t gap;
+        if (!get_varint(in, end, gap) || gap == 0 || gap > cols ||
+            c + gap >= cols) {
+            return false;
+        }
+        c += gap;
+    }
+
+    return true;
+}
+
+MatrixCache::MatrixCache(const path &matrixfile)
+    : base(nullptr), length(0), written(0), traces(0), rows(0), cols(0),
+      cols_orig(0), elems(0), offsets(nullptr), columns(nullptr),
+      meta(nullptr), strings(nullptr) {
+    int fd = open(matrixfile.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw runtime_error("Unable to open matrix cache file: " +
+                            matrixfile.native());
+    }
+    length = info.st_size;
+    written = info.st_mtim.tv_sec * NANOSECONDS + info.st_mtim.tv_nsec;
+    void *addr = (length >= sizeof(MatrixCacheHeader))
+                     ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw runtime_error("Not a matrix cache file: " + matrixfile.native());
+    }
+    base = static_cast<const unsigned char *>(addr);
+
+    try {
+        MatrixCacheHeader header;
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC)) != 0 ||
+            header.version != MATRIX_VERSION) {
+            throw runtime_error("Not a matrix cache file: " +
+                                matrixfile.native());
+        }
+
+        // check the sections all lie within the file before touching them
+        size_t size = length;
+        auto in_file = [size](uint64_t offset, uint64_t count, uint64_t width,
+                              uint64_t align) {
+            return offset % align == 0 && offset <= size &&
+                   count <= (size - offset) / width;
+        };
+        uint64_t n = header.num_rows;
+        if (!in_file(header.offsets_offset, n + 1, sizeof(uint64_t), 8) ||
+            !in_file(header.rows_offset, n, sizeof(MatrixCacheRow), 8) ||
+            !in_file(header.columns_offset, header.columns_size, 1, 1) ||
+            !in_file(header.strings_offset, header.strings_size, 1, 1) ||
+            header.num_cols > header.num_cols_orig ||
+            header.num_cols_orig > (uint64_t) numeric_limits<int>::max()) {
+            throw runtime_error("Corrupt matrix cache file: " +
+                                matrixfile.native());
+        }
+        offsets =
+            reinterpret_cast<const uint64_t *>(base + header.offsets_offset);
+        columns = base + header.columns_offset;
+        meta = reinterpret_cast<const MatrixCacheRow *>(base +
+                                                        header.rows_offset);
+        strings = reinterpret_cast<const char *>(base + header.strings_offset);
+
+        for (uint64_t r = 0; r < n; r++) {
+            const MatrixCacheRow &m = meta[r];
+            if (offsets[r] > offsets[r + 1] ||
+                offsets[r + 1] > header.columns_size ||
+                m.path_offset > header.strings_size ||
+                m.path_length > header.strings_size - m.path_offset ||
+                m.file_size < 0 || m.listed_size < 0 ||
+                !valid_gaps(columns + offsets[r], columns + offsets[r + 1],
+                            header.num_cols)) {
+                throw runtime_error("Corrupt matrix cache file: " +
+                                    matrixfile.native());
+            }
+        }
+        if (offsets[0] != 0 || offsets[n] != header.columns_size) {
+            throw runtime_error("Corrupt matrix cache file: " +
+                                matrixfile.native());
+        }
+
+        traces = header.num_traces;
+        rows = n;
+        cols = header.num_cols;
+        cols_orig = header.num_cols_orig;
+        elems = header.num_elems;
+    } catch (...) {
+        munmap(addr, length);
+        throw;
+    }
+}
+
+MatrixCache::~MatrixCache() {
+    munmap(const_cast<unsigned char *>(base), length);
+}
+
+int MatrixCache::num_traces() const {
+    return traces;
+}
+
+int MatrixCache::num_rows() const {
+    return rows;
+}
+
+int MatrixCache::num_cols() const {
+    return cols;
+}
+
+int MatrixCache::num_cols_orig() const {
+    return cols_orig;
+}
+
+long long MatrixCache::num_elements() const {
+    return elems;
+}
+
+void MatrixCache::read_columns(int r, const vector<int> &transform,
+                               COL_DATA &columns) const {
+    const unsigned char *in = this->columns + offsets[r];
+    const unsigned char *end = this->columns + offsets[r + 1];
+
+    // the gaps were checked when the cache was opened
+    uint64_t c = static_cast<uint64_t>(-1);
+    while (in != end) {
+        uint64_t gap;
+        get_varint(in, end, gap);
+        c += gap;
+
+        if (transform.empty()) {
+            columns.push_back(c);
+        } else if (c < transform.size() && transform[c] != DELETED) {
+            columns.push_back(transform[c]);
+        }
+    }
+}
+
+path MatrixCache::row_path(int r) const {
+    return path(string(strings + meta[r].path_offset, meta[r].path_length));
+}
+
+int MatrixCache::row_file_size(int r) const {
+    return meta[r].file_size;
+}
+
+int MatrixCache::row_listed_size(int r) const {
+    return meta[r].listed_size;
+}
+
+int64_t MatrixCache::modified() const {
+    return written;
+}
+
+int64_t MatrixCache::row_modified(int r) const {
+    return meta[r].modified;
+}
+
+uint64_t MatrixCache::row_hash(int r) const {
+    return meta[r].hash;
+}
+
+double MatrixCache::row_weight(int r) const {
+    return meta[r].weight;
+}
+
+int MatrixCache::row_trace(int r) const {
+    return meta[r].trace;
+}
+
+/**
+ * \brief Write a block of bytes to the matrix cache, or throw.
+ */
+static void write_bytes(std::ofstream &out, const void *bytes, size_t n,
+                        const path &matrixfile) {
+    if (!out.write(static_cast<const char *>(bytes), n)) {
+        throw runtime_error("Unable to write matrix cache file: " +
+                            matrixfile.native());
+    }
+}
+
+/**
+ * \brief Pad the matrix cache so the next section is aligned for direct use
+ * once mapped.
+ */
+static void write_padding(std::ofstream &out, uint64_t &offset,
+                          const path &matrixfile) {
+    static const char padding[8] = {};
+    size_t pad = (8 - offset % 8) % 8;
+
+    write_bytes(out, padding, pad, matrixfile);
+    offset += pad;
+}
+
+void MatrixCache::write(const Matrix &matrix, const path &matrixfile,
+                        const string &key) {
+    src::severity_logger<> &mylog = my_logger::get();
+    BOOST_LOG(mylog) << "Writing matrix data to file: " << matrixfile;
+
+    path temp = matrixfile;
+    temp += ".tmp";
+    std::ofstream out(temp.native(),
+                      std::ofstream::binary | std::ofstream::trunc);
+    if (!out) {
+        throw runtime_error("Unable to create matrix cache file: " +
+                            temp.native());
+    }
+
+    const vector<CorpusFile> *files =
+        matrix.trace_source ? &matrix.trace_source->files() : nullptr;
+    MatrixCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC));
+    header.version = MATRIX_VERSION;
+    header.num_traces = files ? files->size() : 0;
+    header.num_rows = matrix.num_rows;
+    header.num_cols = matrix.num_cols;
+    header.num_cols_orig = matrix.num_cols_orig;
+    header.key_size = key.size();
+
+    // lay the sections out before writing anything. Each row is encoded as
+    // it is hashed, deleted columns left out
+    vector<uint64_t> offsets(1, 0);
+    offsets.reserve(matrix.num_rows + 1);
+    vector<MatrixCacheRow> rows(matrix.num_rows);
+    vector<unsigned char> gaps;
+    string strings;
+    COL_DATA columns;
+    for (int r = 0; r < matrix.num_rows; r++) {
+        columns.clear();
+        matrix.for_each_column(r,
+                               [&columns](INDEX c) { columns.push_back(c); });
+        INDEX previous = -1;
+        for (INDEX c : columns) {
+            put_varint(c - previous, gaps);
+            previous = c;
+        }
+        offsets.push_back(gaps.size());
+
+        string name = matrix.get_row_exemplar(r).native();
+        int trace = matrix.row_traces[matrix.live_rows[r]];
+        MatrixCacheRow &meta = rows[r];
+        memset(&meta, 0, sizeof(meta));
+        meta.path_offset = strings.size();
+        meta.hash = hash_columns(columns);
+        meta.weight = matrix.get_row_weight(r);
+        meta.path_length = name.size();
+        meta.file_size = matrix.get_row_file_size(r);
+        meta.listed_size = meta.file_size;
+        if (files && trace >= 0 && trace < (int) files->size()) {
+            meta.modified = (*files)[trace].modified;
+            meta.listed_size = (*files)[trace].file_size;
+        }
+        meta.trace = trace;
+        strings += name;
+    }
+    header.num_elems = matrix.num_elems;
+    header.columns_size = gaps.size();
+    header.strings_size = strings.size();
+
+    uint64_t offset = sizeof(header);
+    header.key_offset = offset;
+    offset += key.size();
+    offset += (8 - offset % 8) % 8;
+    header.offsets_offset = offset;
+    offset += offsets.size() * sizeof(uint64_t);
+    header.rows_offset = offset;
+    offset += rows.size() * sizeof(MatrixCacheRow);
+    header.columns_offset = offset;
+    offset += header.columns_size;
+    offset += (8 - offset % 8) % 8;
+    header.strings_offset = offset;
+
+    offset = 0;
+    write_bytes(out, &header, sizeof(header), temp);
+    write_bytes(out, key.data(), key.size(), temp);
+    offset += sizeof(header) + key.size();
+    write_padding(out, offset, temp);
+    write_bytes(out, offsets.data(), offsets.size() * sizeof(uint64_t), temp);
+    write_bytes(out, rows.data(), rows.size() * sizeof(MatrixCacheRow), temp);
+    offset += offsets.size() * sizeof(uint64_t) +
+              rows.size() * sizeof(MatrixCacheRow);
+    write_bytes(out, gaps.data(), gaps.size(), temp);
+    offset += header.columns_size;
+    write_padding(out, offset, temp);
+    assert(offset == header.strings_offset);
+    write_bytes(out, strings.data(), strings.size(), temp);
+
+    out.close();
+    if (!out) {
+        throw runtime_error("Unable to write matrix cache file: " +
+                            temp.native());
+    }
+    rename(temp, matrixfile);
+
+    BOOST_LOG(mylog) << "Finished Writing matrix data to file.";
+}
+
+string MatrixCache::read_key(const path &matrixfile) {
+    std::ifstream in(matrixfile.native(), std::ifstream::binary);
+    MatrixCacheHeader header;
+
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        memcmp(header.magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC)) != 0 ||
+        header.version != MATRIX_VERSION || header.key_size > (1 << 20)) {
+        return string();
+    }
+
+    string key(header.key_size, '\0');
+    if (!in.seekg(header.key_offset) || !in.read(&key[0], key.size())) {
+        return string();
+    }
+
+    return key;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Cached Corpus Implementation
+///////////////////////////////////////////////////////////////////////
+
+CachedCorpus::CachedCorpus(const CorpusReader &source,
+                           const MatrixCache &cache)
+    : source(source), cache(cache) {
+    corpus = source.files();
+    cached_row.assign(corpus.size(), -1);
+
+    // only a cache of an untouched matrix holds the traces' own columns
+    if (cache.num_cols() != cache.num_cols_orig()) {
+        return;
+    }
+
+    unordered_map<string, int> rows;
+    rows.reserve(cache.num_rows());
+    for (int r = 0; r < cache.num_rows(); r++) {
+        rows.emplace(cache.row_path(r).native(), r);
+    }
+
+    for (unsigned int i = 0; i < corpus.size(); i++) {
+        const CorpusFile &f = corpus[i];
+        auto found = rows.find(f.file_path.native());
+        if (found == rows.end()) {
+            continue;
+        }
+
+        int r = found->second;
+        if (f.file_size != cache.row_listed_size(r)) {
+            continue;
+        }
+        // file times are only as fine as the kernel's clock tick, so a trace
+        // rewritten in the tick it was read keeps its time. Only a time from
+        // before the cache was written vouches for the trace
+        if (f.modified != 0 && f.modified == cache.row_modified(r) &&
+            f.modified < cache.modified()) {
+            cached_row[i] = r;
+            continue;
+        }
+        uint64_t hash = source.trace_hash(i);
+        if (hash != 0 && hash == cache.row_hash(r)) {
+            cached_row[i] = r;
+        }
+    }
+}
+
+int CachedCorpus::trace_bytes(int i) const {
+    return (cached_row[i] >= 0) ? cache.row_file_size(cached_row[i])
+                                : source.trace_bytes(i);
+}
+
+void CachedCorpus::read_columns(int i, const vector<int> &transform,
+                                COL_DATA &columns) const {
+    if (cached_row[i] >= 0) {
+        cache.read_columns(cached_row[i], transform, columns);
+    } else {
+        source.read_columns(i, transform, columns);
+    }
+}
+
+void CachedCorpus::read_batch(const vector<int> &traces,
+                              const vector<int> &transform,
+                              vector<COL_DATA> &columns,
+                              int num_threads) const {
+    vector<int> missing;
+    for (int i : traces) {
+        if (cached_row[i] < 0) {
+            missing.push_back(i);
+        }
+    }
+    vector<COL_DATA> fresh;
+    if (!missing.empty()) {
+        source.read_batch(missing, transform, fresh, num_threads);
+    }
+
+    columns.assign(traces.size(), COL_DATA());
+    parallel_for(0, traces.size(), num_threads, [&](int k) {
+        if (cached_row[traces[k]] >= 0) {
+            cache.read_columns(cached_row[traces[k]], transform, columns[k]);
+        }
+    });
+    for (unsigned int k = 0, m = 0; k < traces.size(); k++) {
+        if (cached_row[traces[k]] < 0) {
+            columns[k] = std::move(fresh[m++]);
+        }
+    }
+}
+
+uint64_t CachedCorpus::trace_hash(int i) const {
+    return (cached_row[i] >= 0) ? cache.row_hash(cached_row[i])
+                                : source.trace_hash(i);
+}
+
+int CachedCorpus::num_cached() const {
+    int n = 0;
+    for (int r : cached_row) {
+        n += (r >= 0);
+    }
+    return n;
+}
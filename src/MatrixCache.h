@@ -0,0 +1,247 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief The on disk matrix cache (the `.matrix` file).
+ *
+ * The cache is a versioned binary file holding a freshly constructed matrix
+ * in compressed sparse row form: a row offset table, the column indices of
+ * every row back to back as varint gaps (see ColumnCodec.h), and a table of
+ * row meta data. The row table doubles
+ * as a manifest of the corpus the matrix was built from - each row records
+ * its exemplar path, size, modification time and hash_columns() - so when
+ * the corpus changes only the new or changed traces need to be read again
+ * (see CachedCorpus).
+ *
+ * All integers are in host byte order.
+ */
+
+#ifndef MATRIX_CACHE_H
+#define MATRIX_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "Corpus.h"
+#include "moonlight.h"
+
+class Matrix;
+struct MatrixCacheRow;
+
+/**
+ * \brief A matrix cache file, mapped into memory.
+ */
+class MatrixCache {
+public:
+    /**
+     * \brief Open and map a matrix cache file and check its layout.
+     *
+     * \param matrixfile the matrix cache file
+     * \throws runtime_error if the file can't be read or isn't a valid matrix
+     * cache of the current version
+     */
+    explicit MatrixCache(const boost::filesystem::path &matrixfile);
+
+    MatrixCache(const MatrixCache &orig) = delete;
+    MatrixCache &operator=(const MatrixCache &rhs) = delete;
+
+    ~MatrixCache();
+
+    /**
+     * \brief Write a matrix to a matrix cache file.
+     *
+     * The matrix must not have had any columns removed since it was
+     * constructed. Row modification times are taken from the matrix's trace
+     * source, if it has one. The file is written under a temporary name and
+     * renamed into place, so an interrupted write never leaves a truncated
+     * cache behind.
+     *
+     * \param matrix the matrix
+     * \param matrixfile the matrix cache file
+     * \param key describes what the matrix was built from, so a later run can
+     * tell if the cache applies (see read_key())
+     * \throws runtime_error if the file can't be written
+     */
+    static void write(const Matrix &matrix,
+                      const boost::filesystem::path &matrixfile,
+                      const std::string &key);
+
+    /**
+     * \brief Read the key a matrix cache file was written with.
+     *
+     * Only the start of the file is read.
+     *
+     * \param matrixfile the matrix cache file
+     * \return the key, or an empty string if the file isn't a matrix cache
+     * of the current version
+     */
+    static std::string read_key(const boost::filesystem::path &matrixfile);
+
+    /**
+     * \brief Number of traces in the corpus the cached matrix was built
+     * from. 0 if unknown
+     */
+    int num_traces() const;
+
+    /** Number of rows in the cached matrix */
+    int num_rows() const;
+
+    /** Number of columns in the cached matrix */
+    int num_cols() const;
+
+    /** Number of columns the cached matrix was constructed with */
+    int num_cols_orig() const;
+
+    /** Number of ones in the cached matrix */
+    long long num_elements() const;
+
+    /**
+     * \brief Read the columns of a cached row.
+     *
+     * \param r row index
+     * \param transform column index transform (new = transform[old]).
+     * Columns mapped to DELETED are dropped. An empty transform is the
+     * identity
+     * \param columns column list the indices are appended to
+     */
+    void read_columns(int r, const std::vector<int> &transform,
+                      COL_DATA &columns) const;
+
+    /** Exemplar path of a cached row */
+    boost::filesystem::path row_path(int r) const;
+
+    /** Trace size of a cached row (see CorpusReader::trace_bytes()) */
+    int row_file_size(int r) const;
+
+    /** Size the corpus listed a cached row's trace at */
+    int row_listed_size(int r) const;
+
+    /**
+     * \brief Modification time of the cache file itself, in nanoseconds
+     * since the epoch.
+     */
+    std::int64_t modified() const;
+
+    /**
+     * \brief Modification time of a cached row's trace file, in nanoseconds
+     * since the epoch. 0 if unknown
+     */
+    std::int64_t row_modified(int r) const;
+
+    /** hash_columns() of a cached row's columns */
+    std::uint64_t row_hash(int r) const;
+
+    /** Weight of a cached row */
+    double row_weight(int r) const;
+
+    /** Index of a cached row's trace in the corpus it was built from */
+    int row_trace(int r) const;
+
+private:
+    /** Start of the mapping */
+    const unsigned char *base;
+
+    /** Size of the mapping */
+    std::size_t length;
+
+    /** Modification time of the file */
+    std::int64_t written;
+
+    /** Number of traces in the corpus */
+    int traces;
+
+    /** Number of rows */
+    int rows;
+
+    /** Number of columns */
+    int cols;
+
+    /** Number of columns the matrix was constructed with */
+    int cols_orig;
+
+    /** Number of ones */
+    long long elems;
+
+    /** Row offsets into the column gaps */
+    const std::uint64_t *offsets;
+
+    /** Column gaps */
+    const unsigned char *columns;
+
+    /** Row meta data */
+    const MatrixCacheRow *meta;
+
+    /** Exemplar paths */
+    const char *strings;
+};
+
+/**
+ * \brief A corpus whose unchanged traces are read from a matrix cache.
+ *
+ * Lists the traces of another corpus. A trace is taken to be unchanged if
+ * the cache has a row with the same path and size, and the same modification
+ * time from before the cache was written or (where the corpus knows it
+ * without decoding) the same hash. Those
+ * are read from the cache and only the rest are read from the corpus, so a
+ * matrix constructed from a CachedCorpus is identical to one constructed
+ * from the corpus itself.
+ */
+class CachedCorpus : public CorpusReader {
+public:
+    /**
+     * \brief Match the traces of a corpus against the rows of a matrix
+     * cache. Both must outlive this object.
+     */
+    CachedCorpus(const CorpusReader &source, const MatrixCache &cache);
+
+    void read_columns(int i, const std::vector<int> &transform,
+                      COL_DATA &columns) const override;
+
+    /** The traces that aren't cached are read as a batch from the corpus */
+    void read_batch(const std::vector<int> &traces,
+                    const std::vector<int> &transform,
+                    std::vector<COL_DATA> &columns,
+                    int num_threads) const override;
+
+    int trace_bytes(int i) const override;
+
+    std::uint64_t trace_hash(int i) const override;
+
+    /** Number of traces that will be read from the cache */
+    int num_cached() const;
+
+private:
+    /** The corpus */
+    const CorpusReader &source;
+
+    /** The matrix cache */
+    const MatrixCache &cache;
+
+    /** Cached row of each trace, -1 if new or changed */
+    std::vector<int> cached_row;
+};
+
+#endif /* MATRIX_CACHE_H */
@@ -34,6 +34,9 @@
 #include "Corpus.h"
 #include "Matrix.h"
 #include "OSCPSolver.h"
+#include "Parallel.h"
+#include "TraceReader.h"
+#include "WeightTable.h"
 
 using namespace std;
 using namespace boost::filesystem;
@@ -50,28 +53,35 @@ OSCPSolver::OSCPSolver() : solution(Solution()) {
 // OSCP Methods
 ///////////////////////////////////////////////////////////////////////
 
-INDEX_LIST OSCPSolver::calc_cols_to_ignore(const path &directory,
-                                           const string &pattern,
-                                           const path &weight_file) {
+INDEX_LIST OSCPSolver::calc_cols_to_ignore(const CorpusReader &source,
+                                           const path &weight_file,
+                                           CorpusSpill &spill,
+                                           int num_threads) {
     src::severity_logger<> &mylog = my_logger::get();
     BOOST_LOG(mylog) << "CALC_COLS_TO_IGNORE()...";
 
-    vector<CorpusFile> corpus = get_file_list(directory, pattern);
-    sort(corpus.begin(), corpus.end(), greater<CorpusFile>());
+    const vector<CorpusFile> &files = source.files();
+    vector<int> corpus(files.size());
+    for (unsigned int i = 0; i < files.size(); i++) {
+        corpus[i] = i;
+    }
 
-    // don't need to sort by filesize, just need to know max filesize
+    // don't need to sort by filesize, just need to know max filesize. A
+    // sparse trace's size may only be known once it is read, so the counts
+    // grow as the traces come in
     int num_files = corpus.size();
     assert(num_files > 0);
-    int num_cols = 8 * corpus[0].file_size;
-
-    // create a map from exemplar file names to weights
-    bool weighted = false;
-    map<string, double> weight_map;
+    int num_cols = 8 * max_element(files.begin(), files.end())->file_size;
 
-    // empty path implies unweighted version
+    // resolve each file's weight once. Files with no weight get zero, which
+    // excludes them. An empty path implies the unweighted version
+    vector<double> file_weight(files.size(), 1.0);
     if (!weight_file.empty()) {
-        weighted = true;
-        weight_map = get_weight_data(weight_file);
+        shared_ptr<const WeightTable> weights = load_weights(weight_file);
+        for (unsigned int i = 0; i < files.size(); i++) {
+            int entry = weights->find(files[i].file_path.filename().string());
+            file_weight[i] = (entry >= 0) ? weights->weight(entry) : 0.0;
+        }
     }
 
     int num_unitarian = 0;
@@ -79,27 +89,60 @@ INDEX_LIST OSCPSolver::calc_cols_to_ignore(const path &directory,
     BOOST_LOG(mylog)
         << "Going to eliminate row unitarians before reading in all data";
     BOOST_LOG(mylog) << "";
-    BOOST_LOG(mylog) << "Step 1: Counting column frequencies";
+    BOOST_LOG(mylog) << "Step 1: Counting column frequencies and spilling the "
+                     << "column data";
     vector<int> col_freq(num_cols, 0);
 
-    for (int r = 0; r < num_files; r++) {
-        path f = corpus[r].file_path;
-        if ((r % 500) == 0) {
-            BOOST_LOG(mylog) << "File: " << r << ", " << f.filename();
+    // this is the only time the traces are read from the source. They are
+    // read in the order they lie on disk, since neither the counts nor the
+    // spill care about order. Batches are decoded concurrently, then counted
+    // and spilled
+    vector<int> order = disk_order(files, corpus);
+    num_threads = resolve_num_threads(num_threads);
+    const int batch_size = max(TRACE_BATCH, 100 * num_threads);
+    vector<int> batch;
+    vector<COL_DATA> columns;
+    for (int first = 0; first < num_files; first += batch_size) {
+        int count = min(batch_size, num_files - first);
+        // ignore exemplars with invalid (non +ve) weights
+        batch.clear();
+        for (int i = first; i < first + count; i++) {
+            int f = corpus[order[i]];
+            if (file_weight[f] > 0) {
+                batch.push_back(f);
+            }
         }
+        source.read_batch(batch, vector<int>(), columns, num_threads);
 
-        // ignore exemplars with invalid (non positive) weights
-        if (weighted && weight_map[f.filename().string()] <= 0) {
-            continue;
+        for (unsigned int i = 0; i < batch.size(); i++) {
+            int bytes = source.trace_bytes(batch[i]);
+            if (8 * bytes > num_cols) {
+                num_cols = 8 * bytes;
+                col_freq.resize(num_cols, 0);
+            }
+            for (INDEX c : columns[i]) {
+                assert(c < num_cols);
+                col_freq[c]++;
+            }
+            spill.store(batch[i], columns[i], bytes);
         }
-        ROW row_data = get_exemplar_data(f);
-        assert(num_cols >= (int) row_data.size());
-        int rowsum = 0;
-        for (unsigned int i = 0; i < row_data.size(); i++) {
-            col_freq[i] += row_data[i];
-            rowsum += row_data[i];
+
+        BOOST_LOG(mylog) << "File: " << first << ", "
+                         << files[corpus[order[first]]].file_path.filename();
+    }
+    // the traces left out still count towards the matrix size, so the spill
+    // needs their real sizes too
+    for (int f = 0; f < num_files; f++) {
+        if (file_weight[f] <= 0) {
+            spill.store(f, COL_DATA(), source.trace_bytes(f));
         }
     }
+    spill.finish();
+
+    // the matrix is built from the spill, so it has the last word on sizes
+    const vector<CorpusFile> &spilled = spill.files();
+    num_cols = 8 * max_element(spilled.begin(), spilled.end())->file_size;
+    col_freq.resize(num_cols, 0);
 
 #if 0
     // print out rowsum and colsum distributions to help visualise the data
@@ -143,36 +186,29 @@ INDEX_LIST OSCPSolver::calc_cols_to_ignore(const path &directory,
     BOOST_LOG(mylog) << "        and adding the rows and their weights to the "
                      << "solution.";
     for (int r = 0; r < num_files; r++) {
-        path f = corpus[r].file_path;
+        path f = files[corpus[r]].file_path;
         if ((r % 500) == 0) {
             BOOST_LOG(mylog) << "File: " << r << ", " << f.filename();
         }
-        if (weighted && weight_map[f.filename().string()] <= 0) {
+        if (file_weight[corpus[r]] <= 0) {
             continue;
         }
-        ROW row_data = get_exemplar_data(f);
+        ROW row_data = spill.read_row(corpus[r]);
         assert(num_cols >= (int) row_data.size());
         bool unitarian = false;
-        for (unsigned int i = 0; i < row_data.size(); i++) {
-            if (row_data[i] == 1 && col_freq[i] == 1) {
+        for (size_t i = row_data.find_first(); i != BitRow::npos;
+             i = row_data.find_next(i)) {
+            if (col_freq[i] == 1) {
                 unitarian = true;
                 num_unitarian++;
-                string f_name = f.filename().string();
                 this->solution.add_to_soln(f.filename(), row_data, 0.0, true);
-                if (weighted) {
-                    this->solution.weight += weight_map[f_name];
-                } else {
-                    this->solution.weight += 1.0;
-                }
+                this->solution.weight += file_weight[corpus[r]];
                 break;
             }
         }
         if (unitarian) {
-            for (unsigned int i = 0; i < row_data.size(); i++) {
-                if (row_data[i]) {
-                    cols_to_ignore.insert(i);
-                }
-            }
+            row_data.for_each_set(
+                [&cols_to_ignore](int i) { cols_to_ignore.insert(i); });
         }
     }
     BOOST_LOG(mylog) << "Row unitarians: " << num_unitarian;
@@ -202,8 +238,9 @@ Solution OSCPSolver::solve_oscp(Matrix &data, CORPUS_DATA &corpus_data,
                      << "Data[" << r << ", " << c << "]";
     BOOST_LOG(mylog) << "";
 
-    // container of file paths and meta data that constitute our solution
-    Solution solution = this->solution;
+    // container of file paths and meta data that constitute our solution,
+    // starting from the row unitarians found while the matrix was built
+    Solution solution = std::move(this->solution);
 
     // initialise the solution with some meta-data
     if (greedy) {
@@ -216,9 +253,6 @@ Solution OSCPSolver::solve_oscp(Matrix &data, CORPUS_DATA &corpus_data,
     solution.num_rows = data.get_num_rows();
     solution.num_columns = data.get_num_cols_orig();
 
-    COLUMN_SUM init_freq = data.get_column_sum();
-    INDEX_LIST singularities = get_singular_columns(init_freq);
-
     // remove column singularities - row singularities are harmless at this
     // stage
     eliminate_column_singularities(data, solution);
@@ -231,6 +265,7 @@ Solution OSCPSolver::solve_oscp(Matrix &data, CORPUS_DATA &corpus_data,
     //  [2] col supersets
     vector<bool> reduction_options = {true, true, true};
     int non_optimal = 0;
+    GreedyBuffers buffers;
     while (r && c) {
         BOOST_LOG(mylog) << "STATS:  "
                          << "Matrix[" << r << ", " << c << "]";
@@ -256,7 +291,7 @@ Solution OSCPSolver::solve_oscp(Matrix &data, CORPUS_DATA &corpus_data,
                 reduction_options[1] = true;
             }
         } else {
-            if (eliminate_max_score(data, solution, corpus_data)) {
+            if (eliminate_max_score(data, solution, corpus_data, buffers)) {
                 reduction_options[1] = true;
                 non_optimal++;
             }
@@ -306,16 +341,7 @@ bool eliminate_row_unitarians(Matrix &data, Solution &solution,
     // can easily be checked here
 
     // find col unitarians
-    COLUMN_SUM Freq = data.get_column_sum(); // frequency distribution
-    int col = 0;
-    INDEX_LIST unity_cols;
-
-    for (int value : Freq) {
-        if (value == 1) {
-            unity_cols.push_back(col);
-        }
-        col++;
-    }
+    INDEX_LIST unity_cols = data.get_unitarian_cols();
 
     if (unity_cols.size() > 0) {
         changed = true;
@@ -349,36 +375,26 @@ INDEX_LIST find_unitarian_rows(Matrix &data, INDEX_LIST &columns,
                                CORPUS_DATA &c_data) {
     src::severity_logger<> &mylog = my_logger::get();
 
-    // use a set because the balance tree will be efficient for membership
-    // testing
     BOOST_LOG(mylog) << "INFO:   "
                      << "Finding unitarian rows associated with "
                      << columns.size() << " columns";
-    set<int> unitycols(columns.begin(), columns.end());
 
-    // assert( columns are set of unitarian columns)
+    // look each column's row up in the column index. Several columns can
+    // share a row, which is only counted once
     INDEX_LIST rows;
-    for (int r = 0; r < data.get_num_rows(); r++) {
-        auto citer = data.column_begin(r);
-        auto cend = data.column_end(r);
-        for (int c = 0; citer != cend; c++, ++citer) {
-            int value = (*citer);
-            if (value != DELETED) {
-                // check if the value is in the unitarian set
-                if (unitycols.find(value) != unitycols.end()) {
-                    rows.push_back(r);
-                    c_data[r].score_unitarian +=
-                        1.0; // update some corpus analytics
-                    break;   // row only needs to have one unitarian column
-                }
+    for (int c : columns) {
+        for (auto riter = data.rows_begin(c); riter != data.rows_end(c);
+             ++riter) {
+            if (*riter != DELETED) {
+                rows.push_back(*riter);
             }
         }
+    }
+    sort(rows.begin(), rows.end());
+    rows.erase(unique(rows.begin(), rows.end()), rows.end());
 
-        if ((r % 100) == 99) { // progress report
-            BOOST_LOG(mylog) << "LOOP:   "
-                             << "Processed row " << r << " out of "
-                             << data.get_num_rows();
-        }
+    for (int r : rows) {
+        c_data[r].score_unitarian += 1.0; // update some corpus analytics
     }
     return rows;
 }
@@ -453,7 +469,7 @@ INDEX_LIST find_subset_rows(Matrix &data) {
     };
 
     // sort the rows
-    ROW_SUM rowsums = data.get_row_sum();
+    const ROW_SUM &rowsums = data.get_row_sum();
     vector<row_meta> sorted_rows(rowsums.size());
     for (unsigned int i = 0; i < rowsums.size(); i++) {
         sorted_rows[i] = {(int) i, rowsums[i], data.get_row_weight(i)};
@@ -485,8 +501,8 @@ INDEX_LIST find_subset_rows(Matrix &data) {
         for (auto it = sorted_rows.begin(); it != sorted_rows.end(); it++) {
             ROW row = data.get_row(it->index);
             string row_str = "";
-            for (auto c = row.begin(); c != row.end(); c++) {
-                if (*c) {
+            for (size_t c = 0; c < row.size(); c++) {
+                if (row[c]) {
                     row_str += "@ ";
                 } else {
                     row_str += ". ";
@@ -597,27 +613,15 @@ bool eliminate_superset_cols(Matrix &data) {
 INDEX_LIST find_superset_cols(Matrix &data) {
     src::severity_logger<> &mylog = my_logger::get();
     int num_cols = data.get_num_cols();
-    int num_rows = data.get_num_rows();
 
-    BOOST_LOG(mylog) << "INFO:   "
-                     << "Making local column-major sparse matrix";
-    vector<vector<INDEX>> columns(num_cols, vector<int>());
-
-    for (int r = 0; r < num_rows; r++) {
-        auto c_iter = data.column_begin(r);
-        auto c_end = data.column_end(r);
-        while (c_iter != c_end) {
-            int c = (*c_iter);
-            if (c != DELETED) {
-                columns[c].push_back(r);
-            }
-            advance(c_iter, 1);
+    // the columns come straight from the matrix's column index, in which
+    // deleted rows read as DELETED
+    const COLUMN_SUM &col_sums = data.get_column_sum();
+    auto skip_deleted = [](IndexIterator &iter, const IndexIterator &end) {
+        while (iter != end && *iter == DELETED) {
+            ++iter;
         }
-    }
-    // we now have the matrix in column-major sparse form as a local variable
-    // 'columns'
-    BOOST_LOG(mylog) << "INFO:   "
-                     << "Done. Now test for supersets";
+    };
 
     set<INDEX> supersets;
     int count_strict = 0;
@@ -626,7 +630,7 @@ INDEX_LIST find_superset_cols(Matrix &data) {
         if (supersets.find(c1) != supersets.end()) {
             continue;
         }
-        if (columns[c1].size() == 0) {
+        if (col_sums[c1] == 0) {
             continue;
         }
 
@@ -642,7 +646,7 @@ INDEX_LIST find_superset_cols(Matrix &data) {
                 continue;
             }
 
-            if (columns[c2].size() == 0) {
+            if (col_sums[c2] == 0) {
                 continue;
             }
 
@@ -650,12 +654,14 @@ INDEX_LIST find_superset_cols(Matrix &data) {
             // columns are equal
             bool superset1 = true;
             bool superset2 = true;
-            auto iter1 = columns[c1].begin();
-            auto iter2 = columns[c2].begin();
-            auto end1 = columns[c1].end();
-            auto end2 = columns[c2].end();
+            auto iter1 = data.rows_begin(c1);
+            auto iter2 = data.rows_begin(c2);
+            auto end1 = data.rows_end(c1);
+            auto end2 = data.rows_end(c2);
 
             while (superset1 || superset2) {
+                skip_deleted(iter1, end1);
+                skip_deleted(iter2, end2);
                 if (iter1 == end1) {
                     if (iter2 != end2) {
                         // col2 has something col1 doesn't (col2 hasn't
@@ -716,13 +722,15 @@ INDEX_LIST find_superset_cols(Matrix &data) {
 }
 
 bool eliminate_max_score(Matrix &data, Solution &solution,
-                         CORPUS_DATA corpus_data) {
+                         CORPUS_DATA &corpus_data, GreedyBuffers &buffers) {
     src::severity_logger<> &mylog = my_logger::get();
     BOOST_LOG(mylog) << "METHOD: "
                      << "heuristic (single greedy select)";
 
-    MEASURE row_scores = score_rows(data);
-    vector<pair<double, int>> sorted_scores(row_scores.size());
+    MEASURE &row_scores = buffers.scores;
+    score_rows(data, row_scores);
+    vector<SCORE_ROW> &sorted_scores = buffers.sorted_scores;
+    sorted_scores.resize(row_scores.size());
 
     for (unsigned int i = 0; i < row_scores.size(); i++) {
         sorted_scores[i] = {row_scores[i], i};
@@ -733,22 +741,21 @@ bool eliminate_max_score(Matrix &data, Solution &solution,
     print_row_scores(data, sorted_scores);
 
     int rank = deterministic_select(data, sorted_scores);
-    int row = sorted_scores[rank].second;
-
-    INDEX_LIST rowstodelete;
-    if (row == NULL_INDEX) {
+    if (rank == NULL_INDEX) {
         BOOST_LOG(mylog) << "INFO:   "
                          << "No max rowsum found";
         BOOST_LOG(mylog) << "";
         return false;
     }
 
+    int row = sorted_scores[rank].second;
     double maxscore = sorted_scores[rank].first;
     BOOST_LOG(mylog) << "INFO:   "
                      << "Choosing score, row: " << maxscore << ", " << row;
     add_to_solution(data, solution, row, false);
-    rowstodelete.push_back(row);
-    reduce(data, rowstodelete);
+    INDEX_LIST &rowstodelete = buffers.rows;
+    rowstodelete.assign(1, row);
+    reduce(data, rowstodelete, buffers.projection, buffers.columns);
     BOOST_LOG(mylog) << "";
 
     return true;
@@ -782,24 +789,20 @@ int deterministic_select(Matrix &data, const vector<SCORE_ROW> &scores) {
 int deterministic_compare(Matrix &data, int row1, int row2) {
     // take two row IDs, return a comparison based on their file names (which
     // doesn't change)
-    // +ve for exemplar1 > exemplar2 in alphabet
-    string path1 = data.get_row_exemplar(row1).string();
-    string path2 = data.get_row_exemplar(row2).string();
-
-    return path1.compare(path2);
+    // +ve for exemplar1 > exemplar2 in alphabet. The matrix ranks the names
+    // once, so this needn't look at them
+    return data.get_row_exemplar_rank(row1) - data.get_row_exemplar_rank(row2);
 }
 
-MEASURE score_rows(Matrix &data) {
+void score_rows(Matrix &data, MEASURE &scores) {
     int rows = data.get_num_rows();
-    MEASURE scores(rows);                 // vector of row scores
-    ROW_SUM rowsums = data.get_row_sum(); // vector of row sums
+    scores.resize(rows);                         // vector of row scores
+    const ROW_SUM &rowsums = data.get_row_sum(); // vector of row sums
 
     // calculate scores
     for (int r = 0; r < rows; r++) {
         scores[r] = rowsums[r] / data.get_row_weight(r);
     }
-
-    return scores;
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -809,9 +812,9 @@ MEASURE score_rows(Matrix &data) {
 void add_to_solution(Matrix &data, Solution &S, int row, bool optimal) {
     path fullpath = data.get_row_exemplar(row);
     path exemplar = fullpath.filename();
-    ROW rowdata = get_exemplar_data(fullpath);
+    ROW rowdata = data.get_row_trace(row);
     double weight = data.get_row_weight(row);
-    S.add_to_soln(exemplar, rowdata, weight, optimal);
+    S.add_to_soln(exemplar, std::move(rowdata), weight, optimal);
 
     src::severity_logger<> &mylog = my_logger::get();
     BOOST_LOG(mylog) << "INFO:   "
@@ -831,18 +834,20 @@ bool eliminate_column_singularities(Matrix &data, Solution &solution) {
                      << "column singularities";
     bool changed = false;
     int num_singularities = 0;
-    COLUMN_SUM freq = data.get_column_sum(); // frequency distribution
+    INDEX_LIST singularities = data.get_singular_cols();
 
-    if (is_column_singular(freq)) {
+    if (!singularities.empty()) {
         changed = true;
-        INDEX_LIST singularities = get_singular_columns(freq);
         // dangerous assumption here...
         // assumes that if Solution.initial_singularities is non empty then:
         // a) largedata flag was used
         // b) Solution.initial_singularities contains indices of ALL initial col
         // singularities
         if (solution.initial_singularities.size() == 0) {
-            solution.initial_singularities = singularities;
+            for (INDEX c : singularities) {
+                solution.initial_singularities.push_back(
+                    data.get_col_origin(c));
+            }
         } else {
             BOOST_LOG(mylog) << "INFO:   "
                              << "Indicies of column "
@@ -927,9 +932,16 @@ INDEX_LIST get_singular_rows(const ROW_SUM &rowsum) {
 ///////////////////////////////////////////////////////////////////////
 
 void reduce(Matrix &data, INDEX_LIST &rowset) {
+    ROW projection;
+    INDEX_LIST cols;
+    reduce(data, rowset, projection, cols);
+}
+
+void reduce(Matrix &data, INDEX_LIST &rowset, ROW &projection,
+            INDEX_LIST &cols) {
     src::severity_logger<> &mylog = my_logger::get();
     // get the list of columns we need to delete
-    INDEX_LIST cols = project_columns(data, rowset);
+    project_columns(data, rowset, projection, cols);
     // deleting columns does not impact on row indices.
     int delta = cols.size();
     int cols_before = data.get_num_cols();
@@ -946,7 +958,7 @@ void reduce(Matrix &data, INDEX_LIST &rowset) {
     data.remove_rows(rowset);
 
     // we may now have row singularities which we need to remove...
-    ROW_SUM rowsum = data.get_row_sum();
+    const ROW_SUM &rowsum = data.get_row_sum();
     if (is_row_singular(rowsum)) {
         BOOST_LOG(mylog) << "INFO:   "
                          << "We now have row singularities. ";
@@ -955,23 +967,26 @@ void reduce(Matrix &data, INDEX_LIST &rowset) {
 }
 
 INDEX_LIST project_columns(Matrix &data, const INDEX_LIST &rowset) {
-    int cols = data.get_num_cols();
-    INDEX_LIST C;
+    ROW projection;
+    INDEX_LIST columns;
+    project_columns(data, rowset, projection, columns);
+
+    return columns;
+}
 
+void project_columns(Matrix &data, const INDEX_LIST &rowset, ROW &projection,
+                     INDEX_LIST &columns) {
+    projection.resize(data.get_num_cols());
+    projection.clear();
+
+    // the union of the rows - duplicate columns collapse into the same bit
     for (auto r : rowset) {
-        ROW rowdata;
-        rowdata = data.get_row(r);
-        for (int c = 0; c < cols; c++) {
-            if (rowdata[c] == 1) {
-                C.push_back(c);
-            }
-        }
+        data.for_each_column(r, [&projection](INDEX c) { projection.set(c); });
     }
 
-    // de-duplicate the columns
-    C = dedup(C);
-
-    return C;
+    // set bits come out in increasing order, so no need to sort or dedup
+    columns.clear();
+    projection.for_each_set([&columns](int c) { columns.push_back(c); });
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -984,13 +999,8 @@ COLUMN_SUM calc_soln_col_sum(Matrix &data, Solution &S) {
     int cols = data.get_num_cols_orig();
     COLUMN_SUM colsum(cols, 0);
 
-    for (unsigned int i = 0; i < S.rowdata.size(); i++) {
-        ROW row = S.rowdata[i];
-        for (unsigned int c = 0; c < row.size(); c++) {
-            if (row[c] == 1) {
-                colsum[c] += 1;
-            }
-        }
+    for (const ROW &row : S.rowdata) {
+        row.for_each_set([&colsum](int c) { colsum[c]++; });
     }
 
     return colsum;
@@ -1027,9 +1037,12 @@ bool verify_solution(Matrix &data, Solution &S, const path &weight_file) {
     // path)
     if (!weight_file.empty()) {
         double weight = 0;
-        map<string, double> weight_map = get_weight_data(weight_file);
+        shared_ptr<const WeightTable> weights = load_weights(weight_file);
         for (unsigned int i = 0; i < S.solution.size(); i++) {
-            weight += weight_map[S.solution[i].filename().string()];
+            int entry = weights->find(S.solution[i].filename().string());
+            if (entry >= 0) {
+                weight += weights->weight(entry);
+            }
         }
 
         if (weight != S.weight) {
@@ -1059,24 +1072,29 @@ vector<int> primality_check(Matrix &data, Solution &S) {
     int cols = data.get_num_cols_orig();
     COLUMN_SUM colsum = calc_soln_col_sum(data, S);
 
+    // columns covered by exactly one row of the solution
+    ROW covered_once(cols);
+    for (int c = 0; c < cols; c++) {
+        if (colsum[c] == 1) {
+            covered_once.set(c);
+        }
+    }
+
     vector<int> result;
 
     // r is index in solution vector
     for (int r = 0; r < rows; r++) {
-        ROW row = S.rowdata[r];
-        bool unnecessary = true;
+        const ROW &row = S.rowdata[r];
 
-        for (int c = 0; c < cols; c++) {
-            if (row[c] == 1 && colsum[c] == 1) {
-                unnecessary = false;
-            }
-        }
+        // a row is necessary iff it is the only cover of some column
+        bool unnecessary = !row.intersects(covered_once);
 
         if (unnecessary) {
-            for (int c = 0; c < cols; c++) {
-                if (row[c] == 1)
-                    colsum[c] -= 1;
-            }
+            row.for_each_set([&colsum, &covered_once](int c) {
+                if (--colsum[c] == 1) {
+                    covered_once.set(c);
+                }
+            });
 
             BOOST_LOG(mylog) << S.solution[r] << " unnecessary";
             result.push_back(r);
@@ -1174,7 +1192,7 @@ INDEX_LIST brute_force(Matrix &data, int best_solution) {
     INDEX_LIST result;
     int n = data.get_num_rows();
     int m = data.get_num_cols();
-    vector<bool> seen;
+    ROW seen(m);
     bool achieved = false;
     vector<bool> v(n);
 
@@ -1185,28 +1203,16 @@ INDEX_LIST brute_force(Matrix &data, int best_solution) {
         // We permute the bit vector v(n) to generate combinations of rows with
         // r bits set.
         do {
-            seen.assign(m, false);
+            seen.clear();
 
             for (int i = 0; i < n; ++i) {
                 if (v[i]) {
-                    ROW row = data.get_row(i);
-
-                    for (int j = 0; j < (int) row.size(); j++) {
-                        int x = row[j];
-                        if (x == 1) {
-                            seen[j] = true;
-                        }
-                    }
+                    seen |= data.get_row(i);
                 }
             }
 
             // Check to see if this combination provides a cover.
-            bool done = true;
-            for (bool s : seen) {
-                if (!s) {
-                    done = false;
-                }
-            }
+            bool done = ((int) seen.count() == m);
 
             if (done) {
                 achieved = true;
@@ -38,6 +38,8 @@
 #include "Solution.h"
 #include "moonlight.h"
 
+class CorpusReader;
+class CorpusSpill;
 class Matrix;
 
 using EDGE = std::pair<int, int>;
@@ -46,6 +48,27 @@ using SCORE_ROW = std::pair<double, int>;
 
 #define NULL_INDEX -1
 
+/**
+ * \brief Working storage eliminate_max_score() keeps from one call to the
+ * next, so that once it has grown a greedy step allocates nothing of its own.
+ */
+struct GreedyBuffers {
+    /** Score of each row */
+    MEASURE scores;
+
+    /** The scores with their rows, best first */
+    std::vector<SCORE_ROW> sorted_scores;
+
+    /** The rows to delete */
+    INDEX_LIST rows;
+
+    /** The columns of those rows, as a bitmap */
+    ROW projection;
+
+    /** The columns of those rows */
+    INDEX_LIST columns;
+};
+
 ///////////////////////////////////////////////////////////////////////
 // Reduction Functions
 ///////////////////////////////////////////////////////////////////////
@@ -118,10 +141,11 @@ INDEX_LIST find_superset_cols(Matrix &data);
  * \param data contains matrix data
  * \param solution contains solution so far, and has a row added to it
  * \param corpus_data Contains statistics etc
+ * \param buffers working storage, kept for the next call
  * \return whether or not the matrix was modified
  */
 bool eliminate_max_score(Matrix &data, Solution &solution,
-                         CORPUS_DATA corpus_data);
+                         CORPUS_DATA &corpus_data, GreedyBuffers &buffers);
 
 ///////////////////////////////////////////////////////////////////////
 // Heuristic Selection Functions
@@ -193,10 +217,9 @@ INDEX_LIST get_singular_rows(const ROW_SUM &rowsum);
  * order concern.
  *
  * \param data corpus data provider that contains the data matrix
- * \param corpus_data Container object of corpus data analytics
- * \returns row sum measure for every row in the data matrix
+ * \param scores set to the row sum measure of every row in the data matrix
  */
-MEASURE score_rows(Matrix &data);
+void score_rows(Matrix &data, MEASURE &scores);
 
 /**
  * \brief add a row to the solution
@@ -250,6 +273,18 @@ void eliminate_row_singularities(Matrix &data, const ROW_SUM &rowsum);
  */
 void reduce(Matrix &data, INDEX_LIST &rowset);
 
+/**
+ * \brief Reduce the data matrix by a set of rows, as reduce() does, working
+ * in the given storage.
+ *
+ * \param data corpus data provider
+ * \param rowset list of row indices for the reduction
+ * \param projection working bitmap of the projection
+ * \param columns working list of the projection
+ */
+void reduce(Matrix &data, INDEX_LIST &rowset, ROW &projection,
+            INDEX_LIST &columns);
+
 /**
  * \brief deduplicate
  *
@@ -271,6 +306,18 @@ INDEX_LIST dedup(const INDEX_LIST &indices);
  */
 INDEX_LIST project_columns(Matrix &data, const INDEX_LIST &rowset);
 
+/**
+ * \brief Compute the column projection of a list of rows, as
+ * project_columns() does, into the given storage.
+ *
+ * \param data corpus data provider
+ * \param rowset list of row indices that we use to induce a column projection
+ * \param projection set to the projection as a bitmap
+ * \param columns set to the column indices of the projection
+ */
+void project_columns(Matrix &data, const INDEX_LIST &rowset, ROW &projection,
+                     INDEX_LIST &columns);
+
 ///////////////////////////////////////////////////////////////////////
 // Post Solution Checks
 ///////////////////////////////////////////////////////////////////////
@@ -387,21 +434,27 @@ public:
      * Typically (when using code coverage data) this eliminates large
      * proportion of all the non-empty rows to decrease data size.
      *
-     * \param directory the folder to look for exemplars in
-     * \param pattern find exemplar names matching this pattern
+     * Each trace is read from the source exactly once. Its column indices
+     * are kept in the spill, which the row unitarian pass works from and
+     * which should then be used to construct the matrix.
+     *
+     * \param source the corpus traces
      * \param weight_file path to weight file
+     * \param spill spill for the traces of source. Finished on return
+     * \param num_threads number of decoding threads. Zero for one per core
      * \return list of column indices to ignore when you read in again
      */
-    INDEX_LIST calc_cols_to_ignore(const boost::filesystem::path &directory,
-                                   const std::string &pattern,
-                                   const boost::filesystem::path &weight_file);
+    INDEX_LIST calc_cols_to_ignore(const CorpusReader &source,
+                                   const boost::filesystem::path &weight_file,
+                                   CorpusSpill &spill, int num_threads);
 
     /**
      * \brief Start the solver given the corpus data provided.
      *
      * The returned object contains a vector of file paths. Each file in this
-     * vector is part of the solution. This object owns the solution so we
-     * return a reference to it.
+     * vector is part of the solution. The solution starts from the row
+     * unitarians found by calc_cols_to_ignore(), which are moved into it, so
+     * a solver only solves once.
      *
      * \param data is the sparse matrix data structure
      * \param corpus_data extra meta data about the corpus
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Minimal fork-join helper for the embarrassingly parallel parts of
+ * MoonLight, such as decoding one trace file per row.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief Resolve a user supplied thread count. Zero (or less) means one
+ * thread per hardware core.
+ */
+inline int resolve_num_threads(int num_threads) {
+    if (num_threads > 0) {
+        return num_threads;
+    }
+
+    int cores = std::thread::hardware_concurrency();
+
+    return (cores > 0) ? cores : 1;
+}
+
+/**
+ * \brief Call f(i) for every i in [begin, end) using up to num_threads
+ * threads, and return once all calls have completed.
+ *
+ * Indices are handed out one at a time from a shared counter so uneven work
+ * (large and small trace files) balances itself. The calling thread takes
+ * part, so num_threads == 1 runs everything in order on the caller without
+ * creating any threads. f must be safe to call concurrently for different
+ * indices - typically it writes only to slot i of a pre-sized vector.
+ *
+ * If any call throws, the remaining indices are abandoned and the first
+ * exception is rethrown in the calling thread.
+ */
+template <typename F>
+void parallel_for(int begin, int end, int num_threads, F f) {
+    std::atomic<int> next(begin);
+    std::exception_ptr failure;
+    std::mutex failure_lock;
+
+    auto worker = [&]() {
+        int i;
+        while ((i = next++) < end) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(failure_lock);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+                next = end; // stop handing out work
+            }
+        }
+    };
+
+    int extra = std::min(num_threads, end - begin) - 1;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < extra; t++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+#endif /* PARALLEL_H */
@@ -63,6 +63,21 @@ Solution::Solution(const Solution &orig) {
     this->weight_non_optimal = orig.weight_non_optimal;
 }
 
+Solution::Solution(Solution &&orig) noexcept {
+    this->corpusname = std::move(orig.corpusname);
+    this->scorelabel = std::move(orig.scorelabel);
+    this->scoresum = orig.scoresum;
+    this->num_columns = orig.num_columns;
+    this->num_rows = orig.num_rows;
+    this->rowdata = std::move(orig.rowdata);
+    this->scores = std::move(orig.scores);
+    this->initial_singularities = std::move(orig.initial_singularities);
+    this->solution = std::move(orig.solution);
+    this->weight = orig.weight;
+    this->num_non_optimal = orig.num_non_optimal;
+    this->weight_non_optimal = orig.weight_non_optimal;
+}
+
 void Solution::json_print(const path &fpath) const {
     pt::ptree tree;
     pt::ptree solution_exemplars;
@@ -106,7 +121,7 @@ void Solution::add_to_soln(const path &f, ROW row, double weight,
                            bool optimal) {
     this->weight += weight;
     this->solution.push_back(f);
-    this->rowdata.push_back(row);
+    this->rowdata.push_back(std::move(row));
     this->scores.push_back(0);
 
     if (!optimal) {
@@ -98,6 +98,9 @@ public:
     Solution();
     Solution(const Solution &orig);
 
+    /** Move constructor */
+    Solution(Solution &&orig) noexcept;
+
     /** Write the solution to a JSON file */
     void json_print(const boost::filesystem::path &fpath) const;
 
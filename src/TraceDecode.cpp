@@ -0,0 +1,433 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Scalar and vectorised trace decoding kernels.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TRACE_DECODE_X86 1
+#include <immintrin.h>
+#endif
+
+#include "ColumnCodec.h"
+#include "TraceDecode.h"
+
+using namespace std;
+
+using WORD = BitRow::WORD;
+
+///////////////////////////////////////////////////////////////////////
+// Scalar Kernels
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Load up to eight trace bytes starting at 'trace' as a row word. The trace
+ * stores the lowest column in the most significant bit of each byte whereas
+ * the packed row counts from the least significant bit, so the bits within
+ * each byte are reversed. A short tail is padded with zeros.
+ */
+static inline WORD load_trace_word(const unsigned char *trace, size_t bytes) {
+    WORD x = 0;
+
+    if (bytes >= sizeof(x)) {
+        memcpy(&x, trace, sizeof(x));
+    } else {
+        memcpy(&x, trace, bytes);
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+
+    if (x) {
+        x = ((x >> 1) & 0x5555555555555555ULL) |
+            ((x & 0x5555555555555555ULL) << 1);
+        x = ((x >> 2) & 0x3333333333333333ULL) |
+            ((x & 0x3333333333333333ULL) << 2);
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) |
+            ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    }
+
+    return x;
+}
+
+/**
+ * Emit the column index of every set bit of a row word whose first column is
+ * 'base', through the transform if there is one.
+ */
+static inline INDEX *emit_word(WORD word, INDEX base, const int *transform,
+                               INDEX *out) {
+    if (transform) {
+        while (word) {
+            int column = transform[base + __builtin_ctzll(word)];
+            if (column != DELETED) {
+                *out++ = column;
+            }
+            word &= word - 1; // clear the lowest set bit
+        }
+    } else {
+        while (word) {
+            *out++ = base + __builtin_ctzll(word);
+            word &= word - 1; // clear the lowest set bit
+        }
+    }
+
+    return out;
+}
+
+static size_t count_scalar(const unsigned char *trace, size_t bytes) {
+    size_t result = 0;
+
+    for (size_t b = 0; b < bytes; b += sizeof(WORD)) {
+        WORD x = 0;
+        memcpy(&x, trace + b, min(bytes - b, sizeof(x)));
+        result += __builtin_popcountll(x);
+    }
+
+    return result;
+}
+
+/**
+ * Decode the trace bytes [begin, bytes) one word at a time. The vector
+ * kernels use this to finish off the tail that doesn't fill a whole vector.
+ */
+static INDEX *decode_scalar_from(const unsigned char *trace, size_t begin,
+                                 size_t bytes, const int *transform,
+                                 INDEX *out) {
+    for (size_t b = begin; b < bytes; b += sizeof(WORD)) {
+        WORD word = load_trace_word(trace + b, bytes - b);
+        out = emit_word(word, 8 * b, transform, out);
+    }
+
+    return out;
+}
+
+static INDEX *decode_scalar(const unsigned char *trace, size_t bytes,
+                            const int *transform, INDEX *out) {
+    return decode_scalar_from(trace, 0, bytes, transform, out);
+}
+
+#ifdef TRACE_DECODE_X86
+
+///////////////////////////////////////////////////////////////////////
+// AVX2 Kernels
+///////////////////////////////////////////////////////////////////////
+
+__attribute__((target("avx2,popcnt"))) static size_t
+count_avx2(const unsigned char *trace, size_t bytes) {
+    size_t result = 0;
+    size_t b = 0;
+
+    for (; b + 32 <= bytes; b += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (trace + b));
+        if (!_mm256_testz_si256(v, v)) {
+            WORD w[4];
+            _mm256_storeu_si256((__m256i *) w, v);
+            result += __builtin_popcountll(w[0]) + __builtin_popcountll(w[1]) +
+                      __builtin_popcountll(w[2]) + __builtin_popcountll(w[3]);
+        }
+    }
+
+    return result + count_scalar(trace + b, bytes - b);
+}
+
+__attribute__((target("avx2,popcnt,bmi"))) static INDEX *
+decode_avx2(const unsigned char *trace, size_t bytes, const int *transform,
+            INDEX *out) {
+    // bit order within each byte is flipped with two table lookups, one per
+    // nibble
+    const __m256i reverse_nibble =
+        _mm256_setr_epi8(0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5,
+                         0xD, 0x3, 0xB, 0x7, 0xF, 0x0, 0x8, 0x4, 0xC, 0x2, 0xA,
+                         0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    size_t b = 0;
+
+    for (; b + 32 <= bytes; b += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (trace + b));
+        if (_mm256_testz_si256(v, v)) {
+            continue; // 256 columns with nothing set
+        }
+
+        __m256i lo = _mm256_and_si256(v, low_nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibble);
+        v = _mm256_or_si256(
+            _mm256_slli_epi16(_mm256_shuffle_epi8(reverse_nibble, lo), 4),
+            _mm256_shuffle_epi8(reverse_nibble, hi));
+
+        WORD w[4];
+        _mm256_storeu_si256((__m256i *) w, v);
+        for (int k = 0; k < 4; k++) {
+            out = emit_word(w[k], 8 * b + 64 * k, transform, out);
+        }
+    }
+
+    return decode_scalar_from(trace, b, bytes, transform, out);
+}
+
+///////////////////////////////////////////////////////////////////////
+// AVX-512 Kernels
+///////////////////////////////////////////////////////////////////////
+
+__attribute__((target("avx512f,popcnt"))) static size_t
+count_avx512(const unsigned char *trace, size_t bytes) {
+    size_t result = 0;
+    size_t b = 0;
+
+    for (; b + 64 <= bytes; b += 64) {
+        __m512i v = _mm512_loadu_si512((const void *) (trace + b));
+        __mmask8 nonzero = _mm512_test_epi64_mask(v, v);
+        if (nonzero) {
+            WORD w[8];
+            _mm512_storeu_si512((void *) w, v);
+            while (nonzero) {
+                result += __builtin_popcountll(w[__builtin_ctz(nonzero)]);
+                nonzero &= nonzero - 1;
+            }
+        }
+    }
+
+    return result + count_scalar(trace + b, bytes - b);
+}
+
+__attribute__((target("avx512f,popcnt,bmi"))) static INDEX *
+decode_avx512(const unsigned char *trace, size_t bytes, const int *transform,
+              INDEX *out) {
+    const __m512i m1 = _mm512_set1_epi64(0x5555555555555555LL);
+    const __m512i m2 = _mm512_set1_epi64(0x3333333333333333LL);
+    const __m512i m4 = _mm512_set1_epi64(0x0F0F0F0F0F0F0F0FLL);
+    const __m512i lanes =
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i deleted = _mm512_set1_epi32(DELETED);
+    const __mmask8 all = 0xFF;
+    size_t b = 0;
+
+    for (; b + 64 <= bytes; b += 64) {
+        __m512i v = _mm512_loadu_si512((const void *) (trace + b));
+        __mmask8 nonzero = _mm512_test_epi64_mask(v, v);
+        if (!nonzero) {
+            continue; // 512 columns with nothing set
+        }
+
+        // reverse the bits within each byte (the same swaps as the scalar
+        // load_trace_word, eight words at a time). The zero-masked shifts
+        // are the plain shifts with every lane enabled - g++ 12 gives a bogus
+        // maybe-uninitialized warning for the unmasked forms
+        v = _mm512_or_si512(
+            _mm512_and_si512(_mm512_maskz_srli_epi64(all, v, 1), m1),
+            _mm512_maskz_slli_epi64(all, _mm512_and_si512(v, m1), 1));
+        v = _mm512_or_si512(
+            _mm512_and_si512(_mm512_maskz_srli_epi64(all, v, 2), m2),
+            _mm512_maskz_slli_epi64(all, _mm512_and_si512(v, m2), 2));
+        v = _mm512_or_si512(
+            _mm512_and_si512(_mm512_maskz_srli_epi64(all, v, 4), m4),
+            _mm512_maskz_slli_epi64(all, _mm512_and_si512(v, m4), 4));
+
+        WORD w[8];
+        _mm512_storeu_si512((void *) w, v);
+
+        while (nonzero) {
+            int k = __builtin_ctz(nonzero);
+            nonzero &= nonzero - 1;
+
+            // sixteen columns at a time: the word's bits are the lane mask
+            for (int q = 0; q < 4; q++) {
+                __mmask16 mask = static_cast<__mmask16>(w[k] >> (16 * q));
+                if (!mask) {
+                    continue;
+                }
+
+                INDEX base = 8 * b + 64 * k + 16 * q;
+                __m512i columns =
+                    _mm512_add_epi32(_mm512_set1_epi32(base), lanes);
+                if (transform) {
+                    columns = _mm512_mask_i32gather_epi32(
+                        deleted, mask, columns, transform, sizeof(int));
+                    mask = _mm512_mask_cmpneq_epi32_mask(mask, columns,
+                                                         deleted);
+                }
+
+                _mm512_storeu_si512((void *) out,
+                                    _mm512_maskz_compress_epi32(mask, columns));
+                out += __builtin_popcount(mask);
+            }
+        }
+    }
+
+    return decode_scalar_from(trace, b, bytes, transform, out);
+}
+
+#endif /* TRACE_DECODE_X86 */
+
+///////////////////////////////////////////////////////////////////////
+// Dispatch
+///////////////////////////////////////////////////////////////////////
+
+vector<TraceDecoder> supported_trace_decoders() {
+    vector<TraceDecoder> result;
+
+#ifdef TRACE_DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        result.push_back(TraceDecoder{"avx512", count_avx512, decode_avx512});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        result.push_back(TraceDecoder{"avx2", count_avx2, decode_avx2});
+    }
+#endif
+    result.push_back(TraceDecoder{"scalar", count_scalar, decode_scalar});
+
+    return result;
+}
+
+static const TraceDecoder &trace_decoder() {
+    // chosen once, thread safe under C++11 static initialisation rules
+    static const TraceDecoder decoder = supported_trace_decoders().front();
+
+    return decoder;
+}
+
+///////////////////////////////////////////////////////////////////////
+// API
+///////////////////////////////////////////////////////////////////////
+
+ROW pack_trace(const unsigned char *trace, size_t bytes) {
+    ROW result(8 * bytes);
+    WORD *words = result.data();
+
+    for (size_t b = 0; b < bytes; b += sizeof(WORD)) {
+        *words++ = load_trace_word(trace + b, bytes - b);
+    }
+
+    return result;
+}
+
+static void decode_trace(const unsigned char *trace, size_t bytes,
+                         const int *transform, COL_DATA &columns) {
+    const TraceDecoder &decoder = trace_decoder();
+
+    // size the output exactly (plus slack for the vector stores) so a sparse
+    // trace never costs more than its set bits
+    size_t first = columns.size();
+    columns.resize(first + decoder.count(trace, bytes) + TRACE_DECODE_SLACK);
+    INDEX *end =
+        decoder.decode(trace, bytes, transform, columns.data() + first);
+    columns.resize(end - columns.data());
+}
+
+void decode_trace(const unsigned char *trace, size_t bytes,
+                  COL_DATA &columns) {
+    decode_trace(trace, bytes, nullptr, columns);
+}
+
+void decode_trace(const unsigned char *trace, size_t bytes,
+                  const vector<int> &transform, COL_DATA &columns) {
+    assert(transform.empty() || transform.size() >= 8 * bytes);
+    decode_trace(trace, bytes, transform.empty() ? nullptr : transform.data(),
+                 columns);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Sparse Traces
+///////////////////////////////////////////////////////////////////////
+
+static const unsigned char SPARSE_TRACE_MAGIC[SPARSE_TRACE_MAGIC_LENGTH] = {
+    'M', 'L', 'S', 'P', 'A', 'R', 'S', 'E'};
+
+bool is_sparse_trace(const unsigned char *trace, size_t bytes) {
+    return bytes >= SPARSE_TRACE_MAGIC_LENGTH &&
+           memcmp(trace, SPARSE_TRACE_MAGIC, SPARSE_TRACE_MAGIC_LENGTH) == 0;
+}
+
+/**
+ * Read the size from a sparse trace header, leaving 'in' at the block index
+ * list.
+ */
+static size_t read_sparse_size(const unsigned char *&in,
+                               const unsigned char *end) {
+    in += SPARSE_TRACE_MAGIC_LENGTH;
+    uint64_t size;
+    // column counts, 8 times the size, are kept in an int elsewhere
+    if (!get_varint(in, end, size) ||
+        size > static_cast<uint64_t>(numeric_limits<int>::max() / 8)) {
+        throw runtime_error("Corrupt sparse trace header");
+    }
+
+    return size;
+}
+
+size_t trace_size(const unsigned char *trace, size_t bytes,
+                  size_t file_size) {
+    if (!is_sparse_trace(trace, bytes)) {
+        return file_size;
+    }
+
+    return read_sparse_size(trace, trace + bytes);
+}
+
+void decode_trace_file(const unsigned char *trace, size_t bytes,
+                       const vector<int> &transform, COL_DATA &columns) {
+    if (!is_sparse_trace(trace, bytes)) {
+        decode_trace(trace, bytes, transform, columns);
+        return;
+    }
+
+    const unsigned char *in = trace;
+    const unsigned char *end = trace + bytes;
+    uint64_t limit = 8 * static_cast<uint64_t>(read_sparse_size(in, end));
+    assert(transform.empty() || transform.size() >= limit);
+
+    // the same layout as encode_columns(), but the indices come from
+    // outside so each one is checked against the trace size
+    uint64_t count;
+    if (!get_varint(in, end, count) ||
+        count > static_cast<uint64_t>(end - in)) {
+        throw runtime_error("Corrupt sparse trace");
+    }
+    columns.reserve(columns.size() + count);
+    uint64_t column = static_cast<uint64_t>(-1);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t gap;
+        if (!get_varint(in, end, gap) || gap == 0 || gap > limit ||
+            (column += gap) >= limit) {
+            throw runtime_error("Corrupt sparse trace");
+        }
+
+        if (transform.empty()) {
+            columns.push_back(column);
+        } else if (transform[column] != DELETED) {
+            columns.push_back(transform[column]);
+        }
+    }
+}
+
+const char *trace_decoder_name() {
+    return trace_decoder().name;
+}
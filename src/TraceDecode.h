@@ -0,0 +1,183 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Kernels that turn raw bit vector trace bytes into matrix rows.
+ *
+ * Decoding is where ingestion spends its CPU time, so the column index
+ * decoder has several implementations. The best one the CPU supports is
+ * picked the first time a trace is decoded:
+ *
+ * * __avx512__: 64 trace bytes per step. Zero words are found with a single
+ *   vector test and the set bits of the others are turned into column indices
+ *   16 at a time with a masked compress. The column transform is applied with
+ *   a masked gather in the same pass.
+ * * __avx2__: 32 trace bytes per step. All-zero runs are skipped with one
+ *   vector test and bit order is fixed with a nibble shuffle.
+ * * __scalar__: one 64-bit word at a time using count-trailing-zeros and
+ *   clear-lowest-bit (tzcnt/blsr where the compiler targets BMI).
+ *
+ * All implementations produce identical output.
+ *
+ * Tracers that record a few blocks out of a very large program can write a
+ * sparse trace instead of a bit vector: the magic "MLSPARSE", the size in
+ * bytes of the equivalent bit vector trace, then the block indices in the
+ * encode_columns() format. Trace files are recognised by their first bytes,
+ * so the two formats can be mixed in a corpus.
+ */
+
+#ifndef TRACE_DECODE_H
+#define TRACE_DECODE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "moonlight.h"
+
+/**
+ * \brief Pack raw trace bytes into a row.
+ *
+ * The trace is consumed eight bytes at a time, each becoming one word of the
+ * row. A short tail is padded with zeros.
+ *
+ * \param trace raw trace bytes
+ * \param bytes number of bytes in the trace
+ * \return packed row of 8 * bytes columns
+ */
+ROW pack_trace(const unsigned char *trace, std::size_t bytes);
+
+/**
+ * \brief Decode raw trace bytes into the sorted list of set column indices.
+ *
+ * The indices are appended to the given column list. The cost depends on the
+ * number of set bits and all-zero runs are skipped, so a sparse trace never
+ * gets expanded into a dense row.
+ *
+ * \param trace raw trace bytes
+ * \param bytes number of bytes in the trace
+ * \param columns column list the set bit indices are appended to
+ */
+void decode_trace(const unsigned char *trace, std::size_t bytes,
+                  COL_DATA &columns);
+
+/**
+ * \brief Decode raw trace bytes into column indices, pushing each index
+ * through a column transform in the same pass.
+ *
+ * Bit i of the trace becomes column transform[i], and is dropped if that is
+ * DELETED. The transform must be monotonic over the columns it keeps (as the
+ * one built from a list of columns to ignore is) so the output stays sorted.
+ *
+ * \param trace raw trace bytes
+ * \param bytes number of bytes in the trace
+ * \param transform column index transform covering at least 8 * bytes
+ * columns. An empty transform is the identity
+ * \param columns column list the transformed indices are appended to
+ */
+void decode_trace(const unsigned char *trace, std::size_t bytes,
+                  const std::vector<int> &transform, COL_DATA &columns);
+
+/** Number of bytes in the magic number of a sparse trace */
+const std::size_t SPARSE_TRACE_MAGIC_LENGTH = 8;
+
+/** Number of leading bytes that are enough for trace_size() */
+const std::size_t TRACE_HEADER_LENGTH = SPARSE_TRACE_MAGIC_LENGTH + 10;
+
+/**
+ * \brief Is the trace a sparse trace? Only the magic number is checked.
+ *
+ * \param trace the trace file contents, or at least the first
+ * SPARSE_TRACE_MAGIC_LENGTH bytes of them
+ * \param bytes number of bytes given
+ */
+bool is_sparse_trace(const unsigned char *trace, std::size_t bytes);
+
+/**
+ * \brief The size in bytes of a trace, as a bit vector.
+ *
+ * This is the file size of a bit vector trace and the size recorded in the
+ * header of a sparse trace. Either way the trace's block indices are below
+ * 8 times the size.
+ *
+ * \param trace the trace file contents, or at least the first
+ * TRACE_HEADER_LENGTH bytes of them
+ * \param bytes number of bytes given
+ * \param file_size size of the whole trace file
+ * \throws runtime_error if the sparse trace header is corrupt or gives a size
+ * of more columns than an int holds
+ */
+std::size_t trace_size(const unsigned char *trace, std::size_t bytes,
+                       std::size_t file_size);
+
+/**
+ * \brief Decode the contents of a trace file, in either format, into column
+ * indices, pushing each index through a column transform.
+ *
+ * Bit vector traces are decoded as decode_trace() does.
+ *
+ * \param trace the trace file contents
+ * \param bytes number of bytes in the trace file
+ * \param transform column index transform covering at least 8 *
+ * trace_size() columns. An empty transform is the identity
+ * \param columns column list the transformed indices are appended to
+ * \throws runtime_error if a sparse trace is corrupt
+ */
+void decode_trace_file(const unsigned char *trace, std::size_t bytes,
+                       const std::vector<int> &transform, COL_DATA &columns);
+
+/**
+ * The vector kernels store whole vectors of indices and only then advance
+ * the output pointer by the number that were valid, so the output buffer
+ * needs this much room beyond the real result.
+ */
+const std::size_t TRACE_DECODE_SLACK = 16;
+
+/** A matched pair of counting and decoding kernels */
+struct TraceDecoder {
+    /** Implementation name, for logging */
+    const char *name;
+
+    /** Number of set bits in the trace bytes */
+    std::size_t (*count)(const unsigned char *trace, std::size_t bytes);
+
+    /**
+     * Write the column indices of the set bits through the transform (null
+     * for the identity) from 'out' on, which must have room for count()
+     * plus TRACE_DECODE_SLACK indices. Returns the end of the indices.
+     */
+    INDEX *(*decode)(const unsigned char *trace, std::size_t bytes,
+                     const int *transform, INDEX *out);
+};
+
+/**
+ * \brief The decoder implementations this CPU supports, best first.
+ *
+ * decode_trace() always uses the first. The others are only listed so that
+ * they can be checked against it.
+ */
+std::vector<TraceDecoder> supported_trace_decoders();
+
+/** \return name of the decoder implementation in use, for logging */
+const char *trace_decoder_name();
+
+#endif /* TRACE_DECODE_H */
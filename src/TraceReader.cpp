@@ -0,0 +1,636 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief io_uring trace file reader, with a blocking fallback.
+ *
+ * The ring is driven with the raw system calls, so there is no library to
+ * depend on.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#include "Parallel.h"
+#include "TraceReader.h"
+
+using namespace std;
+
+// the open and read operations came with the kernel 5.6 headers, which are
+// the first to define IORING_FEAT_RW_CUR_POS
+#if defined(__linux__) && defined(__NR_io_uring_setup) &&                     \
+    defined(IORING_FEAT_RW_CUR_POS)
+#define TRACE_READER_IO_URING 1
+#endif
+
+/** Cleared the first time io_uring turns out not to work */
+static atomic<bool> io_uring_usable(true);
+
+vector<int> disk_order(const vector<CorpusFile> &files,
+                       const vector<int> &which) {
+    vector<int> order(which.size());
+    for (unsigned int k = 0; k < which.size(); k++) {
+        order[k] = k;
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        uint64_t inode_a = files[which[a]].inode;
+        uint64_t inode_b = files[which[b]].inode;
+        return (inode_a != inode_b) ? inode_a < inode_b : which[a] < which[b];
+    });
+
+    return order;
+}
+
+/**
+ * \brief Ask the kernel to start reading the files into the page cache.
+ *
+ * Blocking reads wait for one file per thread at a time, so without a hint
+ * the disk sees a queue only as deep as the number of threads. The hints
+ * queue every file at once and let the disk put them in order.
+ */
+static void hint_files(const vector<CorpusFile> &files,
+                       const vector<int> &which, const vector<int> &order) {
+    for (int k : order) {
+        const CorpusFile &file = files[which[k]];
+        if (file.file_size < 0 ||
+            (size_t) file.file_size >= TraceData::MMAP_THRESHOLD) {
+            continue;
+        }
+        int fd = open(file.file_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+}
+
+/**
+ * \brief Read the files one at a time on each of the threads.
+ */
+static void read_blocking(
+    const vector<CorpusFile> &files, const vector<int> &which,
+    const vector<int> &order, int num_threads,
+    const function<void(int, const TraceData &)> &decode) {
+    hint_files(files, which, order);
+    parallel_for(0, order.size(), num_threads, [&](int j) {
+        int k = order[j];
+        TraceData trace(files[which[k]].file_path);
+        decode(k, trace);
+    });
+}
+
+#ifdef TRACE_READER_IO_URING
+
+/**
+ * \brief A minimal io_uring: one submission and one completion queue,
+ * mapped into our address space.
+ */
+class Ring {
+public:
+    /**
+     * \brief Set up a ring. Check ok() before use: the kernel may not have
+     * io_uring, or it may be switched off or filtered out.
+     */
+    explicit Ring(unsigned entries)
+        : fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED),
+          sqes(static_cast<io_uring_sqe *>(MAP_FAILED)), sq_length(0),
+          cq_length(0), sqes_length(0), tail(0), submitted(0), completed(0) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            return;
+        }
+
+        sq_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_length =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_length = cq_length = max(sq_length, cq_length);
+        }
+        sq_ring = mmap(nullptr, sq_length, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = mmap(nullptr, cq_length, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        }
+        sqes_length = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(
+            mmap(nullptr, sqes_length, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+            sqes == MAP_FAILED) {
+            release();
+            return;
+        }
+
+        char *sq = static_cast<char *>(sq_ring);
+        sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        char *cq = static_cast<char *>(cq_ring);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        tail = *sq_tail;
+        submitted = tail;
+        completed = tail;
+    }
+
+    Ring(const Ring &orig) = delete;
+    Ring &operator=(const Ring &rhs) = delete;
+
+    ~Ring() {
+        release();
+    }
+
+    bool ok() const {
+        return fd >= 0;
+    }
+
+    /**
+     * \brief A cleared submission queue entry, queued by the next submit().
+     * Null if the submission queue is full.
+     */
+    io_uring_sqe *next_entry() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= sq_entries) {
+            return nullptr;
+        }
+
+        unsigned slot = tail & sq_mask;
+        io_uring_sqe *sqe = &sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[slot] = slot;
+        tail++;
+
+        return sqe;
+    }
+
+    /**
+     * \brief Hand the queued entries to the kernel, and wait for at least
+     * one completion if wait is set.
+     *
+     * \return false if the kernel refused
+     */
+    bool submit(bool wait) {
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        for (;;) {
+            long n = syscall(__NR_io_uring_enter, fd, tail - submitted,
+                             wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                             nullptr, 0);
+            if (n >= 0) {
+                submitted += n;
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EBUSY) {
+                return false;
+            }
+            // out of kernel resources for now. What the kernel already has
+            // will complete and free some up, so wait for it rather than
+            // spin. With nothing there, back off before trying again
+            if (wait && in_kernel() > 0) {
+                return this->wait();
+            }
+            this_thread::sleep_for(chrono::milliseconds(1));
+            return true;
+        }
+    }
+
+    /**
+     * \brief Wait for at least one completion without submitting anything.
+     *
+     * \return false if the kernel refused
+     */
+    bool wait() {
+        for (;;) {
+            long n = syscall(__NR_io_uring_enter, fd, 0, 1,
+                             IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (n >= 0) {
+                return true;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                return false;
+            }
+        }
+    }
+
+    /** Number of queued entries the kernel hasn't taken */
+    unsigned unsubmitted() const {
+        return tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * Number of entries the kernel has taken whose completions haven't been
+     * taken by next_completion()
+     */
+    unsigned in_kernel() const {
+        return __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) - completed;
+    }
+
+    /**
+     * \brief Take the next completion, if there is one.
+     */
+    bool next_completion(io_uring_cqe &cqe) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        completed++;
+
+        return true;
+    }
+
+private:
+    void release() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_length);
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_length);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_length);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = -1;
+        sq_ring = cq_ring = MAP_FAILED;
+        sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    }
+
+    /** The ring's file descriptor, or -1 */
+    int fd;
+    /** The mappings shared with the kernel, and their lengths */
+    void *sq_ring;
+    void *cq_ring;
+    io_uring_sqe *sqes;
+    size_t sq_length;
+    size_t cq_length;
+    size_t sqes_length;
+
+    /** The fields of the submission and completion rings */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+
+    /** Our copy of the submission queue tail */
+    unsigned tail;
+
+    /** The submission queue tail as far as the kernel has taken entries */
+    unsigned submitted;
+
+    /** Number of completions taken, counted on from the initial tail */
+    unsigned completed;
+};
+
+/**
+ * \brief Files read and waiting to be decoded, shared with the decoding
+ * threads.
+ */
+class DecodeQueue {
+public:
+    DecodeQueue() : closed(false) {
+    }
+
+    void push(int k) {
+        {
+            lock_guard<mutex> guard(lock);
+            ready.push_back(k);
+        }
+        wake.notify_one();
+    }
+
+    /** No more files are coming */
+    void close() {
+        {
+            lock_guard<mutex> guard(lock);
+            closed = true;
+        }
+        wake.notify_all();
+    }
+
+    /**
+     * \brief Wait for the next file to decode.
+     *
+     * \return false once the queue is closed and empty
+     */
+    bool pop(int &k) {
+        unique_lock<mutex> guard(lock);
+        wake.wait(guard, [this]() { return closed || !ready.empty(); });
+        if (ready.empty()) {
+            return false;
+        }
+        k = ready.front();
+        ready.pop_front();
+
+        return true;
+    }
+
+private:
+    mutex lock;
+    condition_variable wake;
+    deque<int> ready;
+    bool closed;
+};
+
+/** A user_data tag for the open or read of file k */
+static uint64_t tag(int k, bool read) {
+    return (static_cast<uint64_t>(k) << 1) | (read ? 1 : 0);
+}
+
+/**
+ * \brief Read the files through an io_uring, in the given order.
+ *
+ * Each file is opened and then read (in a buffer one byte bigger than the
+ * listed size, to notice files that have grown) by queued operations, and
+ * is decoded as soon as it has all been read. A short read is continued from
+ * where it stopped. Files that are too big to read this way, that turn out
+ * not to be their listed size, or whose open or read fails, are read with
+ * TraceData as usual, which also gives the usual errors. If the ring stops
+ * taking submissions, the operations it has already taken are waited for and
+ * the files not yet decoded are read with read_blocking() instead.
+ */
+static void read_io_uring(
+    Ring &ring, const vector<CorpusFile> &files, const vector<int> &which,
+    const vector<int> &order, int num_threads,
+    const function<void(int, const TraceData &)> &decode) {
+    int count = which.size();
+    vector<int> fds(count, -1);
+    vector<vector<unsigned char>> buffers(count);
+    vector<size_t> done(count, 0);
+    vector<TraceData> traces(count);
+    vector<bool> handed_over(count, false);
+
+    exception_ptr failure;
+    mutex failure_lock;
+    atomic<bool> failed(false);
+    auto fail = [&](exception_ptr error) {
+        lock_guard<mutex> guard(failure_lock);
+        if (!failure) {
+            failure = error;
+        }
+        failed = true;
+    };
+
+    auto decode_one = [&](int k) {
+        if (!failed) {
+            try {
+                decode(k, traces[k]);
+            } catch (...) {
+                fail(current_exception());
+            }
+        }
+        traces[k] = TraceData();
+    };
+
+    // with more than one thread the others decode while this one reads
+    DecodeQueue queue;
+    vector<thread> decoders;
+    for (int t = 1; t < num_threads; t++) {
+        decoders.push_back(thread([&]() {
+            int k;
+            while (queue.pop(k)) {
+                decode_one(k);
+            }
+        }));
+    }
+    auto arrived = [&](int k) {
+        handed_over[k] = true;
+        if (decoders.empty()) {
+            decode_one(k);
+        } else {
+            queue.push(k);
+        }
+    };
+    auto read_now = [&](int k) {
+        handed_over[k] = true;
+        try {
+            traces[k] = TraceData(files[which[k]].file_path);
+            arrived(k);
+        } catch (...) {
+            fail(current_exception());
+        }
+    };
+
+    int next = 0;
+    unsigned in_flight = 0;
+    bool broken = false;
+    while ((next < count && !failed) || in_flight > 0) {
+        while (next < count && !failed && in_flight < TRACE_READS_IN_FLIGHT) {
+            int k = order[next++];
+            const CorpusFile &file = files[which[k]];
+            if (file.file_size < 0 ||
+                (size_t) file.file_size >= TraceData::MMAP_THRESHOLD) {
+                // big traces are mapped, not waited on
+                read_now(k);
+                continue;
+            }
+
+            // each file in flight holds at most one entry, so there's room
+            io_uring_sqe *sqe = ring.next_entry();
+            assert(sqe);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(file.file_path.c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = tag(k, false);
+            in_flight++;
+        }
+
+        if (!ring.submit(in_flight > 0)) {
+            // the ring is broken. The rest is read without it below
+            io_uring_usable = false;
+            broken = true;
+            break;
+        }
+
+        io_uring_cqe cqe;
+        while (ring.next_completion(cqe)) {
+            int k = cqe.user_data >> 1;
+            bool read = cqe.user_data & 1;
+
+            if (cqe.res == -EINVAL) {
+                // a kernel without these operations
+                io_uring_usable = false;
+            }
+
+            size_t size = files[which[k]].file_size;
+            if (!read && cqe.res >= 0) {
+                fds[k] = cqe.res;
+                buffers[k].resize(size + 1);
+            } else if (read && cqe.res > 0) {
+                done[k] += cqe.res;
+            }
+
+            // read (the rest of) the file, unless the last read came up
+            // short at the end of the file or it's all been read
+            if (cqe.res >= 0 && (!read || (cqe.res > 0 && done[k] < size))) {
+                io_uring_sqe *sqe = ring.next_entry();
+                assert(sqe);
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = fds[k];
+                sqe->addr =
+                    reinterpret_cast<uint64_t>(buffers[k].data() + done[k]);
+                sqe->len = buffers[k].size() - done[k];
+                sqe->off = done[k];
+                sqe->user_data = tag(k, true);
+                continue;
+            }
+
+            in_flight--;
+            if (fds[k] >= 0) {
+                close(fds[k]);
+                fds[k] = -1;
+            }
+            if (failed) {
+                buffers[k] = vector<unsigned char>();
+            } else if (read && cqe.res >= 0 && done[k] == size) {
+                buffers[k].resize(size);
+                traces[k] = TraceData(std::move(buffers[k]));
+                arrived(k);
+            } else {
+                // failed, or the file isn't the size it was listed as
+                buffers[k] = vector<unsigned char>();
+                read_now(k);
+            }
+        }
+    }
+
+    if (broken) {
+        // the entries the kernel hasn't taken will never run, but the ones
+        // it has must finish before their buffers can be freed
+        in_flight -= ring.unsubmitted();
+        while (in_flight > 0) {
+            if (!ring.wait()) {
+                // completions are still posted to the queue, so watch it
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+            io_uring_cqe cqe;
+            while (ring.next_completion(cqe)) {
+                int k = cqe.user_data >> 1;
+                if (!(cqe.user_data & 1) && cqe.res >= 0) {
+                    fds[k] = cqe.res;
+                }
+                in_flight--;
+            }
+        }
+        for (int &fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    queue.close();
+    for (auto &decoder : decoders) {
+        decoder.join();
+    }
+    if (failure) {
+        rethrow_exception(failure);
+    }
+
+    if (broken) {
+        vector<int> rest;
+        for (int k : order) {
+            if (!handed_over[k]) {
+                rest.push_back(k);
+            }
+        }
+        read_blocking(files, which, rest, num_threads, decode);
+    }
+}
+
+#endif /* TRACE_READER_IO_URING */
+
+void read_trace_files(const vector<CorpusFile> &files,
+                      const vector<int> &which, int num_threads,
+                      const function<void(int, const TraceData &)> &decode) {
+    vector<int> order = disk_order(files, which);
+
+#ifdef TRACE_READER_IO_URING
+    if (io_uring_usable) {
+        // completions never outnumber the files in flight, which the
+        // default completion queue (twice the submission queue) covers
+        Ring ring(TRACE_READS_IN_FLIGHT);
+        if (ring.ok()) {
+            read_io_uring(ring, files, which, order, num_threads, decode);
+            return;
+        }
+        io_uring_usable = false;
+    }
+#endif
+
+    read_blocking(files, which, order, num_threads, decode);
+}
+
+const char *trace_reader_name() {
+#ifdef TRACE_READER_IO_URING
+    if (io_uring_usable) {
+        // find out now rather than at the first read
+        Ring ring(1);
+        if (ring.ok()) {
+            return "io_uring";
+        }
+        io_uring_usable = false;
+    }
+#endif
+
+    return "blocking reads";
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Reading many trace files at once.
+ *
+ * A trace file is usually a few kilobytes, so on a cold page cache (or a
+ * network file system) reading one costs far more waiting than decoding. The
+ * files are read with io_uring where the kernel provides it, with up to
+ * TRACE_READS_IN_FLIGHT opens and reads queued at a time, and each file is
+ * handed to the decoders as soon as it has arrived. Without io_uring the
+ * files are read with ordinary blocking reads on a pool of threads, after
+ * posix_fadvise() hints that start them all on their way.
+ *
+ * Either way the files are read in disk_order(), so the disk reads ahead
+ * rather than seeking between files, however the caller has sorted them.
+ */
+
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <functional>
+#include <vector>
+
+#include "Corpus.h"
+
+/** Most files being opened or read at once with io_uring */
+const unsigned TRACE_READS_IN_FLIGHT = 256;
+
+/**
+ * \brief The order in which to read trace files to seek the least.
+ *
+ * Files are ordered by inode number, which in a directory mostly follows
+ * where their data lies. Files with the same inode number, or none (members
+ * of a pack or archive, which are listed front to back), are read in the
+ * order they are listed.
+ *
+ * \param files the corpus files
+ * \param which indices into files of the files to read
+ * \return a permutation of the indices into which, in reading order
+ */
+std::vector<int> disk_order(const std::vector<CorpusFile> &files,
+                            const std::vector<int> &which);
+
+/**
+ * \brief Read trace files and pass each one to a decoder as it arrives.
+ *
+ * The decoder is called once per file, in no particular order, from the
+ * calling thread and up to num_threads - 1 others at the same time. With
+ * io_uring and more than one thread, the calling thread does the reading
+ * and the others decode. If a read or decode fails, reading stops and the
+ * first exception is rethrown once everything in flight has finished.
+ *
+ * \param files the corpus files
+ * \param which indices into files of the files to read
+ * \param num_threads number of threads
+ * \param decode called as decode(k, trace) with the contents of
+ * files[which[k]]
+ * \throws runtime_error if a file can't be read, or whatever decode throws
+ */
+void read_trace_files(
+    const std::vector<CorpusFile> &files, const std::vector<int> &which,
+    int num_threads,
+    const std::function<void(int, const TraceData &)> &decode);
+
+/** \return how trace files are read, for logging */
+const char *trace_reader_name();
+
+#endif /* TRACE_READER_H */
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Weight file parser and lookup.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include "CorpusPack.h"
+#include "WeightTable.h"
+#include "moonlight.h"
+
+using namespace std;
+using namespace boost::filesystem;
+namespace src = boost::log::sources;
+
+/**
+ * \brief FNV-1a hash of a file name.
+ */
+static uint64_t hash_name(const char *name, size_t length) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<unsigned char>(name[i]);
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+WeightTable::WeightTable(const path &weight_file) : count(0) {
+    if (is_corpus_pack(weight_file)) {
+        // use the weights the pack was made with. The names are copied into
+        // one block first, so pointers into it stay put
+        map<string, double> weights = PackedCorpus(weight_file).weight_map();
+        for (const auto &w : weights) {
+            names += w.first;
+        }
+        reserve(weights.size());
+        size_t offset = 0;
+        for (const auto &w : weights) {
+            insert(names.data() + offset, w.first.size(), w.second);
+            offset += w.first.size();
+        }
+
+        return;
+    }
+
+    try {
+        text = TraceData(weight_file);
+    } catch (const runtime_error &) {
+        throw runtime_error("Unable to read weight file: " +
+                            weight_file.native());
+    }
+    const char *p = reinterpret_cast<const char *>(text.data());
+    const char *end = p + text.size();
+
+    // one line per exemplar, so the line count bounds the table size
+    size_t lines = 1;
+    for (const char *c = p; (c = static_cast<const char *>(
+                                 memchr(c, '\n', end - c))) != nullptr;
+         c++) {
+        lines++;
+    }
+    reserve(lines);
+
+    int line = 0;
+    while (p < end) {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!eol) {
+            eol = end;
+        }
+        line++;
+
+        // name, white space, weight. Anything after the weight is ignored
+        while (p < eol && is_space(*p)) {
+            p++;
+        }
+        const char *name = p;
+        while (p < eol && !is_space(*p)) {
+            p++;
+        }
+        size_t length = p - name;
+        while (p < eol && is_space(*p)) {
+            p++;
+        }
+
+        // strtod needs a terminated string, and the mapping has none
+        char number[64];
+        size_t digits = 0;
+        while (p < eol && !is_space(*p) && digits < sizeof(number) - 1) {
+            number[digits++] = *p++;
+        }
+        number[digits] = '\0';
+        char *parsed;
+        double weight = strtod(number, &parsed);
+
+        if (length == 0 && digits == 0) {
+            // blank line
+        } else if (length == 0 || parsed == number) {
+            throw runtime_error("Bad format in exemplar weight file " +
+                                weight_file.native() + " at line " +
+                                to_string(line));
+        } else {
+            insert(name, length, weight);
+        }
+
+        p = eol + 1;
+    }
+}
+
+void WeightTable::reserve(size_t n) {
+    // keep the load factor at or under a half
+    size_t size = 16;
+    while (size < 2 * n) {
+        size *= 2;
+    }
+    slots.assign(size, Slot{nullptr, 0, 0, 0.0});
+}
+
+void WeightTable::insert(const char *name, uint32_t length, double weight) {
+    uint64_t hash = hash_name(name, length);
+    size_t mask = slots.size() - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Slot &slot = slots[i];
+        if (!slot.name) {
+            slot = Slot{name, hash, length, weight};
+            count++;
+            return;
+        }
+        if (slot.hash == hash && slot.length == length &&
+            memcmp(slot.name, name, length) == 0) {
+            return;
+        }
+    }
+}
+
+int WeightTable::size() const {
+    return count;
+}
+
+int WeightTable::find(const string &name) const {
+    uint64_t hash = hash_name(name.data(), name.size());
+    size_t mask = slots.size() - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const Slot &slot = slots[i];
+        if (!slot.name) {
+            return -1;
+        }
+        if (slot.hash == hash && slot.length == name.size() &&
+            memcmp(slot.name, name.data(), name.size()) == 0) {
+            return i;
+        }
+    }
+}
+
+shared_ptr<const WeightTable> load_weights(const path &weight_file) {
+    static mutex lock;
+    static path loaded;
+    static shared_ptr<const WeightTable> table;
+
+    lock_guard<mutex> guard(lock);
+    if (!table || loaded != weight_file) {
+        table = make_shared<WeightTable>(weight_file);
+        loaded = weight_file;
+
+        src::severity_logger<> &mylog = my_logger::get();
+        BOOST_LOG(mylog) << "Read " << table->size()
+                         << " exemplar weights from " << weight_file;
+    }
+
+    return table;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Exemplar weights, loaded from a weight file.
+ */
+
+#ifndef WEIGHT_TABLE_H
+#define WEIGHT_TABLE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "Corpus.h"
+
+/**
+ * \brief An open addressing hash table from exemplar file names to weights.
+ *
+ * A weight file has one line per exemplar: the file name, white space, then
+ * the weight. The file is read in one go (mapped if it is large) and the
+ * names are used where they lie rather than copied. If a name appears more
+ * than once the first weight is used.
+ */
+class WeightTable {
+public:
+    /**
+     * \brief Read a weight file, or the weights of a weighted corpus pack.
+     *
+     * \param weight_file path to the weight file
+     * \throws runtime_error if the file can't be read or a line isn't a name
+     * followed by a weight
+     */
+    explicit WeightTable(const boost::filesystem::path &weight_file);
+
+    WeightTable(const WeightTable &orig) = delete;
+    WeightTable &operator=(const WeightTable &rhs) = delete;
+
+    /** Number of distinct exemplar names */
+    int size() const;
+
+    /**
+     * \brief Look up an exemplar.
+     *
+     * \param name the exemplar file name
+     * \return the exemplar's entry, or -1 if it has no weight
+     */
+    int find(const std::string &name) const;
+
+    /** The weight of an entry returned by find() */
+    double weight(int entry) const {
+        return slots[entry].weight;
+    }
+
+    /** Upper bound on the entries find() returns, for per-entry flags */
+    int capacity() const {
+        return slots.size();
+    }
+
+private:
+    /** A hash table slot. Empty if name is null */
+    struct Slot {
+        const char *name;
+        std::uint64_t hash;
+        std::uint32_t length;
+        double weight;
+    };
+
+    /** Add a name, unless it's already there */
+    void insert(const char *name, std::uint32_t length, double weight);
+
+    /** Size the table for the given number of names */
+    void reserve(std::size_t count);
+
+    /** The slots. The size is a power of two */
+    std::vector<Slot> slots;
+
+    /** Number of names in the table */
+    int count;
+
+    /** The weight file contents, which the names point into */
+    TraceData text;
+
+    /** Storage for names that aren't in the weight file text */
+    std::string names;
+};
+
+/**
+ * \brief Load the exemplar weights in a weight file.
+ *
+ * The file is only read the first time. Later calls for the same file share
+ * the same table, so the matrix, the large data pass, the corpus packer and
+ * the solution check all use one copy.
+ *
+ * \param weight_file path to the weight file, or a weighted corpus pack
+ * \return the weights
+ * \throws runtime_error if the file can't be read or is badly formatted
+ */
+std::shared_ptr<const WeightTable>
+load_weights(const boost::filesystem::path &weight_file);
+
+#endif /* WEIGHT_TABLE_H */
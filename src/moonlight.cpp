@@ -30,8 +30,8 @@
  */
 
 #include <chrono>
+#include <memory>
 
-#include <boost/archive/binary_oarchive.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
@@ -39,8 +39,13 @@
 #include <boost/log/utility/setup/file.hpp>
 #include <boost/program_options.hpp>
 
+#include "Corpus.h"
+#include "CorpusArchive.h"
+#include "CorpusCoverage.h"
+#include "CorpusPack.h"
 #include "ExemplarData.h"
 #include "Matrix.h"
+#include "MatrixCache.h"
 #include "OSCPSolver.h"
 #include "moonlight.h"
 
@@ -74,11 +79,93 @@ static path weight_file;
 static bool ignore_matrixfile;
 static bool large_data;
 static bool greedy;
+static int num_threads;
+static path pack_output;
+static path packfile;
+static path file_list;
+static path archive_file;
+static TraceFormat trace_format;
+static bool hit_counts;
+static bool order_columns;
 
 /////////////////////////////////////////////////////////////////////////////
 // Utility Functions
 /////////////////////////////////////////////////////////////////////////////
 
+/**
+ * \brief Describe the corpus and weights a matrix is built from.
+ *
+ * A cached matrix is only used if it was built with the same key. The traces
+ * themselves are checked against the cache's manifest (see CachedCorpus), so
+ * they aren't part of the key.
+ */
+static string matrix_cache_key() {
+    auto stamp = [](const path &p) {
+        return absolute(p).native() + " " + to_string(file_size(p)) + " " +
+               to_string(last_write_time(p));
+    };
+    string key;
+
+    if (!packfile.empty()) {
+        key = "pack " + absolute(packfile).native() + "\n";
+    } else if (!archive_file.empty()) {
+        key = "archive " + absolute(archive_file).native() + "\n";
+        key += "pattern " + pattern + "\n";
+    } else {
+        key = "directory " + absolute(directory).native() + "\n";
+        if (file_list.empty()) {
+            key += "pattern " + pattern + "\n";
+        } else {
+            key += "list " + absolute(file_list).native() + "\n";
+        }
+        if (trace_format == TraceFormat::AFL) {
+            key += hit_counts ? "format afl hit-counts\n" : "format afl\n";
+        } else if (trace_format == TraceFormat::AFL_RAW) {
+            key += hit_counts ? "format afl-raw hit-counts\n"
+                              : "format afl-raw\n";
+        } else if (trace_format == TraceFormat::SANCOV) {
+            key += "format sancov\n";
+        }
+    }
+    key += "weights " + (weight_file.empty() ? "none" : stamp(weight_file));
+
+    return key;
+}
+
+/**
+ * \brief Open the corpus given on the command line: a corpus pack, an
+ * archive, a file list or (by default) the corpus directory. The files of a
+ * directory or file list may be fuzzer coverage files.
+ */
+static std::shared_ptr<CorpusReader> open_corpus() {
+    src::severity_logger<> &mylog = my_logger::get();
+
+    if (trace_format != TraceFormat::BIT_VECTOR) {
+        if (!packfile.empty() || !archive_file.empty()) {
+            throw runtime_error("--trace-format only applies to a corpus "
+                                "directory or file list");
+        }
+        std::unique_ptr<DirectoryCorpus> listing(
+            file_list.empty()
+                ? new DirectoryCorpus(directory, pattern, num_threads)
+                : new DirectoryCorpus(directory, file_list, num_threads));
+        return std::make_shared<CoverageCorpus>(
+            listing->files(), trace_format, hit_counts, num_threads);
+    } else if (!packfile.empty()) {
+        BOOST_LOG(mylog) << "Reading corpus pack " << packfile;
+        return std::make_shared<PackedCorpus>(packfile);
+    } else if (!archive_file.empty()) {
+        return std::make_shared<ArchiveCorpus>(archive_file, pattern,
+                                               num_threads);
+    } else if (!file_list.empty()) {
+        return std::make_shared<DirectoryCorpus>(directory, file_list,
+                                                 num_threads);
+    } else {
+        return std::make_shared<DirectoryCorpus>(directory, pattern,
+                                                 num_threads);
+    }
+}
+
 /** \brief Configure the logger */
 BOOST_LOG_GLOBAL_LOGGER_INIT(my_logger, src::logger_mt) {
     src::severity_logger<> lg(keywords::severity = info);
@@ -116,47 +203,99 @@ int main(int argc, char **argv) {
     ////////////////////////////////////////////////////////////////
 
     OSCPSolver solver;
-    Matrix matrix;
 
-    // parse data into a matrix
-    if (!ignore_matrixfile && exists(matrixfile) &&
-        is_regular_file(matrixfile)) {
-        // if we've serialised it before use that...
+    if (!pack_output.empty()) {
+        // just convert the corpus into a corpus pack
+        write_corpus_pack(*open_corpus(), weight_file, pack_output,
+                          num_threads);
+        BOOST_LOG(mylog) << "End ";
+
+        return EXIT_SUCCESS;
+    }
+
+    // parse data into a matrix. In large data mode the solver has already
+    // been handed the row unitarians when the matrix is built, which the
+    // cached matrix knows nothing about, so the cache isn't used
+    bool use_matrixfile = !ignore_matrixfile && !(large_data && !greedy);
+    string cache_key = use_matrixfile ? matrix_cache_key() : string();
+    std::unique_ptr<MatrixCache> cache;
+    if (use_matrixfile && exists(matrixfile) && is_regular_file(matrixfile) &&
+        MatrixCache::read_key(matrixfile) == cache_key) {
+        // if we've cached it before for this corpus only the traces that
+        // have changed since need to be read
         BOOST_LOG(mylog) << "Matrix data appears to have been serialised to "
-                         << "disk. Attempting to restore it.";
-        Matrix dmat(matrixfile); // construct from file
-        BOOST_LOG(mylog) << "Matrix restored from file.";
-        matrix = dmat; // move assign
-    } else {
-        // we need to parse the whole corpus to construct the matrix
+                         << "disk. Checking it against the corpus.";
+        try {
+            cache.reset(new MatrixCache(matrixfile));
+        } catch (const runtime_error &e) {
+            // a damaged cache is just rebuilt
+            BOOST_LOG_SEV(mylog, warning) << e.what() << ". Rebuilding it";
+        }
+    }
+    if (!cache) {
         BOOST_LOG(mylog) << "Constructing matrix from corpus data";
-        INDEX_LIST cols_to_ignore;
+    }
 
-        if (large_data && !greedy) {
-            cols_to_ignore =
-                solver.calc_cols_to_ignore(directory, pattern, weight_file);
+    INDEX_LIST cols_to_ignore;
+    std::shared_ptr<CorpusReader> corpus = open_corpus();
+    const CorpusReader *source = corpus.get();
+
+    std::unique_ptr<CachedCorpus> cached;
+    if (cache) {
+        try {
+            cached.reset(new CachedCorpus(*corpus, *cache));
+        } catch (const runtime_error &e) {
+            BOOST_LOG_SEV(mylog, warning)
+                << "Unable to match the matrix cache to the corpus: "
+                << e.what() << ". Rebuilding it";
+            cache.reset();
         }
+    }
+    if (cached) {
+        source = cached.get();
+        BOOST_LOG(mylog) << cached->num_cached() << " of "
+                         << corpus->files().size()
+                         << " traces are unchanged since the matrix was cached";
+    }
 
-        Matrix dmat(directory, pattern, weight_file,
-                    cols_to_ignore); // construct from corpus data
-        BOOST_LOG(mylog) << "Finished constructing matrix from corpus data";
-
-        if (!ignore_matrixfile) {
-            // having just constructed it - serialise to disk so we don't need
-            // to do this again
-            BOOST_LOG(mylog) << "Serialising matrix to disk for future "
-                             << "possible use";
-            std::ofstream matrix_file_out(matrixfile.native());
-            boost::archive::binary_oarchive sout(matrix_file_out);
-            BOOST_LOG(mylog) << "Writing matrix data to file for archiving...";
-            // write class instance to archive
-            // getting serialisation error since converting rowlist from a list
-            // to a vector
-            // see git log for when that was. TODO: fix this
-            BOOST_LOG(mylog) << "Finished Writing matrix data to file.";
-        }
-        matrix = dmat; // move assign
-        // archive and stream closed when destructors are called
+    // in large data mode the traces are read from the corpus directory
+    // once, into a compact spill file that both the row unitarian pass
+    // and the matrix construction work from
+    std::unique_ptr<CorpusSpill> spill;
+    if (large_data && !greedy) {
+        spill.reset(new CorpusSpill(*corpus));
+        cols_to_ignore = solver.calc_cols_to_ignore(*corpus, weight_file,
+                                                    *spill, num_threads);
+        source = spill.get();
+    }
+
+    Matrix matrix(*source, weight_file, cols_to_ignore,
+                  num_threads); // construct from corpus data
+    spill.reset();
+    // solution rows are re-read from the corpus, not the spill
+    matrix.set_trace_source(corpus);
+    BOOST_LOG(mylog) << "Finished constructing matrix from corpus data";
+
+    // the cache is up to date if every cached row was reused and the corpus
+    // has nothing new
+    bool cache_current =
+        cache && cached->num_cached() == cache->num_rows() &&
+        matrix.get_num_rows() == cache->num_rows() &&
+        (int) corpus->files().size() == cache->num_traces();
+    cached.reset();
+    cache.reset();
+    if (use_matrixfile && !cache_current) {
+        // having just constructed it - cache it on disk so we don't need
+        // to do this again
+        BOOST_LOG(mylog) << "Serialising matrix to disk for future "
+                         << "possible use";
+        MatrixCache::write(matrix, matrixfile, cache_key);
+    }
+
+    // the cache holds the columns as the traces number them, so they are
+    // only renumbered once it is written
+    if (order_columns) {
+        matrix.order_columns();
     }
 
     // we want a place to store all the meta-data about each of the exemplars
@@ -212,7 +351,30 @@ void command_line_processing(int argc, char **argv) {
                  "Absolute path to the file containing the exemplar weights")(
         "large-data,l",
         "Use less memory, matrix data will be too large in sparse form")(
-        "greedy,g", "Apply the standard greedy algorithm");
+        "greedy,g", "Apply the standard greedy algorithm")(
+        "threads,t", po::value<int>(),
+        "Number of threads used to read the corpus. 0 means one per core")(
+        "pack", po::value<string>(),
+        "Write the corpus files (and any weights) to a single corpus pack "
+        "file and exit")(
+        "packed,p", po::value<string>(),
+        "Read the corpus from a corpus pack made with --pack instead of the "
+        "corpus directory")(
+        "file-list,f", po::value<string>(),
+        "Read the names of the corpus files from this file instead of "
+        "scanning the corpus directory")(
+        "archive,z", po::value<string>(),
+        "Read the corpus straight from a tar archive (optionally gzip, bzip2, "
+        "xz or zstd compressed) instead of the corpus directory")(
+        "trace-format", po::value<string>(),
+        "Format of the corpus files: bits (MoonLight traces, the default), "
+        "afl (afl-showmap maps), afl-raw (afl-showmap -r maps of raw hit "
+        "counts) or sancov (SanitizerCoverage files)")(
+        "hit-counts",
+        "Make a column of each AFL hit count bucket of each edge, as afl-cmin "
+        "does, rather than of each edge")(
+        "order-columns",
+        "Renumber the matrix columns most frequent first before solving");
 
     // process the command line options
     po::variables_map vm; // command line variable map
@@ -281,8 +443,57 @@ void command_line_processing(int argc, char **argv) {
                          << "exists and write one if it doesn't";
     }
 
+    if (vm.count("pack")) {
+        pack_output = path(vm["pack"].as<string>());
+        BOOST_LOG(mylog) << "Packing the corpus into " << pack_output;
+    }
+
+    if (vm.count("packed")) {
+        packfile = path(vm["packed"].as<string>());
+        BOOST_LOG(mylog) << "Reading the corpus from corpus pack :"
+                         << packfile;
+    }
+
+    if (vm.count("file-list")) {
+        file_list = path(vm["file-list"].as<string>());
+        BOOST_LOG(mylog) << "Reading the corpus file names from :"
+                         << file_list;
+    }
+
+    if (vm.count("archive")) {
+        archive_file = path(vm["archive"].as<string>());
+        BOOST_LOG(mylog) << "Reading the corpus from archive :"
+                         << archive_file;
+    }
+
+    if (vm.count("trace-format")) {
+        trace_format = parse_trace_format(vm["trace-format"].as<string>());
+        BOOST_LOG(mylog) << "Corpus files are in the "
+                         << vm["trace-format"].as<string>() << " format";
+    } else {
+        trace_format = TraceFormat::BIT_VECTOR;
+    }
+
+    if (vm.count("hit-counts")) {
+        hit_counts = true;
+        BOOST_LOG(mylog) << "Each AFL hit count bucket is a separate column";
+    } else {
+        hit_counts = false;
+    }
+
+    if (vm.count("order-columns")) {
+        order_columns = true;
+        BOOST_LOG(mylog) << "Renumbering the columns most frequent first";
+    } else {
+        order_columns = false;
+    }
+
     if (vm.count("weighted")) {
         weight_file = path(vm["weighted"].as<string>());
+    } else if (!packfile.empty() && is_corpus_pack(packfile) &&
+               PackedCorpus(packfile).weighted()) {
+        weight_file = packfile;
+        BOOST_LOG(mylog) << "Using the weights stored in the corpus pack";
     } else {
         weight_file = path(); // empty path indicates unweighted version
     }
@@ -308,6 +519,16 @@ void command_line_processing(int argc, char **argv) {
         BOOST_LOG(mylog) << "Using the Reduction Algorithm";
     }
 
+    if (vm.count("threads")) {
+        num_threads = vm["threads"].as<int>();
+        BOOST_LOG(mylog) << "Reading the corpus with " << num_threads
+                         << " thread(s) (0 = one per core)";
+    } else {
+        num_threads = 1;
+        BOOST_LOG(mylog) << "Number of threads was not set. Defaulting to "
+                         << num_threads;
+    }
+
     // run name configuration of file names
     resultfile = directory / path(runname + "_solution.json");
     BOOST_LOG(mylog) << "Storing solution in file :" << resultfile;
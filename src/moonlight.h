@@ -40,9 +40,11 @@
 #include <boost/log/sources/global_logger_storage.hpp>
 #include <boost/log/trivial.hpp>
 
+#include "BitRow.h"
+
 using INDEX = int;    // a column index
 using BIN_ELEM = int; // a single binary (0 or 1) element of the matrix
-using ROW = std::vector<BIN_ELEM>;    // a 0-1 vector of a row from the matrix
+using ROW = BitRow;   // a packed 0-1 vector of a row from the matrix
 using COLUMN = std::vector<BIN_ELEM>; // a 0-1 vector of a col from the matrix
 using COL_DATA = std::vector<INDEX>;  // the column data stored for each row
 using INDEX_LIST = std::vector<INDEX>;
@@ -50,6 +52,9 @@ using COLUMN_SUM = std::vector<int>;
 using ROW_SUM = std::vector<int>;
 using MEASURE = std::vector<double>;
 
+// marks a column index that has been deleted or is to be ignored
+#define DELETED -1
+
 // logging joy
 #define BOOST_LOG_DYN_LINK 1
 
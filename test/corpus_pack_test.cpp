@@ -0,0 +1,228 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Check that a corpus pack reads back as the corpus it was made from,
+ * and that a damaged pack is rejected.
+ *
+ * A small weighted corpus of dense and sparse traces is packed, so that both
+ * the raw and the column list encodings are used. The pack must list the same
+ * traces, columns and weights as the directory. Every truncation of the pack,
+ * and index entries pointing outside it, must then make opening it throw.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/log/core.hpp>
+
+#include "Corpus.h"
+#include "CorpusPack.h"
+
+using namespace std;
+using namespace boost::filesystem;
+
+/** Linked in code logs through this, and the test doesn't want it */
+BOOST_LOG_GLOBAL_LOGGER_INIT(my_logger, boost::log::sources::logger_mt) {
+    boost::log::sources::severity_logger<> lg;
+    boost::log::core::get()->set_logging_enabled(false);
+
+    return lg;
+}
+
+/** Where the pack header keeps the number of traces and the index offset */
+static const size_t NUM_TRACES_AT = 16;
+static const size_t INDEX_OFFSET_AT = 24;
+
+/** Size of an index entry, and where it keeps the fields damaged below */
+static const size_t ENTRY_SIZE = 56;
+static const size_t OFFSET_AT = 0;
+static const size_t NAME_LENGTH_AT = 32;
+static const size_t ENCODING_AT = 48;
+
+static vector<char> read_file(const path &file) {
+    std::ifstream in(file.native(), std::ifstream::binary);
+
+    return vector<char>(istreambuf_iterator<char>(in),
+                        istreambuf_iterator<char>());
+}
+
+static void write_file(const path &file, const vector<char> &bytes) {
+    std::ofstream out(file.native(),
+                      std::ofstream::binary | std::ofstream::trunc);
+    out.write(bytes.data(), bytes.size());
+}
+
+template <typename T> static T get(const vector<char> &bytes, size_t at) {
+    T value;
+    memcpy(&value, bytes.data() + at, sizeof(value));
+
+    return value;
+}
+
+template <typename T>
+static void put(vector<char> &bytes, size_t at, T value) {
+    memcpy(bytes.data() + at, &value, sizeof(value));
+}
+
+/** true iff opening the pack throws runtime_error */
+static bool rejected(const path &pack) {
+    try {
+        PackedCorpus corpus(pack);
+    } catch (const runtime_error &) {
+        return true;
+    }
+
+    return false;
+}
+
+/** The corpus's columns, by trace name */
+static map<string, COL_DATA> read_corpus(const CorpusReader &corpus) {
+    map<string, COL_DATA> result;
+    for (unsigned int i = 0; i < corpus.files().size(); i++) {
+        COL_DATA &columns =
+            result[corpus.files()[i].file_path.filename().string()];
+        corpus.read_columns(i, vector<int>(), columns);
+    }
+
+    return result;
+}
+
+static int check_pack(const path &dir) {
+    // a dense trace, a sparse one, an empty one and one with no weight
+    vector<string> traces = {string("\xff\x5a\x00\x81", 4),
+                             string(200, '\0') + "\x01",
+                             string(8, '\0'),
+                             string("\x80\x00\x00\x00\x00\x00\x00\x02", 8)};
+    for (unsigned int t = 0; t < traces.size(); t++) {
+        std::ofstream out((dir / ("exemplar_" + to_string(t))).native(),
+                          std::ofstream::binary);
+        out << traces[t];
+    }
+    path weight_file = dir / "weights";
+    {
+        std::ofstream out(weight_file.native());
+        out << "exemplar_0 2.5\nexemplar_1 1\nexemplar_2 0.25\n";
+    }
+
+    DirectoryCorpus directory(dir, "exemplar_");
+    path pack = dir / "corpus.pack";
+    write_corpus_pack(directory, weight_file, pack, 1);
+
+    {
+        PackedCorpus packed(pack);
+        if (read_corpus(packed) != read_corpus(directory)) {
+            cerr << "The pack's columns differ from the directory's" << endl;
+            return 1;
+        }
+        map<string, double> weights = {
+            {"exemplar_0", 2.5}, {"exemplar_1", 1}, {"exemplar_2", 0.25}};
+        if (!packed.weighted() || packed.weight_map() != weights) {
+            cerr << "The pack's weights differ from the weight file" << endl;
+            return 1;
+        }
+    }
+
+    vector<char> bytes = read_file(pack);
+    uint64_t num_traces = get<uint64_t>(bytes, NUM_TRACES_AT);
+    uint64_t index = get<uint64_t>(bytes, INDEX_OFFSET_AT);
+    int encodings[2] = {0, 0};
+    for (uint64_t i = 0; i < num_traces; i++) {
+        uint32_t encoding =
+            get<uint32_t>(bytes, index + i * ENTRY_SIZE + ENCODING_AT);
+        encodings[encoding & 1]++;
+    }
+    if (!encodings[0] || !encodings[1]) {
+        cerr << "The pack doesn't use both trace encodings" << endl;
+        return 1;
+    }
+
+    path damaged = dir / "damaged.pack";
+    for (size_t length = 0; length < bytes.size(); length++) {
+        write_file(damaged,
+                   vector<char>(bytes.begin(), bytes.begin() + length));
+        if (!rejected(damaged)) {
+            cerr << "A pack truncated to " << length << " of " << bytes.size()
+                 << " bytes was accepted" << endl;
+            return 1;
+        }
+    }
+
+    struct Damage {
+        const char *what;
+        size_t at;
+        uint64_t value;
+        size_t size;
+    };
+    vector<Damage> damage = {
+        {"a trace offset past the end", OFFSET_AT, bytes.size() + 1, 8},
+        {"a name past the end", NAME_LENGTH_AT, bytes.size() + 1, 4},
+        {"an unknown encoding", ENCODING_AT, 7, 4},
+    };
+    for (const Damage &d : damage) {
+        for (uint64_t i = 0; i < num_traces; i++) {
+            vector<char> corrupt = bytes;
+            size_t at = index + i * ENTRY_SIZE + d.at;
+            if (d.size == 8) {
+                put<uint64_t>(corrupt, at, d.value);
+            } else {
+                put<uint32_t>(corrupt, at, d.value);
+            }
+            write_file(damaged, corrupt);
+            if (!rejected(damaged)) {
+                cerr << "A pack with " << d.what << " was accepted" << endl;
+                return 1;
+            }
+        }
+    }
+
+    vector<char> corrupt = bytes;
+    put<uint64_t>(corrupt, INDEX_OFFSET_AT, bytes.size() - ENTRY_SIZE);
+    write_file(damaged, corrupt);
+    if (!rejected(damaged)) {
+        cerr << "A pack with its index past the end was accepted" << endl;
+        return 1;
+    }
+
+    cout << "The pack reads back as the corpus and damaged packs are rejected"
+         << endl;
+
+    return 0;
+}
+
+int main() {
+    path dir = temp_directory_path() / unique_path();
+    create_directory(dir);
+    int result = check_pack(dir);
+    remove_all(dir);
+
+    return result;
+}
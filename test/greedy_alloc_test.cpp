@@ -0,0 +1,143 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Check that a greedy step allocates nothing once its working
+ * storage has grown.
+ *
+ * Every allocation goes through a counting operator new. A synthetic matrix
+ * of sparse list rows is built and reduced a greedy step at a time, and the
+ * steps after the first few must not allocate at all. The matrix is big
+ * enough that the steps measured don't compact it, and its rows read back
+ * as empty traces so the solution needs no heap memory either.
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+
+#include <boost/log/core.hpp>
+
+#include "Corpus.h"
+#include "Matrix.h"
+#include "OSCPSolver.h"
+#include "Solution.h"
+
+using namespace std;
+using boost::filesystem::path;
+
+/** Whether allocations are being counted */
+static bool counting = false;
+
+/** Number of allocations counted */
+static long allocations = 0;
+
+void *operator new(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw bad_alloc();
+    }
+
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+/** The solver logs through this, and the test doesn't want it */
+BOOST_LOG_GLOBAL_LOGGER_INIT(my_logger, boost::log::sources::logger_mt) {
+    boost::log::sources::severity_logger<> lg;
+    boost::log::core::get()->set_logging_enabled(false);
+
+    return lg;
+}
+
+/** Traces that are all empty, for the solution rows */
+class EmptyTraces : public CorpusReader {
+public:
+    explicit EmptyTraces(int traces) {
+        corpus.assign(traces, CorpusFile(path(), 0));
+    }
+
+    void read_columns(int i, const vector<int> &transform,
+                      COL_DATA &columns) const override {
+    }
+};
+
+int main() {
+    const int rows = 400;
+    const int cols = 4096;
+    const int ones = 16;
+    const int warm_up = 2;
+    const int steps = 10;
+
+    mt19937 random(1);
+    Matrix data(0, cols);
+    for (int r = 0; r < rows; r++) {
+        set<INDEX> row;
+        while ((int) row.size() < ones) {
+            row.insert(random() % cols);
+        }
+        data.insert_row(path("r" + to_string(r)), cols / 8,
+                        COL_DATA(row.begin(), row.end()), 1.0, r);
+    }
+    data.set_trace_source(make_shared<EmptyTraces>(rows));
+
+    Solution solution;
+    solution.solution.reserve(rows);
+    solution.rowdata.reserve(rows);
+    solution.scores.reserve(rows);
+    CORPUS_DATA corpus_data;
+    GreedyBuffers buffers;
+
+    for (int k = 0; k < warm_up; k++) {
+        eliminate_max_score(data, solution, corpus_data, buffers);
+    }
+    counting = true;
+    for (int k = 0; k < steps; k++) {
+        eliminate_max_score(data, solution, corpus_data, buffers);
+    }
+    counting = false;
+
+    if (solution.solution.size() != warm_up + steps) {
+        cerr << "Expected " << warm_up + steps << " greedy choices, got "
+             << solution.solution.size() << endl;
+        return 1;
+    }
+    if (allocations) {
+        cerr << steps << " greedy steps made " << allocations
+             << " allocations" << endl;
+        return 1;
+    }
+    cout << steps << " greedy steps made no allocations" << endl;
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Check that every trace decoder the CPU supports gives the same
+ * answers.
+ *
+ * Random traces of random lengths and densities, with long zero runs, are
+ * counted and decoded by each kernel, both with no transform and through a
+ * transform that deletes some of the columns. Each result is compared with
+ * a bit at a time decode of the same trace. Sparse trace headers must give
+ * their size as long as its columns fit in an int, and be rejected beyond.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/log/core.hpp>
+
+#include "ColumnCodec.h"
+#include "TraceDecode.h"
+
+using namespace std;
+
+/** Linked in code logs through this, and the test doesn't want it */
+BOOST_LOG_GLOBAL_LOGGER_INIT(my_logger, boost::log::sources::logger_mt) {
+    boost::log::sources::severity_logger<> lg;
+    boost::log::core::get()->set_logging_enabled(false);
+
+    return lg;
+}
+
+/** A random trace, dense in places, empty in others */
+static vector<unsigned char> random_trace(mt19937 &random) {
+    vector<unsigned char> trace(random() % 600);
+    // one in 'density' bytes is non-zero, except in zero runs
+    unsigned int density = 1 + random() % 16;
+    size_t b = 0;
+    while (b < trace.size()) {
+        size_t run = 1 + random() % 200;
+        bool zero = random() % 3 == 0;
+        for (; run && b < trace.size(); run--, b++) {
+            if (!zero && random() % density == 0) {
+                trace[b] = random();
+            }
+        }
+    }
+
+    return trace;
+}
+
+/** A monotonic transform over 'columns' that deletes some of them */
+static vector<int> random_transform(mt19937 &random, size_t columns) {
+    vector<int> transform(columns);
+    int next = 0;
+    for (size_t c = 0; c < columns; c++) {
+        transform[c] = random() % 4 == 0 ? DELETED : next++;
+    }
+
+    return transform;
+}
+
+/** Decode a trace a bit at a time, most significant bit first */
+static COL_DATA reference_decode(const vector<unsigned char> &trace,
+                                 const int *transform) {
+    COL_DATA result;
+    for (size_t i = 0; i < 8 * trace.size(); i++) {
+        if (trace[i / 8] & (0x80 >> (i % 8))) {
+            int column = transform ? transform[i] : (int) i;
+            if (column != DELETED) {
+                result.push_back(column);
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * The size trace_size() reads from a sparse trace header giving 'size', or
+ * -1 if the header is rejected
+ */
+static long long sparse_size(uint64_t size) {
+    vector<unsigned char> trace = {'M', 'L', 'S', 'P', 'A', 'R', 'S', 'E'};
+    put_varint(size, trace);
+    put_varint(0, trace); // no blocks
+    try {
+        return trace_size(trace.data(), trace.size(), trace.size());
+    } catch (const runtime_error &) {
+        return -1;
+    }
+}
+
+int main() {
+    const int traces = 20000;
+
+    // 8 times the size must fit in an int
+    const uint64_t max_size = numeric_limits<int>::max() / 8;
+    for (uint64_t size : {uint64_t(0), uint64_t(2), max_size}) {
+        if (sparse_size(size) != (long long) size) {
+            cerr << "A sparse trace of " << size << " bytes was rejected"
+                 << endl;
+            return 1;
+        }
+    }
+    for (uint64_t size : {max_size + 1, uint64_t(1) << 30,
+                          (uint64_t) numeric_limits<int>::max()}) {
+        if (sparse_size(size) != -1) {
+            cerr << "A sparse trace of " << size << " bytes was accepted"
+                 << endl;
+            return 1;
+        }
+    }
+
+    vector<TraceDecoder> decoders = supported_trace_decoders();
+    for (const TraceDecoder &decoder : decoders) {
+        cout << "Checking the " << decoder.name << " decoder" << endl;
+    }
+
+    mt19937 random(1);
+    int failures = 0;
+    for (int t = 0; t < traces && !failures; t++) {
+        vector<unsigned char> trace = random_trace(random);
+        vector<int> transform = random_transform(random, 8 * trace.size());
+        size_t ones = reference_decode(trace, nullptr).size();
+
+        for (int with_transform = 0; with_transform < 2; with_transform++) {
+            const int *map = with_transform ? transform.data() : nullptr;
+            COL_DATA expected = reference_decode(trace, map);
+
+            for (const TraceDecoder &decoder : decoders) {
+                size_t count = decoder.count(trace.data(), trace.size());
+                if (count != ones) {
+                    cerr << decoder.name << " counted " << count
+                         << " set bits in trace " << t << ", expected "
+                         << ones << endl;
+                    failures++;
+                    continue;
+                }
+
+                COL_DATA columns(count + TRACE_DECODE_SLACK);
+                INDEX *end = decoder.decode(trace.data(), trace.size(), map,
+                                            columns.data());
+                columns.resize(end - columns.data());
+                if (columns != expected) {
+                    cerr << decoder.name << " decoded trace " << t
+                         << (map ? " with" : " without")
+                         << " a transform wrongly" << endl;
+                    failures++;
+                }
+            }
+        }
+    }
+
+    if (failures) {
+        return 1;
+    }
+    cout << traces << " traces decoded alike by " << decoders.size()
+         << " decoders" << endl;
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2017 The Australian National University
+ *
+ * This software is the result of a joint project between the Defence Science
+ * and Technology Group and the Australian National University. It was enabled
+ * as part of a Next Generation Technology Fund grant:
+ * see https://www.dst.defence.gov.au/nextgentechfund
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * \brief Check that the trace reader falls back to blocking reads when the
+ * io_uring stops taking submissions part way through.
+ *
+ * Every system call goes through a syscall() that fails the third
+ * io_uring_enter that submits anything, as a broken ring would. A corpus of
+ * small trace files is then read, and every file must still be decoded
+ * exactly once with the right contents, without leaking any file
+ * descriptors. With --fail-waits the calls that wait for the reads already
+ * submitted fail too. With --busy that and the next few submissions fail
+ * with EAGAIN instead, which the reader must wait out and keep using the
+ * ring. Without io_uring there is nothing to check.
+ */
+
+#include <cerrno>
+#include <cstdarg>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/log/core.hpp>
+
+#include "Corpus.h"
+#include "TraceReader.h"
+
+using namespace std;
+using namespace boost::filesystem;
+
+/** Submitting io_uring_enter calls to let through before failing one */
+static int submits_left = -1;
+
+/** Number of io_uring_enter calls failed */
+static int submits_failed = 0;
+
+/** Fail the io_uring_enter calls that only wait, once a submit has failed */
+static bool fail_waits = false;
+
+/** Fail submissions with EAGAIN, as a ring short of resources would */
+static bool busy = false;
+
+/** Number of submissions to fail with EAGAIN */
+static const int BUSY_SUBMITS = 5;
+
+long syscall(long number, ...) noexcept {
+    using SYSCALL = long (*)(long, ...);
+    static SYSCALL real = (SYSCALL) dlsym(RTLD_NEXT, "syscall");
+
+    va_list ap;
+    va_start(ap, number);
+    long args[6];
+    for (long &arg : args) {
+        arg = va_arg(ap, long);
+    }
+    va_end(ap);
+
+#ifdef __NR_io_uring_enter
+    // args[1] is the number of entries to submit
+    if (number == __NR_io_uring_enter && args[1] > 0 && submits_left >= 0 &&
+        submits_left-- == 0) {
+        submits_failed++;
+        errno = busy ? EAGAIN : ENXIO;
+        if (busy && submits_failed < BUSY_SUBMITS) {
+            submits_left = 0;
+        }
+        return -1;
+    }
+    if (number == __NR_io_uring_enter && args[1] == 0 && submits_failed &&
+        fail_waits) {
+        errno = ENXIO;
+        return -1;
+    }
+#endif
+
+    return real(number, args[0], args[1], args[2], args[3], args[4],
+                args[5]);
+}
+
+/** Linked in code logs through this, and the test doesn't want it */
+BOOST_LOG_GLOBAL_LOGGER_INIT(my_logger, boost::log::sources::logger_mt) {
+    boost::log::sources::severity_logger<> lg;
+    boost::log::core::get()->set_logging_enabled(false);
+
+    return lg;
+}
+
+/** Number of file descriptors this process has open */
+static int open_fds() {
+    int count = 0;
+    for (directory_iterator it("/proc/self/fd"), end; it != end; ++it) {
+        count++;
+    }
+
+    return count;
+}
+
+static int check_reader(const path &dir) {
+    const int traces = 2000;
+
+    mt19937 random(1);
+    vector<string> contents(traces);
+    for (int t = 0; t < traces; t++) {
+        contents[t].resize(1 + random() % 200);
+        for (char &c : contents[t]) {
+            c = random();
+        }
+        std::ofstream out((dir / ("exemplar_" + to_string(t))).native(),
+                          std::ofstream::binary);
+        out << contents[t];
+    }
+
+    DirectoryCorpus corpus(dir, "exemplar_");
+    const vector<CorpusFile> &files = corpus.files();
+    vector<int> which(files.size());
+    for (unsigned int i = 0; i < files.size(); i++) {
+        which[i] = i;
+    }
+
+    int fds = open_fds();
+    mutex lock;
+    vector<int> decoded(files.size(), 0);
+    vector<string> read(files.size());
+    submits_left = 2;
+    read_trace_files(files, which, 4, [&](int k, const TraceData &trace) {
+        lock_guard<mutex> guard(lock);
+        decoded[k]++;
+        read[k].assign(reinterpret_cast<const char *>(trace.data()),
+                       trace.size());
+    });
+    submits_left = -1;
+
+    if (submits_failed != (busy ? BUSY_SUBMITS : 1)) {
+        cerr << "The io_uring submissions weren't failed" << endl;
+        return 1;
+    }
+    if (string(trace_reader_name()) != (busy ? "io_uring" : "blocking reads")) {
+        cerr << "The reader uses " << trace_reader_name() << endl;
+        return 1;
+    }
+    for (unsigned int k = 0; k < files.size(); k++) {
+        int t = stoi(files[which[k]].file_path.filename().string().substr(9));
+        if (decoded[k] != 1 || read[k] != contents[t]) {
+            cerr << files[which[k]].file_path << " was decoded " << decoded[k]
+                 << " times" << (read[k] != contents[t] ? ", wrongly" : "")
+                 << endl;
+            return 1;
+        }
+    }
+    if (open_fds() != fds) {
+        cerr << open_fds() - fds << " file descriptors were leaked" << endl;
+        return 1;
+    }
+    cout << "All " << files.size() << " traces were read after the io_uring "
+         << (busy ? "was busy" : "broke") << endl;
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    fail_waits = argc > 1 && string(argv[1]) == "--fail-waits";
+    busy = argc > 1 && string(argv[1]) == "--busy";
+    if (string(trace_reader_name()) != "io_uring") {
+        cout << "No io_uring, so no fall back to check" << endl;
+        return 0;
+    }
+
+    path dir = temp_directory_path() / unique_path();
+    create_directory(dir);
+    int result = check_reader(dir);
+    remove_all(dir);
+
+    return result;
+}